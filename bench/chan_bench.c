@@ -0,0 +1,521 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/chan.h"
+
+// Measures channel throughput and handoff latency. Each case prints one CSV
+// row to stdout under a header row, so results can be collected and compared
+// across releases:
+//
+//   bench,channel,capacity,channels,senders,receivers,messages,seconds,
+//   msgs_per_sec,p50_ns,p99_ns,p999_ns
+//
+// Latency is measured from just before a value is sent until it has been
+// received, using timestamps carried in the values themselves.
+//
+// Usage: chan_bench [-n messages] [-t threads]
+
+// The send and receive calls a case goes through.
+typedef enum
+{
+    PATH_PTR,
+    PATH_INT64,
+    PATH_BUF
+} bench_path_t;
+
+// Payload for the chan_send_buf path, one cache line in size.
+typedef struct
+{
+    uint64_t sent;
+    char     pad[56];
+} bench_buf_t;
+
+typedef struct
+{
+    const char*  bench;
+    const char*  kind;
+    size_t       capacity;
+    bench_path_t path;
+    int          senders;
+    int          receivers;
+    long         messages;
+
+    // Select cases spread messages over several channels, and set cases
+    // also register them in a channel set.
+    chan_t**     chans;
+    int          chan_count;
+    chan_set_t*  set;
+
+    volatile int go;
+} bench_t;
+
+typedef struct
+{
+    bench_t*  bench;
+    int       id;
+    uint64_t* latencies;
+    long      received;
+} bench_worker_t;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static void wait_for_go(bench_t* bench)
+{
+    while (!__atomic_load_n(&bench->go, __ATOMIC_ACQUIRE))
+    {
+        sched_yield();
+    }
+}
+
+static void* sender(void* arg)
+{
+    bench_worker_t* worker = (bench_worker_t*) arg;
+    bench_t* bench = worker->bench;
+    long count = bench->messages / bench->senders;
+    wait_for_go(bench);
+
+    for (long i = 0; i < count; ++i)
+    {
+        chan_t* chan = bench->chans[i % bench->chan_count];
+        uint64_t sent = now_ns();
+        switch (bench->path)
+        {
+            case PATH_PTR:
+                chan_send(chan, (void*) (uintptr_t) sent);
+                break;
+            case PATH_INT64:
+                chan_send_int64(chan, (int64_t) sent);
+                break;
+            case PATH_BUF:
+            {
+                bench_buf_t buf;
+                buf.sent = sent;
+                memset(buf.pad, 0, sizeof(buf.pad));
+                chan_send_buf(chan, &buf, sizeof(buf));
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void* receiver(void* arg)
+{
+    bench_worker_t* worker = (bench_worker_t*) arg;
+    bench_t* bench = worker->bench;
+    chan_t* chan = bench->chans[0];
+    wait_for_go(bench);
+
+    for (;;)
+    {
+        uint64_t sent;
+        int success;
+        if (bench->set)
+        {
+            void* msg;
+            success = chan_set_select_wait(bench->set, &msg) >= 0 ? 0 : -1;
+            sent = (uint64_t) (uintptr_t) msg;
+        }
+        else if (bench->chan_count > 1)
+        {
+            void* msg;
+            success = chan_select_wait(bench->chans, bench->chan_count, &msg,
+                NULL, 0, NULL) >= 0 ? 0 : -1;
+            sent = (uint64_t) (uintptr_t) msg;
+        }
+        else if (bench->path == PATH_PTR)
+        {
+            void* msg;
+            success = chan_recv(chan, &msg);
+            sent = (uint64_t) (uintptr_t) msg;
+        }
+        else if (bench->path == PATH_INT64)
+        {
+            int64_t msg;
+            success = chan_recv_int64(chan, &msg);
+            sent = (uint64_t) msg;
+        }
+        else
+        {
+            bench_buf_t msg;
+            success = chan_recv_buf(chan, &msg, sizeof(msg));
+            sent = msg.sent;
+        }
+
+        if (success != 0)
+        {
+            // Channels are closed once every sender is done.
+            break;
+        }
+        worker->latencies[worker->received++] = now_ns() - sent;
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(uint64_t* sorted, long count, double p)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+    long i = (long) (p * (double) count);
+    return sorted[i < count ? i : count - 1];
+}
+
+// Creates a channel of the given kind. Returns NULL if the kind is unknown or
+// initialization failed.
+static chan_t* make_chan(const char* kind, size_t capacity, size_t elem_size)
+{
+    if (strcmp(kind, "unbuffered") == 0 || strcmp(kind, "buffered") == 0)
+    {
+        return chan_init(capacity);
+    }
+    if (strcmp(kind, "sized") == 0)
+    {
+        return chan_init_sized(capacity, elem_size);
+    }
+    if (strcmp(kind, "spsc") == 0)
+    {
+        return chan_init_flags(capacity, CHAN_SPSC);
+    }
+    if (strcmp(kind, "mpmc") == 0)
+    {
+        return chan_init_flags(capacity, CHAN_MPMC);
+    }
+    if (strcmp(kind, "unbounded") == 0)
+    {
+        return chan_init_unbounded();
+    }
+    return NULL;
+}
+
+// Runs one case and prints its row. Returns 0 on success or -1 if it could
+// not be set up.
+static int run(const char* name, const char* kind, size_t capacity,
+    bench_path_t path, int chan_count, int senders, int receivers,
+    long messages)
+{
+    size_t elem_size = path == PATH_BUF ? sizeof(bench_buf_t) : sizeof(int64_t);
+    bench_t bench = {name, kind, capacity, path, senders, receivers,
+        messages - messages % senders, NULL, chan_count, NULL, 0};
+    bench.chans = (chan_t**) calloc(chan_count, sizeof(chan_t*));
+    bench_worker_t* workers = (bench_worker_t*) calloc(senders + receivers,
+        sizeof(bench_worker_t));
+    pthread_t* threads = (pthread_t*) calloc(senders + receivers,
+        sizeof(pthread_t));
+    if (!bench.chans || !workers || !threads)
+    {
+        free(bench.chans);
+        free(workers);
+        free(threads);
+        return -1;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < chan_count; ++i)
+    {
+        bench.chans[i] = make_chan(kind, capacity, elem_size);
+        failed |= bench.chans[i] == NULL;
+    }
+    if (strcmp(name, "set") == 0 && !failed)
+    {
+        bench.set = chan_set_init(chan_count);
+        for (int i = 0; bench.set && i < chan_count; ++i)
+        {
+            chan_set_add(bench.set, bench.chans[i]);
+        }
+        failed |= bench.set == NULL;
+    }
+
+    for (int i = 0; i < senders + receivers && !failed; ++i)
+    {
+        workers[i].bench = &bench;
+        workers[i].id = i;
+        if (i >= senders)
+        {
+            workers[i].latencies = (uint64_t*) malloc(
+                bench.messages * sizeof(uint64_t));
+            failed |= workers[i].latencies == NULL;
+        }
+    }
+
+    if (failed)
+    {
+        fprintf(stderr, "%s/%s: setup failed: %s\n", name, kind,
+            strerror(errno));
+        for (int i = 0; i < chan_count; ++i)
+        {
+            if (bench.chans[i])
+            {
+                chan_dispose(bench.chans[i]);
+            }
+        }
+        for (int i = senders; i < senders + receivers; ++i)
+        {
+            free(workers[i].latencies);
+        }
+        free(bench.chans);
+        free(workers);
+        free(threads);
+        return -1;
+    }
+
+    for (int i = 0; i < senders + receivers; ++i)
+    {
+        pthread_create(&threads[i], NULL, i < senders ? sender : receiver,
+            &workers[i]);
+    }
+
+    uint64_t start = now_ns();
+    __atomic_store_n(&bench.go, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < senders; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < chan_count; ++i)
+    {
+        chan_close(bench.chans[i]);
+    }
+    for (int i = senders; i < senders + receivers; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    double seconds = (double) (now_ns() - start) / 1e9;
+
+    // Merge the receivers' samples into the first receiver's buffer.
+    uint64_t* all = workers[senders].latencies;
+    long count = workers[senders].received;
+    for (int i = senders + 1; i < senders + receivers; ++i)
+    {
+        memcpy(&all[count], workers[i].latencies,
+            workers[i].received * sizeof(uint64_t));
+        count += workers[i].received;
+    }
+    qsort(all, count, sizeof(uint64_t), cmp_u64);
+
+    printf("%s,%s,%zu,%d,%d,%d,%ld,%.6f,%.0f,%llu,%llu,%llu\n", name, kind,
+        capacity, chan_count, senders, receivers, count, seconds,
+        (double) count / seconds,
+        (unsigned long long) percentile(all, count, 0.50),
+        (unsigned long long) percentile(all, count, 0.99),
+        (unsigned long long) percentile(all, count, 0.999));
+    fflush(stdout);
+
+    if (bench.set)
+    {
+        chan_set_dispose(bench.set);
+    }
+    for (int i = 0; i < chan_count; ++i)
+    {
+        chan_dispose(bench.chans[i]);
+    }
+    for (int i = senders; i < senders + receivers; ++i)
+    {
+        free(workers[i].latencies);
+    }
+    free(bench.chans);
+    free(workers);
+    free(threads);
+    return 0;
+}
+
+// A pool job: reports how long ago it was sent.
+static void* pool_job(void* job)
+{
+    return (void*) (uintptr_t) (now_ns() - (uint64_t) (uintptr_t) job);
+}
+
+typedef struct
+{
+    chan_pool_t*  pool;
+    long          count;
+    volatile int* go;
+} pool_sender_t;
+
+static void* pool_sender(void* arg)
+{
+    pool_sender_t* sender = (pool_sender_t*) arg;
+    while (!__atomic_load_n(sender->go, __ATOMIC_ACQUIRE))
+    {
+        sched_yield();
+    }
+    for (long i = 0; i < sender->count; ++i)
+    {
+        chan_pool_send(sender->pool, (void*) (uintptr_t) now_ns());
+    }
+    return NULL;
+}
+
+// Runs the fan-out case on a work-stealing pool instead of a shared channel
+// and prints its row. The jobs report their own latency as results, which
+// are collected once every job has run. Returns 0 on success or -1 if it
+// could not be set up.
+static int run_pool(int senders, int workers, long messages)
+{
+    messages -= messages % senders;
+    chan_pool_t* pool = chan_pool_init(workers, pool_job, CHAN_POOL_RESULTS);
+    uint64_t* all = (uint64_t*) malloc(messages * sizeof(uint64_t));
+    pool_sender_t* args = (pool_sender_t*) calloc(senders,
+        sizeof(pool_sender_t));
+    pthread_t* threads = (pthread_t*) calloc(senders, sizeof(pthread_t));
+    if (!pool || !all || !args || !threads)
+    {
+        fprintf(stderr, "pool: setup failed: %s\n", strerror(errno));
+        if (pool)
+        {
+            chan_pool_dispose(pool);
+        }
+        free(all);
+        free(args);
+        free(threads);
+        return -1;
+    }
+
+    volatile int go = 0;
+    for (int i = 0; i < senders; ++i)
+    {
+        args[i].pool = pool;
+        args[i].count = messages / senders;
+        args[i].go = &go;
+        pthread_create(&threads[i], NULL, pool_sender, &args[i]);
+    }
+
+    uint64_t start = now_ns();
+    __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < senders; ++i)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    chan_pool_close(pool);
+    long count = 0;
+    void* result;
+    while (chan_pool_recv(pool, &result) == 0)
+    {
+        all[count++] = (uint64_t) (uintptr_t) result;
+    }
+    double seconds = (double) (now_ns() - start) / 1e9;
+    qsort(all, count, sizeof(uint64_t), cmp_u64);
+
+    printf("ptr,pool,%d,1,%d,%d,%ld,%.6f,%.0f,%llu,%llu,%llu\n",
+        CHAN_POOL_DEQUE_SIZE, senders, workers, count, seconds,
+        (double) count / seconds,
+        (unsigned long long) percentile(all, count, 0.50),
+        (unsigned long long) percentile(all, count, 0.99),
+        (unsigned long long) percentile(all, count, 0.999));
+    fflush(stdout);
+
+    chan_pool_dispose(pool);
+    free(all);
+    free(args);
+    free(threads);
+    return 0;
+}
+
+int main(int argc, char* argv[])
+{
+    long messages = 100000;
+    int threads = 4;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+        {
+            messages = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+        {
+            threads = atoi(argv[++i]);
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [-n messages] [-t threads]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (messages < threads || threads < 1)
+    {
+        fprintf(stderr, "need at least one thread and one message each\n");
+        return 1;
+    }
+
+    printf("bench,channel,capacity,channels,senders,receivers,messages,"
+        "seconds,msgs_per_sec,p50_ns,p99_ns,p999_ns\n");
+
+    // Thread topologies: 1:1, N:1, 1:N and N:M.
+    int topologies[4][2] = {
+        {1, 1}, {threads, 1}, {1, threads}, {threads, threads}
+    };
+    struct
+    {
+        const char* kind;
+        size_t      capacity;
+    } chans[] = {
+        {"unbuffered", 0},
+        {"buffered", 1},
+        {"buffered", 16},
+        {"buffered", 1024},
+        {"mpmc", 1024},
+        {"unbounded", 0},
+    };
+    int chan_kinds = sizeof(chans) / sizeof(chans[0]);
+
+    for (int c = 0; c < chan_kinds; ++c)
+    {
+        for (int t = 0; t < 4; ++t)
+        {
+            run("ptr", chans[c].kind, chans[c].capacity, PATH_PTR, 1,
+                topologies[t][0], topologies[t][1], messages);
+        }
+    }
+    run("ptr", "spsc", 1024, PATH_PTR, 1, 1, 1, messages);
+
+    // Fan-out to a work-stealing pool, to compare with the 1:N and N:M
+    // cases on a single shared channel.
+    run_pool(1, threads, messages);
+    run_pool(threads, threads, messages);
+
+    // Typed paths, boxed on regular channels and by value on sized ones.
+    const char* typed[] = {"unbuffered", "buffered", "sized"};
+    for (int c = 0; c < 3; ++c)
+    {
+        size_t capacity = strcmp(typed[c], "unbuffered") == 0 ? 0 : 1024;
+        run("int64", typed[c], capacity, PATH_INT64, 1, 1, 1, messages);
+        run("int64", typed[c], capacity, PATH_INT64, 1, threads, threads,
+            messages);
+        run("buf", typed[c], capacity, PATH_BUF, 1, 1, 1, messages);
+        run("buf", typed[c], capacity, PATH_BUF, 1, threads, threads,
+            messages);
+    }
+
+    // Select cost grows with the number of channels, so fewer messages are
+    // sent through the larger selects. Channel sets run the same cases to
+    // show their cost does not.
+    int select_counts[] = {2, 10, 100, 1000};
+    for (int i = 0; i < 4; ++i)
+    {
+        long n = messages * 10 / select_counts[i];
+        n = n > messages ? messages : n < 1000 ? 1000 : n;
+        run("select", "buffered", 16, PATH_PTR, select_counts[i], 1, 1, n);
+        run("set", "buffered", 16, PATH_PTR, select_counts[i], 1, 1, n);
+    }
+
+    return 0;
+}
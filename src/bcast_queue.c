@@ -0,0 +1,111 @@
+#define _GNU_SOURCE
+
+#ifdef __APPLE__
+#define _XOPEN_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "bcast_queue.h"
+
+// Allocates and returns a new queue. The capacity is rounded up to the next
+// power of two and must be at least 2. Returns NULL and sets errno if
+// initialization failed.
+bcast_queue_t* bcast_queue_init(size_t capacity)
+{
+    if (capacity < 2 || capacity > SIZE_MAX / 2 / sizeof(bcast_queue_slot_t))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t size = 2;
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+
+    bcast_queue_t* queue = (bcast_queue_t*) malloc(sizeof(bcast_queue_t));
+    bcast_queue_slot_t* slots = (bcast_queue_slot_t*) calloc(size,
+        sizeof(bcast_queue_slot_t));
+    if (!queue || !slots)
+    {
+        free(queue);
+        free(slots);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    queue->tail = 0;
+    queue->capacity = size;
+    queue->mask = size - 1;
+    queue->slots = slots;
+    return queue;
+}
+
+// Releases the queue resources.
+void bcast_queue_dispose(bcast_queue_t* queue)
+{
+    free(queue->slots);
+    free(queue);
+}
+
+// Publishes a value under the next sequence number, overwriting the value
+// published capacity values earlier. Must only be called by the producer.
+void bcast_queue_publish(bcast_queue_t* queue, void* value)
+{
+    size_t tail = queue->tail;
+    bcast_queue_slot_t* slot = &queue->slots[tail & queue->mask];
+
+    // Readers that lag behind check seq on both sides of reading the value,
+    // so they notice if it was replaced in between.
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&slot->value, value, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->seq, tail + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Reads the value with sequence number seq into value. Returns 1 if it was
+// read, 0 if it has not been published yet or -1 if it has already been
+// overwritten. May be called by any thread.
+int bcast_queue_read(bcast_queue_t* queue, size_t seq, void** value)
+{
+    bcast_queue_slot_t* slot = &queue->slots[seq & queue->mask];
+    for (;;)
+    {
+        size_t before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (before == seq + 1)
+        {
+            void* read = __atomic_load_n(&slot->value, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq + 1)
+            {
+                *value = read;
+                return 1;
+            }
+            return -1;
+        }
+        if (before > seq + 1)
+        {
+            return -1;
+        }
+
+        // The slot holds an older value or is being written. The tail tells
+        // whether that write is of seq itself or of a value replacing it.
+        size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+        if (tail <= seq)
+        {
+            return 0;
+        }
+        if (tail - seq > queue->capacity ||
+            (tail - seq == queue->capacity && before == 0))
+        {
+            return -1;
+        }
+
+        // seq was published after we looked at its slot, look again.
+    }
+}
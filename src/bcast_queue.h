@@ -0,0 +1,53 @@
+#ifndef bcast_queue_h
+#define bcast_queue_h
+
+#include <stddef.h>
+
+#include "spsc_queue.h"
+
+// A slot of a bcast_queue_t. seq is one more than the sequence number of the
+// value held, or 0 while the slot is empty or being overwritten.
+typedef struct bcast_queue_slot_t
+{
+    size_t seq;
+    void*  value;
+} bcast_queue_slot_t;
+
+// Defines a sequence-numbered ring for broadcasting values from one producer
+// to any number of readers, each of which keeps its own position. Values are
+// written once and stay in place until the producer wraps around to their
+// slot, so every reader sees every value without copying. The queue does not
+// stop the producer from overwriting values a reader still needs; that is up
+// to the caller, but readers can always tell when it has happened.
+typedef struct bcast_queue_t
+{
+    char                pad0[CHAN_CACHE_LINE];
+
+    // Producer-owned, read by readers.
+    size_t              tail;
+    char                pad1[CHAN_CACHE_LINE - sizeof(size_t)];
+
+    // Read-only after initialization.
+    size_t              capacity;
+    size_t              mask;
+    bcast_queue_slot_t* slots;
+} bcast_queue_t;
+
+// Allocates and returns a new queue. The capacity is rounded up to the next
+// power of two and must be at least 2. Returns NULL and sets errno if
+// initialization failed.
+bcast_queue_t* bcast_queue_init(size_t capacity);
+
+// Releases the queue resources.
+void bcast_queue_dispose(bcast_queue_t* queue);
+
+// Publishes a value under the next sequence number, overwriting the value
+// published capacity values earlier. Must only be called by the producer.
+void bcast_queue_publish(bcast_queue_t* queue, void* value);
+
+// Reads the value with sequence number seq into value. Returns 1 if it was
+// read, 0 if it has not been published yet or -1 if it has already been
+// overwritten. May be called by any thread.
+int bcast_queue_read(bcast_queue_t* queue, size_t seq, void** value);
+
+#endif
@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+
+#ifdef __APPLE__
+#define _XOPEN_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "byte_queue.h"
+
+// Size of the length header in front of every record.
+#define BYTE_QUEUE_HEADER 8
+
+// Header value marking a padding record which runs to the end of the buffer.
+#define BYTE_QUEUE_PAD UINT64_MAX
+
+// Returns the number of bytes a record holding a len-byte message takes up.
+static inline size_t byte_queue_record(size_t len)
+{
+    return BYTE_QUEUE_HEADER + ((len + 7) & ~(size_t) 7);
+}
+
+static inline uint64_t* byte_queue_header(byte_queue_t* queue, size_t pos)
+{
+    return (uint64_t*) (queue->data + pos % queue->capacity);
+}
+
+// Returns the number of bytes that must be free to reserve a len-byte message
+// at tail, counting any padding needed to wrap around.
+static size_t byte_queue_needed(byte_queue_t* queue, size_t tail, size_t len)
+{
+    size_t record = byte_queue_record(len);
+    size_t contiguous = queue->capacity - tail % queue->capacity;
+    return record <= contiguous ? record : contiguous + record;
+}
+
+// Allocates and returns a new queue holding up to capacity bytes of messages
+// and headers. The capacity is rounded up to a multiple of 8. Returns NULL
+// and sets errno if initialization failed.
+byte_queue_t* byte_queue_init(size_t capacity)
+{
+    if (capacity < 2 * BYTE_QUEUE_HEADER || capacity > SIZE_MAX / 2)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    capacity = (capacity + 7) & ~(size_t) 7;
+
+    byte_queue_t* queue = (byte_queue_t*) malloc(sizeof(byte_queue_t));
+    char*         data  = (char*) malloc(capacity);
+    if (!queue || !data)
+    {
+        free(queue);
+        free(data);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    queue->head = 0;
+    queue->tail = 0;
+    queue->reserved = 0;
+    queue->capacity = capacity;
+    queue->data = data;
+    return queue;
+}
+
+// Releases the queue resources.
+void byte_queue_dispose(byte_queue_t* queue)
+{
+    free(queue->data);
+    free(queue);
+}
+
+// Returns non-zero if byte_queue_reserve would succeed for a len-byte
+// message, or if the queue is empty and would have room for it once rewound
+// with byte_queue_rewind. May be called by any thread.
+int byte_queue_fits(byte_queue_t* queue, size_t len)
+{
+    if (len > queue->capacity || byte_queue_record(len) > queue->capacity)
+    {
+        return 0;
+    }
+
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    return head == tail ||
+        queue->capacity - (tail - head) >= byte_queue_needed(queue, tail, len);
+}
+
+// Reserves contiguous room for a message of up to len bytes and returns a
+// pointer to it. Must only be called by the producer. Returns NULL if there is
+// not enough room, with errno set to EAGAIN, or if the message can never fit,
+// with errno set to EMSGSIZE. A message that would straddle the end of the
+// buffer needs room for the padding in front of it as well, which even an
+// empty queue may not have; see byte_queue_rewind.
+void* byte_queue_reserve(byte_queue_t* queue, size_t len)
+{
+    if (len > queue->capacity ||
+        byte_queue_record(len) > queue->capacity)
+    {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    size_t tail = queue->tail;
+    if (queue->capacity - (tail - head) < byte_queue_needed(queue, tail, len))
+    {
+        errno = EAGAIN;
+        return NULL;
+    }
+
+    size_t contiguous = queue->capacity - tail % queue->capacity;
+    if (byte_queue_record(len) > contiguous)
+    {
+        // Pad out the end of the buffer and start the message at the front.
+        *byte_queue_header(queue, tail) = BYTE_QUEUE_PAD;
+        tail += contiguous;
+        __atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    queue->reserved = len;
+    return queue->data + tail % queue->capacity + BYTE_QUEUE_HEADER;
+}
+
+// Publishes the reserved message with its final length, which must not
+// exceed the reserved length. Must only be called by the producer. Returns 0
+// if the message was published or -1 if len is too long.
+int byte_queue_commit(byte_queue_t* queue, size_t len)
+{
+    if (len > queue->reserved)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t tail = queue->tail;
+    *byte_queue_header(queue, tail) = len;
+    __atomic_store_n(&queue->tail, tail + byte_queue_record(len),
+        __ATOMIC_RELEASE);
+    queue->reserved = 0;
+    return 0;
+}
+
+// Returns a pointer to the oldest message and stores its length in len,
+// without removing it. Must only be called by the consumer. Returns NULL if
+// the queue is empty.
+const void* byte_queue_peek(byte_queue_t* queue, size_t* len)
+{
+    size_t head = queue->head;
+    for (;;)
+    {
+        if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE))
+        {
+            return NULL;
+        }
+
+        uint64_t header = *byte_queue_header(queue, head);
+        if (header != BYTE_QUEUE_PAD)
+        {
+            *len = (size_t) header;
+            return queue->data + head % queue->capacity + BYTE_QUEUE_HEADER;
+        }
+
+        // Skip the padding at the end of the buffer.
+        head += queue->capacity - head % queue->capacity;
+        __atomic_store_n(&queue->head, head, __ATOMIC_RELEASE);
+    }
+}
+
+// Moves the head and tail of an empty queue forward to the start of the
+// buffer, so a message of up to the full capacity fits without padding. Must
+// only be called by a thread that holds off both the producer and the
+// consumer. Returns 0 if the queue was rewound or -1 if it is not empty.
+int byte_queue_rewind(byte_queue_t* queue)
+{
+    size_t tail = queue->tail;
+    if (queue->head != tail)
+    {
+        return -1;
+    }
+
+    size_t offset = tail % queue->capacity;
+    if (offset != 0)
+    {
+        // Readers without a role load head before tail, so moving tail first
+        // keeps byte_queue_used from going negative.
+        tail += queue->capacity - offset;
+        __atomic_store_n(&queue->tail, tail, __ATOMIC_RELEASE);
+        __atomic_store_n(&queue->head, tail, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+// Removes the oldest message, which must have been returned by
+// byte_queue_peek. Must only be called by the consumer.
+void byte_queue_consume(byte_queue_t* queue)
+{
+    size_t head = queue->head;
+    size_t len = (size_t) *byte_queue_header(queue, head);
+    __atomic_store_n(&queue->head, head + byte_queue_record(len),
+        __ATOMIC_RELEASE);
+}
+
+// Returns the number of bytes in use, including headers and padding. The
+// result is a snapshot and may be stale by the time it is used.
+size_t byte_queue_used(byte_queue_t* queue)
+{
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    return tail - head;
+}
@@ -0,0 +1,80 @@
+#ifndef byte_queue_h
+#define byte_queue_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "spsc_queue.h"
+
+// Defines a circular buffer of variable-length messages for one producer
+// and one consumer at a time. Messages are written and read in place: the
+// producer reserves contiguous room, fills it and commits it, and the consumer
+// peeks at the oldest message and then consumes it. Each message is preceded
+// by an 8-byte length header and padded to a multiple of 8 bytes, so payloads
+// are 8-byte aligned. A message that would straddle the end of the buffer is
+// placed at the front instead, behind a padding record covering the unused
+// tail.
+typedef struct byte_queue_t
+{
+    char     pad0[CHAN_CACHE_LINE];
+
+    // Consumer-owned.
+    size_t   head;
+    char     pad1[CHAN_CACHE_LINE - sizeof(size_t)];
+
+    // Producer-owned.
+    size_t   tail;
+    size_t   reserved;
+    char     pad2[CHAN_CACHE_LINE - 2 * sizeof(size_t)];
+
+    // Read-only after initialization.
+    size_t   capacity;
+    char*    data;
+} byte_queue_t;
+
+// Allocates and returns a new queue holding up to capacity bytes of messages
+// and headers. The capacity is rounded up to a multiple of 8. Returns NULL
+// and sets errno if initialization failed.
+byte_queue_t* byte_queue_init(size_t capacity);
+
+// Releases the queue resources.
+void byte_queue_dispose(byte_queue_t* queue);
+
+// Returns non-zero if byte_queue_reserve would succeed for a len-byte
+// message, or if the queue is empty and would have room for it once rewound
+// with byte_queue_rewind. May be called by any thread.
+int byte_queue_fits(byte_queue_t* queue, size_t len);
+
+// Reserves contiguous room for a message of up to len bytes and returns a
+// pointer to it. Must only be called by the producer. Returns NULL if there is
+// not enough room, with errno set to EAGAIN, or if the message can never fit,
+// with errno set to EMSGSIZE. A message that would straddle the end of the
+// buffer needs room for the padding in front of it as well, which even an
+// empty queue may not have; see byte_queue_rewind.
+void* byte_queue_reserve(byte_queue_t* queue, size_t len);
+
+// Publishes the reserved message with its final length, which must not
+// exceed the reserved length. Must only be called by the producer. Returns 0
+// if the message was published or -1 if len is too long.
+int byte_queue_commit(byte_queue_t* queue, size_t len);
+
+// Returns a pointer to the oldest message and stores its length in len,
+// without removing it. Must only be called by the consumer. Returns NULL if
+// the queue is empty.
+const void* byte_queue_peek(byte_queue_t* queue, size_t* len);
+
+// Moves the head and tail of an empty queue forward to the start of the
+// buffer, so a message of up to the full capacity fits without padding. Must
+// only be called by a thread that holds off both the producer and the
+// consumer. Returns 0 if the queue was rewound or -1 if it is not empty.
+int byte_queue_rewind(byte_queue_t* queue);
+
+// Removes the oldest message, which must have been returned by
+// byte_queue_peek. Must only be called by the consumer.
+void byte_queue_consume(byte_queue_t* queue);
+
+// Returns the number of bytes in use, including headers and padding. The
+// result is a snapshot and may be stale by the time it is used.
+size_t byte_queue_used(byte_queue_t* queue);
+
+#endif
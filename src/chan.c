@@ -6,9 +6,11 @@
 #endif
 
 #include <errno.h>
+#include <limits.h>
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sched.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -20,8 +22,21 @@
 #include <mach/mach.h>
 #endif
 
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "chan.h"
+#include "bcast_queue.h"
 #include "queue.h"
+#include "mpmc_queue.h"
+#include "prio_queue.h"
+#include "seg_queue.h"
+#include "spsc_queue.h"
 
 #ifdef _WIN32
 #include <windows.h>
@@ -38,17 +53,308 @@ static int clock_gettime (int __attribute__((__unused__)) clockid, struct timesp
 }
 #endif
 
-static int buffered_chan_init(chan_t* chan, size_t capacity);
-static int buffered_chan_send(chan_t* chan, void* data);
-static int buffered_chan_recv(chan_t* chan, void** data);
+#ifdef CHAN_FUTEX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// Blocked threads park on futex words embedded in the channel rather than on
+// condition variables.
+typedef chan_futex_t chan_cond_t;
+#else
+typedef pthread_cond_t chan_cond_t;
+#endif
+
+// Returns what receivers blocked on the channel wait on.
+static inline chan_cond_t* chan_r_cond(chan_t* chan)
+{
+#ifdef CHAN_FUTEX
+    return &chan->r_futex;
+#else
+    return &chan->r_cond;
+#endif
+}
+
+// Returns what senders blocked on the channel wait on.
+static inline chan_cond_t* chan_w_cond(chan_t* chan)
+{
+#ifdef CHAN_FUTEX
+    return &chan->w_futex;
+#else
+    return &chan->w_cond;
+#endif
+}
+
+// Number of enqueue times kept for an unbounded channel with statistics
+// enabled. Values that have more than this many others queued behind them by
+// the time they are received are left out of the latency histogram.
+#define CHAN_STATS_STAMPS 1024
+
+// Statistics collected for a channel once chan_stats_enable has been called.
+// The counters are only updated with relaxed atomics so chan_stats can read
+// them without locking. Mutex-guarded buffered channels also remember when
+// each queued value was added, in a ring of stamps indexed by the number of
+// values added so far, which is protected by m_mu.
+typedef struct chan_stats_state_t
+{
+    chan_stats_t counters;
+    uint64_t     enqueued;
+    uint64_t     dequeued;
+    size_t       stamp_count;
+    uint64_t     stamps[];
+} chan_stats_state_t;
+
+// Marks a shared-memory channel mapping as initialized. The low byte is a
+// layout version, bumped whenever chan_shm_t changes.
+#define CHAN_SHM_MAGIC 0x6368616e01ull
+
+// Offset of the element ring from the start of a shared-memory mapping.
+#define CHAN_SHM_HEADER \
+    ((sizeof(chan_shm_t) + CHAN_CACHE_LINE - 1) & ~(size_t) (CHAN_CACHE_LINE - 1))
+
+// Header of a channel mapped into several processes by chan_open_shm. It is
+// followed by a circular buffer of capacity elements of elem_size bytes,
+// stored inline, and holds only offsets, never pointers, so every process can
+// map it at a different address. The mutex and condition variables are
+// process-shared.
+typedef struct chan_shm_t
+{
+    uint64_t        magic;
+    size_t          map_size;
+    size_t          capacity;
+    size_t          elem_size;
+    pthread_mutex_t mu;
+    pthread_cond_t  r_cond;
+    pthread_cond_t  w_cond;
+    int             closed;
+    int             r_waiting;
+    int             w_waiting;
+    size_t          head;
+    size_t          size;
+} chan_shm_t;
+
+// A thread blocked in chan_select_wait. The waiter is linked into the select
+// list of every channel involved and is woken by the first channel that
+// changes state in a way that could let one of its operations proceed. On
+// unbuffered channels it also queues a chan_waiter_t per case, and the first
+// thread to pair with one of them claims the select by setting selected to
+// that case's index.
+typedef struct select_waiter_t
+{
+    pthread_mutex_t mu;
+    chan_cond_t     cond;
+    int             signaled;
+    int             selected;
+} select_waiter_t;
+
+typedef struct select_link_t
+{
+    select_waiter_t*      waiter;
+    struct select_link_t* prev;
+    struct select_link_t* next;
+} select_link_t;
+
+// A thread blocked on an unbuffered channel. Senders queue on w_head and
+// receivers on r_head in arrival order, and each parks on its own condition,
+// so the thread that pairs with a waiter wakes that one thread only. data is
+// the value of a sender, or where a receiver wants its value stored. The
+// pairing thread copies the value and sets done, both under m_mu. A waiter
+// queued by a blocked select has select set instead of a condition, and is
+// only paired if the select has not been claimed through another case. A
+// select sender's data points to its slot in the caller's array instead, which
+// is only read once the send is paired.
+typedef struct chan_waiter_t
+{
+    void*                   data;
+    uint64_t                published;
+    int                     done;
+    int                     queued;
+    chan_cond_t             cond;
+    struct select_waiter_t* select;
+    int                     index;
+    struct chan_waiter_t*   prev;
+    struct chan_waiter_t*   next;
+} chan_waiter_t;
+
+// A chan_set_t. Senders set a channel's bit in ready whenever a receive on it
+// may have become possible, and selects clear the bits of the channels they
+// try, so a select only visits channels that were marked. Channels found
+// closed and empty are recorded in done instead. The slots are fixed at
+// creation so the bitmaps never move under concurrent senders; mu only guards
+// membership changes and parking.
+struct chan_set_t
+{
+    pthread_mutex_t mu;
+    chan_cond_t     cond;
+    int             waiting;
+    chan_t**        chans;
+    int             capacity;
+    int             count;
+    int             done_count;
+    int             words;
+    int             cursor;
+    uint64_t*       ready;
+    uint64_t*       done;
+};
+
+// A chan_bcast_t. The producer only needs to know the position of the slowest
+// subscriber that must not miss values, and keeps it cached in gate so it
+// rescans the subscribers only when the ring looks full. w_mu serializes
+// senders; m_mu guards the subscriber list and parking.
+struct chan_bcast_t
+{
+    bcast_queue_t*   ring;
+    pthread_mutex_t  w_mu;
+    pthread_mutex_t  m_mu;
+    chan_cond_t      r_cond;
+    chan_cond_t      w_cond;
+    int              r_waiting;
+    int              w_waiting;
+    int              closed;
+    size_t           gate;
+    chan_sub_t**     subs;
+    int              sub_count;
+    int              sub_capacity;
+};
+
+// A subscriber of a chan_bcast_t, reading at its own position. next is only
+// written by the subscriber and read by the producer to gate the ring.
+struct chan_sub_t
+{
+    chan_bcast_t*    bcast;
+    size_t           next;
+    int              flags;
+    uint64_t         dropped;
+};
+
+// Channels disposed of on a thread and kept for chan_init to reuse, see
+// chan_cache_enable.
+typedef struct chan_cache_t
+{
+    int              count;
+    chan_t*          chans[CHAN_CACHE_MAX];
+} chan_cache_t;
+
+// Number of channels each thread may cache, 0 while caching is disabled.
+static int chan_cache_limit = 0;
+static pthread_once_t chan_cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t chan_cache_key;
+
+static chan_t* plain_chan_init(size_t capacity);
+static void chan_destroy(chan_t* chan);
+static chan_t* chan_cache_take(size_t capacity);
+static int chan_cache_put(chan_t* chan);
+static void chan_cache_key_init(void);
+
+static int buffered_chan_init(chan_t* chan, size_t capacity,
+    const chan_mem_t* mem);
+static int unbounded_chan_init(chan_t* chan);
+static int prio_chan_init(chan_t* chan, size_t capacity, int levels);
+static int buffered_chan_send(chan_t* chan, void* data, int level,
+    const struct timespec* deadline);
+static int buffered_chan_recv(chan_t* chan, void** data,
+    const struct timespec* deadline);
+
+static int ring_chan_init(chan_t* chan, size_t capacity, int flags,
+    const chan_mem_t* mem);
+static int ring_chan_send(chan_t* chan, void* data,
+    const struct timespec* deadline);
+static int ring_chan_recv(chan_t* chan, void** data,
+    const struct timespec* deadline);
+static void ring_chan_wake(chan_t* chan, int* waiting, chan_cond_t* cond,
+    select_link_t** select, int all);
+static inline int ring_push(chan_t* chan, void* data);
+static inline int ring_pop(chan_t* chan, void** data);
 
 static int unbuffered_chan_init(chan_t* chan);
-static int unbuffered_chan_send(chan_t* chan, void* data);
-static int unbuffered_chan_recv(chan_t* chan, void** data);
+static int unbuffered_chan_send(chan_t* chan, void* data,
+    const struct timespec* deadline);
+static int unbuffered_chan_recv(chan_t* chan, void** data,
+    const struct timespec* deadline);
+static int unbuffered_chan_wait(chan_t* chan, chan_waiter_t* waiter, int send,
+    const struct timespec* deadline);
+static void unbuffered_chan_give(chan_t* chan, chan_waiter_t* receiver,
+    void* data);
+static void* unbuffered_chan_take(chan_t* chan, chan_waiter_t* sender);
+static void unbuffered_chan_copy(chan_t* chan, void* dst, void* value);
+static void chan_waiter_push(chan_waiter_t** head, chan_waiter_t** tail,
+    chan_waiter_t* waiter);
+static chan_waiter_t* chan_waiter_pop(chan_t* chan, int send);
+static void chan_waiter_unlink(chan_waiter_t** head, chan_waiter_t** tail,
+    chan_waiter_t* waiter);
+static void chan_waiter_wake(chan_waiter_t* waiter);
+static inline void chan_waiting_add(int* waiting, int n);
+
+static int buffered_chan_overflow(chan_t* chan, void* data, int level,
+    void** dropped);
+static void chan_drop(chan_t* chan, void* value);
+static int ring_chan_overflow(chan_t* chan, void* data);
+static int buffered_chan_send_many(chan_t* chan, void* data[], int count);
+static int buffered_chan_recv_many(chan_t* chan, void* data[], int count,
+    int block);
+static int ring_chan_send_many(chan_t* chan, void* data[], int count);
+static int ring_chan_recv_many(chan_t* chan, void* data[], int count,
+    int block);
+static int chan_recv_many_impl(chan_t* chan, void* data[], int count,
+    int block);
+static int chan_select_try_recv(chan_t* chan, void** data);
+static int chan_select_try_send(chan_t* chan, void** data);
+static int sized_chan_send(chan_t* chan, const void* elem);
+static int sized_chan_recv(chan_t* chan, void* elem);
+static int shm_chan_init(chan_shm_t* shm, size_t map_size, size_t capacity,
+    size_t elem_size);
+static int shm_chan_attach(chan_shm_t* shm, size_t capacity,
+    size_t elem_size);
+static void shm_chan_lock(chan_shm_t* shm);
+static int shm_chan_send(chan_t* chan, const void* elem);
+static int shm_chan_recv(chan_t* chan, void* elem);
+static int shm_chan_close(chan_t* chan);
+
+static int chan_send_deadline(chan_t* chan, void* data,
+    const struct timespec* deadline);
+static int chan_recv_deadline(chan_t* chan, void** data,
+    const struct timespec* deadline);
+static void chan_deadline(struct timespec* deadline,
+    const struct timespec* timeout);
+static int chan_cond_init(chan_cond_t* cond);
+static void chan_cond_destroy(chan_cond_t* cond);
+static int chan_cond_wait(chan_cond_t* cond, pthread_mutex_t* mu,
+    const struct timespec* deadline);
+static void chan_cond_signal(chan_cond_t* cond);
+static void chan_cond_broadcast(chan_cond_t* cond);
+static int chan_mutex_lock(pthread_mutex_t* mu,
+    const struct timespec* deadline);
+static int chan_spin(chan_t* chan, int (*ready)(chan_t*),
+    const struct timespec* deadline);
+static int buffered_chan_can_send(chan_t* chan);
+static int buffered_chan_can_recv(chan_t* chan);
+static int ring_chan_can_send(chan_t* chan);
+static int ring_chan_can_recv(chan_t* chan);
+
+static int chan_park(chan_t* chan, chan_cond_t* cond,
+    const struct timespec* deadline);
+static int chan_park_side(chan_t* chan, chan_cond_t* cond,
+    const struct timespec* deadline, int send);
+static void chan_stats_enqueued(chan_t* chan, int n);
+static void chan_stats_evicted(chan_t* chan);
+static void chan_stats_dequeued(chan_t* chan, int n);
+static void chan_stats_ring_pushed(chan_t* chan);
+static void chan_stats_ring_popped(chan_t* chan);
+static uint64_t chan_stats_stamp(chan_t* chan);
+static void chan_stats_handed_off(chan_t* chan, uint64_t published);
+static void chan_stats_delivered(chan_t* chan, uint64_t published);
+static size_t buffered_chan_size(chan_t* chan);
+static void chan_fd_set(chan_t* chan);
+static void chan_fd_clear(chan_t* chan);
+static void chan_ready(chan_t* chan);
+static void chan_set_mark(chan_set_t* set, int index);
+static int chan_set_select_impl(chan_set_t* set, void** recv_out, int block,
+    const struct timespec* deadline);
 
-static int chan_can_recv(chan_t* chan);
-static int chan_can_send(chan_t* chan);
+static void chan_notify_select(select_link_t* list);
 static int chan_is_buffered(chan_t* chan);
+static int chan_is_ring(chan_t* chan);
+static size_t chan_ring_size(chan_t* chan);
+static size_t chan_ring_capacity(chan_t* chan);
 
 void current_utc_time(struct timespec *ts) {
 #ifdef __MACH__ 
@@ -64,443 +370,4506 @@ void current_utc_time(struct timespec *ts) {
 #endif
 }
 
-// Allocates and returns a new channel. The capacity specifies whether the
-// channel should be buffered or not. A capacity of 0 will create an unbuffered
-// channel. Sets errno and returns NULL if initialization failed.
-chan_t* chan_init(size_t capacity)
+// Reads the clock that channel deadlines are measured against. This is the
+// monotonic clock where condition variables can be bound to it, so deadlines
+// are not affected by changes to the system time.
+static void chan_clock_now(struct timespec* ts)
 {
-    chan_t* chan = (chan_t*) malloc(sizeof(chan_t));
-    if (!chan)
+#if defined(__MACH__) || defined(_WIN32)
+    current_utc_time(ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, ts);
+#endif
+}
+
+// Sets deadline to the absolute time that is timeout from now.
+static void chan_deadline(struct timespec* deadline,
+    const struct timespec* timeout)
+{
+    chan_clock_now(deadline);
+    deadline->tv_sec += timeout->tv_sec;
+    deadline->tv_nsec += timeout->tv_nsec;
+    if (deadline->tv_nsec >= 1000000000L)
     {
-        errno = ENOMEM;
-        return NULL;
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
     }
+}
 
-    if (capacity > 0)
+#ifdef CHAN_FUTEX
+static long chan_futex(uint32_t* addr, int op, uint32_t val,
+    const struct timespec* deadline)
+{
+    return syscall(SYS_futex, addr, op | FUTEX_PRIVATE_FLAG, val, deadline,
+        NULL, FUTEX_BITSET_MATCH_ANY);
+}
+
+// Initializes a futex word.
+static int chan_cond_init(chan_cond_t* cond)
+{
+    cond->seq = 0;
+    cond->waiters = 0;
+    return 0;
+}
+
+static void chan_cond_destroy(chan_cond_t* cond)
+{
+    (void) cond;
+}
+
+// Releases mu and sleeps until the futex sequence moves on, then re-acquires
+// mu. If deadline is not NULL, gives up once it has passed and returns
+// ETIMEDOUT. Like a condition variable, this may wake spuriously.
+static int chan_cond_wait(chan_cond_t* cond, pthread_mutex_t* mu,
+    const struct timespec* deadline)
+{
+    if (chan_task_current())
     {
-        if (buffered_chan_init(chan, capacity) != 0)
-        {
-            free(chan);
-            return NULL;
-        }
+        return chan_task_park(cond, mu, deadline);
     }
-    else
+
+    uint32_t seq = __atomic_load_n(&cond->seq, __ATOMIC_ACQUIRE);
+    __atomic_add_fetch(&cond->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(mu);
+
+    // The wait returns at once if a wakeup bumped seq after we read it.
+    int rc = 0;
+    if (chan_futex(&cond->seq, FUTEX_WAIT_BITSET, seq, deadline) != 0 &&
+        errno == ETIMEDOUT)
     {
-        if (unbuffered_chan_init(chan) != 0)
-        {
-            free(chan);
-            return NULL;
-        }
+        rc = ETIMEDOUT;
     }
-    
-    return chan;
+
+    __atomic_sub_fetch(&cond->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(mu);
+    return rc;
 }
 
-static int buffered_chan_init(chan_t* chan, size_t capacity)
+// Wakes one thread sleeping on the futex and one task parked on it. Makes no
+// system call if nobody is.
+static void chan_cond_signal(chan_cond_t* cond)
 {
-    queue_t* queue = queue_init(capacity);
-    if (!queue)
+    __atomic_add_fetch(&cond->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cond->waiters, __ATOMIC_SEQ_CST) > 0)
     {
-        return -1;
+        chan_futex(&cond->seq, FUTEX_WAKE, 1, NULL);
     }
+    chan_task_wake(cond, 0);
+}
 
-    if (unbuffered_chan_init(chan) != 0)
+// Wakes every thread and task waiting on the futex. Makes no system call if
+// nobody is.
+static void chan_cond_broadcast(chan_cond_t* cond)
+{
+    __atomic_add_fetch(&cond->seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&cond->waiters, __ATOMIC_SEQ_CST) > 0)
     {
-        queue_dispose(queue);
-        return -1;
+        chan_futex(&cond->seq, FUTEX_WAKE, INT_MAX, NULL);
     }
-    
-    chan->queue = queue;
-    return 0;
+    chan_task_wake(cond, 1);
 }
-
-static int unbuffered_chan_init(chan_t* chan)
+#else
+// Initializes a condition variable whose timed waits use chan_clock_now.
+static int chan_cond_init(chan_cond_t* cond)
 {
-    if (pthread_mutex_init(&chan->w_mu, NULL) != 0)
+#if defined(__MACH__) || defined(_WIN32)
+    return pthread_cond_init(cond, NULL);
+#else
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr) != 0)
     {
         return -1;
     }
 
-    if (pthread_mutex_init(&chan->r_mu, NULL) != 0)
+    int success = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0 &&
+        pthread_cond_init(cond, &attr) == 0 ? 0 : -1;
+    pthread_condattr_destroy(&attr);
+    return success;
+#endif
+}
+
+static void chan_cond_destroy(chan_cond_t* cond)
+{
+    pthread_cond_destroy(cond);
+}
+
+// Waits on cond like pthread_cond_wait. If deadline is not NULL, gives up once
+// it has passed and returns ETIMEDOUT. A task is parked instead, leaving its
+// worker thread free.
+static int chan_cond_wait(chan_cond_t* cond, pthread_mutex_t* mu,
+    const struct timespec* deadline)
+{
+    if (chan_task_current())
     {
-        pthread_mutex_destroy(&chan->w_mu);
-        return -1;
+        return chan_task_park(cond, mu, deadline);
     }
-
-    if (pthread_mutex_init(&chan->m_mu, NULL) != 0)
+    if (!deadline)
     {
-        pthread_mutex_destroy(&chan->w_mu);
-        pthread_mutex_destroy(&chan->r_mu);
-        return -1;
+        return pthread_cond_wait(cond, mu);
     }
+    return pthread_cond_timedwait(cond, mu, deadline);
+}
+
+static void chan_cond_signal(chan_cond_t* cond)
+{
+    pthread_cond_signal(cond);
+    chan_task_wake(cond, 0);
+}
+
+static void chan_cond_broadcast(chan_cond_t* cond)
+{
+    pthread_cond_broadcast(cond);
+    chan_task_wake(cond, 1);
+}
+#endif
 
-    if (pthread_cond_init(&chan->r_cond, NULL) != 0)
+// Locks mu like pthread_mutex_lock. If deadline is not NULL, gives up once it
+// has passed and returns ETIMEDOUT. A task yields to the other tasks of its
+// worker between attempts rather than blocking the worker, since the holder
+// may be one of them.
+static int chan_mutex_lock(pthread_mutex_t* mu,
+    const struct timespec* deadline)
+{
+    if (chan_task_current())
     {
-        pthread_mutex_destroy(&chan->m_mu);
-        pthread_mutex_destroy(&chan->w_mu);
-        pthread_mutex_destroy(&chan->r_mu);
-        return -1;
+        int rc;
+        while ((rc = pthread_mutex_trylock(mu)) == EBUSY)
+        {
+            if (deadline)
+            {
+                struct timespec now;
+                chan_clock_now(&now);
+                if (now.tv_sec > deadline->tv_sec ||
+                    (now.tv_sec == deadline->tv_sec &&
+                    now.tv_nsec >= deadline->tv_nsec))
+                {
+                    return ETIMEDOUT;
+                }
+            }
+            chan_yield();
+        }
+        return rc;
+    }
+    if (!deadline)
+    {
+        return pthread_mutex_lock(mu);
     }
 
-    if (pthread_cond_init(&chan->w_cond, NULL) != 0)
+#if defined(__GLIBC__) && !defined(__MACH__) && \
+    (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30))
+    return pthread_mutex_clocklock(mu, CLOCK_MONOTONIC, deadline);
+#else
+    int rc;
+    while ((rc = pthread_mutex_trylock(mu)) == EBUSY)
     {
-        pthread_mutex_destroy(&chan->m_mu);
-        pthread_mutex_destroy(&chan->w_mu);
-        pthread_mutex_destroy(&chan->r_mu);
-        pthread_cond_destroy(&chan->r_cond);
-        return -1;
+        struct timespec now;
+        chan_clock_now(&now);
+        if (now.tv_sec > deadline->tv_sec || (now.tv_sec == deadline->tv_sec &&
+            now.tv_nsec >= deadline->tv_nsec))
+        {
+            return ETIMEDOUT;
+        }
+        sched_yield();
     }
+    return rc;
+#endif
+}
 
-    chan->closed = 0;
-    chan->r_waiting = 0;
-    chan->w_waiting = 0;
-    chan->queue = NULL;
-    chan->data = NULL;
-    return 0;
+// Hints to the CPU that we are in a spin loop.
+static inline void chan_cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
 }
 
-// Releases the channel resources.
-void chan_dispose(chan_t* chan)
+// Polls ready without holding the channel lock for up to the channel's spin
+// budget, so a waiter that is only just behind the other side can avoid
+// parking. The number of polls a successful spin took stands in for the wait
+// time: the budget moves towards twice that, and halves whenever the spin
+// fails. Returns non-zero if ready returned non-zero.
+static int chan_spin(chan_t* chan, int (*ready)(chan_t*),
+    const struct timespec* deadline)
 {
-    if (chan_is_buffered(chan))
+    // A task parks cheaply, and spinning would hold up the other tasks of its
+    // worker, which may include the one it waits for.
+    int limit = __atomic_load_n(&chan->spin_limit, __ATOMIC_RELAXED);
+    if (limit == 0 || chan_task_current())
     {
-        queue_dispose(chan->queue);
+        return 0;
     }
 
-    pthread_mutex_destroy(&chan->w_mu);
-    pthread_mutex_destroy(&chan->r_mu);
-
-    pthread_mutex_destroy(&chan->m_mu);
-    pthread_cond_destroy(&chan->r_cond);
-    pthread_cond_destroy(&chan->w_cond);
-    free(chan);
-}
+    if (deadline)
+    {
+        struct timespec now;
+        chan_clock_now(&now);
+        if (now.tv_sec > deadline->tv_sec ||
+            (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec))
+        {
+            return 0;
+        }
+    }
 
-// Once a channel is closed, data cannot be sent into it. If the channel is
-// buffered, data can be read from it until it is empty, after which reads will
-// return an error code. Reading from a closed channel that is unbuffered will
-// return an error code. Closing a channel does not release its resources. This
-// must be done with a call to chan_dispose. Returns 0 if the channel was
-// successfully closed, -1 otherwise. If -1 is returned, errno will be set.
-int chan_close(chan_t* chan)
-{
+    int budget = __atomic_load_n(&chan->spin, __ATOMIC_RELAXED);
+    int polls = 0;
     int success = 0;
-    pthread_mutex_lock(&chan->m_mu);
-    if (chan->closed)
+    while (polls < budget)
     {
-        // Channel already closed.
-        success = -1;
-        errno = EPIPE;
+        if (ready(chan))
+        {
+            success = 1;
+            break;
+        }
+        chan_cpu_relax();
+        polls++;
     }
-    else
+
+    // Keep a small floor so the channel notices when waits get short again.
+    int floor = limit < 16 ? limit : 16;
+    int next = success ? budget + (2 * polls - budget) / 8 : budget / 2;
+    next = next < floor ? floor : next > limit ? limit : next;
+    if (next != budget)
     {
-        // Otherwise close it.
-        chan->closed = 1;
-        pthread_cond_broadcast(&chan->r_cond);
-        pthread_cond_broadcast(&chan->w_cond);
+        __atomic_store_n(&chan->spin, next, __ATOMIC_RELAXED);
     }
-    pthread_mutex_unlock(&chan->m_mu);
     return success;
 }
 
-// Returns 0 if the channel is open and 1 if it is closed.
-int chan_is_closed(chan_t* chan)
+static int buffered_chan_can_send(chan_t* chan)
 {
-    pthread_mutex_lock(&chan->m_mu);
-    int closed = chan->closed;
-    pthread_mutex_unlock(&chan->m_mu);
-    return closed;
+    // Which level of a priority channel has room depends on the sender, so
+    // those do not spin and go straight to checking under m_mu.
+    return !chan->queue ||
+        __atomic_load_n(&chan->queue->size, __ATOMIC_RELAXED) <
+        chan->queue->capacity ||
+        __atomic_load_n(&chan->closed, __ATOMIC_RELAXED);
 }
 
-// Sends a value into the channel. If the channel is unbuffered, this will
-// block until a receiver receives the value. If the channel is buffered and at
-// capacity, this will block until a receiver receives a value. Returns 0 if
-// the send succeeded or -1 if it failed. If -1 is returned, errno will be set.
-int chan_send(chan_t* chan, void* data)
+static int buffered_chan_can_recv(chan_t* chan)
 {
-    if (chan_is_closed(chan))
-    {
-        // Cannot send on closed channel.
-        errno = EPIPE;
-        return -1;
-    }
+    int ready = chan->queue ?
+        __atomic_load_n(&chan->queue->size, __ATOMIC_RELAXED) > 0 :
+        chan->prio ?
+        __atomic_load_n(&chan->prio->size, __ATOMIC_RELAXED) > 0 :
+        __atomic_load_n(&chan->seg->size, __ATOMIC_RELAXED) > 0;
+    return ready || __atomic_load_n(&chan->closed, __ATOMIC_RELAXED);
+}
 
-    return chan_is_buffered(chan) ?
-        buffered_chan_send(chan, data) :
-        unbuffered_chan_send(chan, data);
+static int ring_chan_can_send(chan_t* chan)
+{
+    return chan_ring_size(chan) < chan_ring_capacity(chan) ||
+        __atomic_load_n(&chan->closed, __ATOMIC_RELAXED);
 }
 
-// Receives a value from the channel. This will block until there is data to
-// receive. Returns 0 if the receive succeeded or -1 if it failed. If -1 is
-// returned, errno will be set.
-int chan_recv(chan_t* chan, void** data)
+static int ring_chan_can_recv(chan_t* chan)
 {
-    return chan_is_buffered(chan) ?
-        buffered_chan_recv(chan, data) :
-        unbuffered_chan_recv(chan, data);
+    return chan_ring_size(chan) > 0 ||
+        __atomic_load_n(&chan->closed, __ATOMIC_RELAXED);
+}
+
+// Allocates and returns a new channel. The capacity specifies whether the
+// channel should be buffered or not. A capacity of 0 will create an unbuffered
+// channel. Sets errno and returns NULL if initialization failed.
+chan_t* chan_init(size_t capacity)
+{
+    return chan_init_flags(capacity, 0);
 }
 
-static int buffered_chan_send(chan_t* chan, void* data)
+// Allocates and returns a new channel like chan_init, using the buffered
+// engine selected by flags. CHAN_SPSC and CHAN_MPMC are mutually exclusive and
+// require a capacity greater than 0. CHAN_UNBOUNDED requires a capacity of 0.
+// Sets errno and returns NULL if initialization failed.
+chan_t* chan_init_flags(size_t capacity, int flags)
 {
-    pthread_mutex_lock(&chan->m_mu);
-    while (chan->queue->size == chan->queue->capacity)
+    if (flags & CHAN_NUMA)
     {
-        // Block until something is removed.
-        chan->w_waiting++;
-        pthread_cond_wait(&chan->w_cond, &chan->m_mu);
-        chan->w_waiting--;
+        // The node can only be given through chan_init_opts.
+        errno = EINVAL;
+        return NULL;
     }
 
-    int success = queue_add(chan->queue, data);
+    chan_opts_t opts = { capacity, flags, 0 };
+    return chan_init_opts(&opts);
+}
 
-    if (chan->r_waiting > 0)
+// Allocates and returns a new channel like chan_init_flags with the capacity
+// and flags in opts. CHAN_NUMA places the channel and its buffer on
+// opts->numa_node and CHAN_HUGEPAGES backs large buffers with huge pages;
+// neither applies to CHAN_UNBOUNDED channels. Sets errno and returns NULL if
+// initialization failed.
+chan_t* chan_init_opts(const chan_opts_t* opts)
+{
+    size_t capacity = opts->capacity;
+    int flags = opts->flags;
+    int ring = flags & (CHAN_SPSC | CHAN_MPMC);
+    int unbounded = flags & CHAN_UNBOUNDED;
+    int placed = flags & (CHAN_HUGEPAGES | CHAN_NUMA);
+    if (ring == (CHAN_SPSC | CHAN_MPMC) || (ring && capacity == 0) ||
+        (unbounded && (ring || capacity > 0 || placed)))
     {
-        // Signal waiting reader.
-        pthread_cond_signal(&chan->r_cond);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (!flags)
+    {
+        return plain_chan_init(capacity);
+    }
+
+    // The channel itself is small, so it only follows the NUMA placement.
+    chan_mem_t mem = { 0, opts->numa_node };
+    if (flags & CHAN_NUMA)
+    {
+        mem.flags |= CHAN_MEM_NUMA;
+    }
+    chan_t* chan = (chan_t*) chan_mem_alloc(sizeof(chan_t), &mem);
+    if (!chan)
+    {
+        return NULL;
+    }
+    if (flags & CHAN_HUGEPAGES)
+    {
+        mem.flags |= CHAN_MEM_HUGEPAGES;
+    }
+
+    if (ring)
+    {
+        if (ring_chan_init(chan, capacity, flags, &mem) != 0)
+        {
+            chan_mem_free(chan);
+            return NULL;
+        }
+    }
+    else if (unbounded)
+    {
+        if (unbounded_chan_init(chan) != 0)
+        {
+            chan_mem_free(chan);
+            return NULL;
+        }
+    }
+    else if (capacity > 0)
+    {
+        if (buffered_chan_init(chan, capacity, &mem) != 0)
+        {
+            chan_mem_free(chan);
+            return NULL;
+        }
+    }
+    else
+    {
+        if (unbuffered_chan_init(chan) != 0)
+        {
+            chan_mem_free(chan);
+            return NULL;
+        }
+    }
+    
+    return chan;
+}
+
+// Allocates and returns a new buffered channel for use by exactly one sending
+// thread and one receiving thread. Equivalent to chan_init_flags with
+// CHAN_SPSC. Sets errno and returns NULL if initialization failed.
+chan_t* chan_init_spsc(size_t capacity)
+{
+    return chan_init_flags(capacity, CHAN_SPSC);
+}
+
+// Allocates and returns a new buffered channel with no capacity limit, so
+// sends never block. Equivalent to chan_init_flags with a capacity of 0 and
+// CHAN_UNBOUNDED. Sets errno and returns NULL if initialization failed.
+chan_t* chan_init_unbounded(void)
+{
+    return chan_init_flags(0, CHAN_UNBOUNDED);
+}
+
+// Allocates and returns a new channel which carries fixed-size elements of
+// elem_size bytes by value. A capacity of 0 will create an unbuffered channel.
+// Sets errno and returns NULL if initialization failed.
+chan_t* chan_init_sized(size_t capacity, size_t elem_size)
+{
+    if (elem_size == 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    chan_t* chan = (chan_t*) chan_mem_alloc(sizeof(chan_t), NULL);
+    if (!chan)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    queue_t* queue = NULL;
+    if (capacity > 0)
+    {
+        queue = queue_init_sized(capacity, elem_size);
+        if (!queue)
+        {
+            chan_mem_free(chan);
+            return NULL;
+        }
+    }
+
+    if (unbuffered_chan_init(chan) != 0)
+    {
+        if (queue)
+        {
+            queue_dispose(queue);
+        }
+        chan_mem_free(chan);
+        return NULL;
+    }
+
+    chan->queue = queue;
+    chan->elem_size = elem_size;
+    return chan;
+}
+
+// Allocates and returns a new channel which carries variable-length messages
+// in a ring of capacity bytes. Messages are written and read in place with
+// chan_reserve/chan_commit and chan_peek_msg/chan_consume. Sets errno and
+// returns NULL if initialization failed.
+chan_t* chan_init_bytes(size_t capacity)
+{
+    chan_t* chan = (chan_t*) chan_mem_alloc(sizeof(chan_t), NULL);
+    if (!chan)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    byte_queue_t* bytes = byte_queue_init(capacity);
+    if (!bytes)
+    {
+        chan_mem_free(chan);
+        return NULL;
+    }
+
+    if (unbuffered_chan_init(chan) != 0)
+    {
+        byte_queue_dispose(bytes);
+        chan_mem_free(chan);
+        return NULL;
+    }
+
+    chan->bytes = bytes;
+    return chan;
+}
+
+// Allocates and returns a new buffered channel serving levels priority levels,
+// each with its own buffer of capacity values. Receives take the oldest value
+// of the highest non-empty level. Sets errno and returns NULL if
+// initialization failed.
+chan_t* chan_init_priority(size_t capacity, int levels)
+{
+    chan_t* chan = (chan_t*) chan_mem_alloc(sizeof(chan_t), NULL);
+    if (!chan)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (prio_chan_init(chan, capacity, levels) != 0)
+    {
+        chan_mem_free(chan);
+        return NULL;
+    }
+    return chan;
+}
+
+// Opens the shared-memory channel called name, creating it if it does not
+// exist yet, and returns a handle to it. The channel is buffered, holding up
+// to capacity elements of elem_size bytes by value, and lives in a POSIX
+// shared memory object that every process opening the same name maps. A NULL
+// name creates an anonymous mapping that is shared with child processes
+// forked afterwards. Sets errno and returns NULL if the channel could not be
+// opened, to EINVAL if it exists with a different capacity or element size.
+chan_t* chan_open_shm(const char* name, size_t capacity, size_t elem_size)
+{
+    if (capacity == 0 || elem_size == 0 ||
+        capacity > (SIZE_MAX - CHAN_SHM_HEADER) / elem_size)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    size_t map_size = CHAN_SHM_HEADER + capacity * elem_size;
+
+    chan_t* chan = (chan_t*) chan_mem_alloc(sizeof(chan_t), NULL);
+    if (!chan)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    int fd = -1;
+    int created = 1;
+    if (name)
+    {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && errno == EEXIST)
+        {
+            created = 0;
+            fd = shm_open(name, O_RDWR, 0);
+        }
+        if (fd < 0)
+        {
+            chan_mem_free(chan);
+            return NULL;
+        }
+
+        struct stat st;
+        int rc = 0;
+        if (created)
+        {
+            rc = ftruncate(fd, (off_t) map_size);
+        }
+        else
+        {
+            // The creator may not have sized the object yet.
+            int tries;
+            for (tries = 0; (rc = fstat(fd, &st)) == 0 && st.st_size == 0 &&
+                tries < 1000; tries++)
+            {
+                struct timespec ms = {0, 1000000};
+                nanosleep(&ms, NULL);
+            }
+            if (rc == 0 && (size_t) st.st_size != map_size)
+            {
+                errno = st.st_size == 0 ? ETIMEDOUT : EINVAL;
+                rc = -1;
+            }
+        }
+        if (rc != 0)
+        {
+            int err = errno;
+            if (created)
+            {
+                shm_unlink(name);
+            }
+            close(fd);
+            chan_mem_free(chan);
+            errno = err;
+            return NULL;
+        }
+    }
+
+    void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+        name ? MAP_SHARED : MAP_SHARED | MAP_ANONYMOUS, fd, 0);
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    if (map == MAP_FAILED)
+    {
+        int err = errno;
+        if (name && created)
+        {
+            shm_unlink(name);
+        }
+        chan_mem_free(chan);
+        errno = err;
+        return NULL;
+    }
+
+    chan_shm_t* shm = (chan_shm_t*) map;
+    int success = created ?
+        shm_chan_init(shm, map_size, capacity, elem_size) :
+        shm_chan_attach(shm, capacity, elem_size);
+    if (success != 0 || unbuffered_chan_init(chan) != 0)
+    {
+        int err = errno;
+        munmap(map, map_size);
+        if (name && created)
+        {
+            shm_unlink(name);
+        }
+        chan_mem_free(chan);
+        errno = err;
+        return NULL;
+    }
+
+    chan->shm = shm;
+    chan->elem_size = elem_size;
+    return chan;
+}
+
+// Removes the name of a shared-memory channel created by chan_open_shm. The
+// channel itself stays usable by processes that have it open and is freed
+// once the last of them disposes of it. Returns 0 on success or -1 with errno
+// set if it failed.
+int chan_unlink_shm(const char* name)
+{
+    return shm_unlink(name);
+}
+
+// Lays out a new shared-memory channel in shm and marks it ready for other
+// processes to attach to.
+static int shm_chan_init(chan_shm_t* shm, size_t map_size, size_t capacity,
+    size_t elem_size)
+{
+    pthread_mutexattr_t mu_attr;
+    pthread_condattr_t cond_attr;
+    if (pthread_mutexattr_init(&mu_attr) != 0)
+    {
+        return -1;
+    }
+    if (pthread_condattr_init(&cond_attr) != 0)
+    {
+        pthread_mutexattr_destroy(&mu_attr);
+        return -1;
+    }
+
+    int success = pthread_mutexattr_setpshared(&mu_attr,
+        PTHREAD_PROCESS_SHARED) == 0 &&
+        pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED) == 0;
+#ifdef __linux__
+    // A process that dies holding the lock must not wedge the others.
+    success = success &&
+        pthread_mutexattr_setrobust(&mu_attr, PTHREAD_MUTEX_ROBUST) == 0;
+#endif
+    if (success && pthread_mutex_init(&shm->mu, &mu_attr) == 0)
+    {
+        if (pthread_cond_init(&shm->r_cond, &cond_attr) != 0)
+        {
+            pthread_mutex_destroy(&shm->mu);
+            success = 0;
+        }
+        else if (pthread_cond_init(&shm->w_cond, &cond_attr) != 0)
+        {
+            pthread_cond_destroy(&shm->r_cond);
+            pthread_mutex_destroy(&shm->mu);
+            success = 0;
+        }
+    }
+    else
+    {
+        success = 0;
+    }
+    pthread_mutexattr_destroy(&mu_attr);
+    pthread_condattr_destroy(&cond_attr);
+    if (!success)
+    {
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    shm->map_size = map_size;
+    shm->capacity = capacity;
+    shm->elem_size = elem_size;
+    shm->closed = 0;
+    shm->r_waiting = 0;
+    shm->w_waiting = 0;
+    shm->head = 0;
+    shm->size = 0;
+    __atomic_store_n(&shm->magic, CHAN_SHM_MAGIC, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Waits for the creator of the shared-memory channel in shm to finish laying
+// it out and checks that it matches the expected shape.
+static int shm_chan_attach(chan_shm_t* shm, size_t capacity,
+    size_t elem_size)
+{
+    int tries;
+    for (tries = 0; __atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) == 0 &&
+        tries < 1000; tries++)
+    {
+        struct timespec ms = {0, 1000000};
+        nanosleep(&ms, NULL);
+    }
+
+    uint64_t magic = __atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE);
+    if (magic == 0)
+    {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (magic != CHAN_SHM_MAGIC || shm->capacity != capacity ||
+        shm->elem_size != elem_size)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+static int ring_chan_init(chan_t* chan, size_t capacity, int flags,
+    const chan_mem_t* mem)
+{
+    spsc_queue_t* spsc = NULL;
+    mpmc_queue_t* mpmc = NULL;
+    if (flags & CHAN_SPSC)
+    {
+        spsc = spsc_queue_init_mem(capacity, mem);
+    }
+    else
+    {
+        mpmc = mpmc_queue_init_mem(capacity, mem);
+    }
+
+    if (!spsc && !mpmc)
+    {
+        return -1;
+    }
+
+    if (unbuffered_chan_init(chan) != 0)
+    {
+        if (spsc)
+        {
+            spsc_queue_dispose(spsc);
+        }
+        else
+        {
+            mpmc_queue_dispose(mpmc);
+        }
+        return -1;
+    }
+
+    chan->spsc = spsc;
+    chan->mpmc = mpmc;
+    return 0;
+}
+
+static int unbounded_chan_init(chan_t* chan)
+{
+    seg_queue_t* seg = seg_queue_init();
+    if (!seg)
+    {
+        return -1;
+    }
+
+    if (unbuffered_chan_init(chan) != 0)
+    {
+        seg_queue_dispose(seg);
+        return -1;
+    }
+
+    chan->seg = seg;
+    return 0;
+}
+
+// Returns where the queue of a channel made by plain_chan_init lives, right
+// behind the channel in the same allocation.
+static inline queue_t* chan_inline_queue(chan_t* chan)
+{
+    return (queue_t*) (chan + 1);
+}
+
+// Allocates a channel without placement or a special engine, reusing one from
+// the calling thread's cache if possible. A buffered channel is laid out in a
+// single allocation: the channel, its queue and then the queue's slots.
+static chan_t* plain_chan_init(size_t capacity)
+{
+    chan_t* chan = chan_cache_take(capacity);
+    if (chan)
+    {
+        return chan;
+    }
+
+    if (capacity > INT_MAX / sizeof(void*))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t size = sizeof(chan_t);
+    if (capacity > 0)
+    {
+        size += sizeof(queue_t) + capacity * sizeof(void*);
+    }
+    chan = (chan_t*) chan_mem_alloc(size, NULL);
+    if (!chan)
+    {
+        return NULL;
+    }
+
+    if (unbuffered_chan_init(chan) != 0)
+    {
+        chan_mem_free(chan);
+        return NULL;
+    }
+
+    if (capacity > 0)
+    {
+        queue_t* queue = chan_inline_queue(chan);
+        queue_init_buf(queue, capacity, 0, queue + 1);
+        chan->queue = queue;
+    }
+    chan->plain = 1;
+    return chan;
+}
+
+static int prio_chan_init(chan_t* chan, size_t capacity, int levels)
+{
+    prio_queue_t* prio = prio_queue_init(capacity, levels);
+    if (!prio)
+    {
+        return -1;
+    }
+
+    if (unbuffered_chan_init(chan) != 0)
+    {
+        prio_queue_dispose(prio);
+        return -1;
+    }
+
+    chan->prio = prio;
+    return 0;
+}
+
+static int buffered_chan_init(chan_t* chan, size_t capacity,
+    const chan_mem_t* mem)
+{
+    queue_t* queue = queue_init_mem(capacity, 0, mem);
+    if (!queue)
+    {
+        return -1;
+    }
+
+    if (unbuffered_chan_init(chan) != 0)
+    {
+        queue_dispose(queue);
+        return -1;
+    }
+    
+    chan->queue = queue;
+    return 0;
+}
+
+static int unbuffered_chan_init(chan_t* chan)
+{
+    if (pthread_mutex_init(&chan->w_mu, NULL) != 0)
+    {
+        return -1;
+    }
+
+    if (pthread_mutex_init(&chan->r_mu, NULL) != 0)
+    {
+        pthread_mutex_destroy(&chan->w_mu);
+        return -1;
+    }
+
+    if (pthread_mutex_init(&chan->m_mu, NULL) != 0)
+    {
+        pthread_mutex_destroy(&chan->w_mu);
+        pthread_mutex_destroy(&chan->r_mu);
+        return -1;
+    }
+
+    if (chan_cond_init(chan_r_cond(chan)) != 0)
+    {
+        pthread_mutex_destroy(&chan->m_mu);
+        pthread_mutex_destroy(&chan->w_mu);
+        pthread_mutex_destroy(&chan->r_mu);
+        return -1;
+    }
+
+    if (chan_cond_init(chan_w_cond(chan)) != 0)
+    {
+        pthread_mutex_destroy(&chan->m_mu);
+        pthread_mutex_destroy(&chan->w_mu);
+        pthread_mutex_destroy(&chan->r_mu);
+        chan_cond_destroy(chan_r_cond(chan));
+        return -1;
+    }
+
+    chan->closed = 0;
+    chan->r_waiting = 0;
+    chan->w_waiting = 0;
+    chan->queue = NULL;
+    chan->seg = NULL;
+    chan->prio = NULL;
+    chan->spsc = NULL;
+    chan->mpmc = NULL;
+    chan->bytes = NULL;
+    chan->shm = NULL;
+    chan->set = NULL;
+    chan->set_index = 0;
+    chan->plain = 0;
+    chan->w_head = NULL;
+    chan->w_tail = NULL;
+    chan->r_head = NULL;
+    chan->r_tail = NULL;
+    chan->r_select = NULL;
+    chan->w_select = NULL;
+    chan->elem_size = 0;
+    chan->stats = NULL;
+    chan->fd = -1;
+    chan->fd_ready = 0;
+    chan->spin_limit = CHAN_SPIN_DEFAULT;
+    chan->spin = CHAN_SPIN_DEFAULT;
+    chan->overflow = CHAN_OVERFLOW_BLOCK;
+    chan->on_drop = NULL;
+    chan->dropped = 0;
+    return 0;
+}
+
+// Releases the channel resources. If channel caching is enabled, a channel
+// made by chan_init may instead be kept by the calling thread for reuse.
+void chan_dispose(chan_t* chan)
+{
+    if (!chan_cache_put(chan))
+    {
+        chan_destroy(chan);
+    }
+}
+
+static void chan_destroy(chan_t* chan)
+{
+    // The queue of a plain channel is part of the same allocation.
+    if (chan->queue && !chan->plain)
+    {
+        queue_dispose(chan->queue);
+    }
+    else if (chan->seg)
+    {
+        seg_queue_dispose(chan->seg);
+    }
+    else if (chan->prio)
+    {
+        prio_queue_dispose(chan->prio);
+    }
+    else if (chan->spsc)
+    {
+        spsc_queue_dispose(chan->spsc);
+    }
+    else if (chan->mpmc)
+    {
+        mpmc_queue_dispose(chan->mpmc);
+    }
+    else if (chan->bytes)
+    {
+        byte_queue_dispose(chan->bytes);
+    }
+    else if (chan->shm)
+    {
+        munmap(chan->shm, chan->shm->map_size);
+    }
+
+    pthread_mutex_destroy(&chan->w_mu);
+    pthread_mutex_destroy(&chan->r_mu);
+
+    pthread_mutex_destroy(&chan->m_mu);
+    chan_cond_destroy(chan_r_cond(chan));
+    chan_cond_destroy(chan_w_cond(chan));
+    if (chan->fd >= 0)
+    {
+        close(chan->fd);
+    }
+    free(chan->stats);
+    chan_mem_free(chan);
+}
+
+// Sets how many disposed channels each thread keeps for chan_init to reuse,
+// from 0 (the default, which disables caching) up to CHAN_CACHE_MAX. Only
+// channels made by chan_init, or chan_init_flags without flags, are cached,
+// and only for reuse at the same capacity. A cached channel keeps its
+// mutexes and condition variables initialized and, if buffered, its buffer,
+// so reusing it costs no allocation. The calling thread's cache is trimmed to
+// the new size at once, those of other threads as they next dispose of a
+// channel, and each thread's cache is freed when it exits. Returns 0 on
+// success or -1 with errno set to EINVAL if per_thread is out of range.
+int chan_cache_enable(int per_thread)
+{
+    if (per_thread < 0 || per_thread > CHAN_CACHE_MAX)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_once(&chan_cache_once, chan_cache_key_init);
+    __atomic_store_n(&chan_cache_limit, per_thread, __ATOMIC_RELEASE);
+
+    chan_cache_t* cache = (chan_cache_t*) pthread_getspecific(chan_cache_key);
+    while (cache && cache->count > per_thread)
+    {
+        chan_destroy(cache->chans[--cache->count]);
+    }
+    return 0;
+}
+
+// Releases a thread's channel cache when the thread exits.
+static void chan_cache_free(void* arg)
+{
+    chan_cache_t* cache = (chan_cache_t*) arg;
+    while (cache->count > 0)
+    {
+        chan_destroy(cache->chans[--cache->count]);
+    }
+    free(cache);
+}
+
+static void chan_cache_key_init(void)
+{
+    pthread_key_create(&chan_cache_key, chan_cache_free);
+}
+
+// Returns a channel of the given capacity from the calling thread's cache, or
+// NULL if it has none.
+static chan_t* chan_cache_take(size_t capacity)
+{
+    if (__atomic_load_n(&chan_cache_limit, __ATOMIC_ACQUIRE) == 0)
+    {
+        return NULL;
+    }
+
+    chan_cache_t* cache = (chan_cache_t*) pthread_getspecific(chan_cache_key);
+    if (!cache)
+    {
+        return NULL;
+    }
+
+    // Start with the most recently disposed channel, which is likeliest to
+    // still be in the cache.
+    int i;
+    for (i = cache->count - 1; i >= 0; i--)
+    {
+        chan_t* chan = cache->chans[i];
+        size_t cap = chan->queue ? (size_t) chan->queue->capacity : 0;
+        if (cap == capacity)
+        {
+            cache->chans[i] = cache->chans[--cache->count];
+            return chan;
+        }
+    }
+    return NULL;
+}
+
+// Resets a disposed plain channel to its initial state and keeps it in the
+// calling thread's cache. Returns 1 if it was cached or 0 if it must be
+// destroyed.
+static int chan_cache_put(chan_t* chan)
+{
+    int limit = __atomic_load_n(&chan_cache_limit, __ATOMIC_ACQUIRE);
+    if (!chan->plain || limit == 0)
+    {
+        return 0;
+    }
+
+    chan_cache_t* cache = (chan_cache_t*) pthread_getspecific(chan_cache_key);
+    if (!cache)
+    {
+        cache = (chan_cache_t*) calloc(1, sizeof(chan_cache_t));
+        if (!cache || pthread_setspecific(chan_cache_key, cache) != 0)
+        {
+            free(cache);
+            return 0;
+        }
+    }
+    while (cache->count > limit)
+    {
+        chan_destroy(cache->chans[--cache->count]);
+    }
+    if (cache->count == limit)
+    {
+        return 0;
+    }
+
+    if (chan->fd >= 0)
+    {
+        close(chan->fd);
+        chan->fd = -1;
+    }
+    free(chan->stats);
+    chan->stats = NULL;
+    chan->fd_ready = 0;
+    chan->closed = 0;
+    chan->r_waiting = 0;
+    chan->w_waiting = 0;
+    chan->set = NULL;
+    chan->set_index = 0;
+    chan->w_head = NULL;
+    chan->w_tail = NULL;
+    chan->r_head = NULL;
+    chan->r_tail = NULL;
+    chan->r_select = NULL;
+    chan->w_select = NULL;
+    chan->spin_limit = CHAN_SPIN_DEFAULT;
+    chan->spin = CHAN_SPIN_DEFAULT;
+    chan->overflow = CHAN_OVERFLOW_BLOCK;
+    chan->on_drop = NULL;
+    chan->dropped = 0;
+    if (chan->queue)
+    {
+        __atomic_store_n(&chan->queue->size, 0, __ATOMIC_RELAXED);
+        chan->queue->next = 0;
+    }
+
+    cache->chans[cache->count++] = chan;
+    return 1;
+}
+
+// Once a channel is closed, data cannot be sent into it. If the channel is
+// buffered, data can be read from it until it is empty, after which reads will
+// return an error code. Reading from a closed channel that is unbuffered will
+// return an error code. Closing a channel does not release its resources. This
+// must be done with a call to chan_dispose. Returns 0 if the channel was
+// successfully closed, -1 otherwise. If -1 is returned, errno will be set.
+int chan_close(chan_t* chan)
+{
+    if (chan->shm)
+    {
+        return shm_chan_close(chan);
+    }
+
+    int success = 0;
+    pthread_mutex_lock(&chan->m_mu);
+    if (chan->closed)
+    {
+        // Channel already closed.
+        success = -1;
+        errno = EPIPE;
+    }
+    else
+    {
+        // Otherwise close it. The flag is also read without the lock by
+        // lock-free ring channels.
+        __atomic_store_n(&chan->closed, 1, __ATOMIC_RELEASE);
+        chan_cond_broadcast(chan_r_cond(chan));
+        chan_cond_broadcast(chan_w_cond(chan));
+
+        // Threads blocked on an unbuffered channel each park on their own
+        // condition and remove themselves from the queues once they see the
+        // channel closed.
+        chan_waiter_t* waiter;
+        for (waiter = chan->w_head; waiter; waiter = waiter->next)
+        {
+            chan_waiter_wake(waiter);
+        }
+        for (waiter = chan->r_head; waiter; waiter = waiter->next)
+        {
+            chan_waiter_wake(waiter);
+        }
+        chan_notify_select(chan->r_select);
+        chan_notify_select(chan->w_select);
+        chan_ready(chan);
+    }
+    pthread_mutex_unlock(&chan->m_mu);
+    return success;
+}
+
+// Returns 0 if the channel is open and 1 if it is closed. This is a single
+// atomic load, so polling it is cheap.
+int chan_is_closed(chan_t* chan)
+{
+    if (chan->shm)
+    {
+        return __atomic_load_n(&chan->shm->closed, __ATOMIC_ACQUIRE);
+    }
+    return __atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE);
+}
+
+// Sets the most times a send or receive that would block on a buffered
+// channel polls it, with a CPU pause hint in between, before parking the
+// thread. Channels start at CHAN_SPIN_DEFAULT. Within this bound the channel
+// tunes its own budget from how long recent waits took, spinning for about
+// twice a typical wait and backing off when spinning does not pay. A limit of
+// 0 disables spinning. Returns 0 if the limit was set or -1 if it was
+// negative.
+int chan_set_spin(chan_t* chan, int limit)
+{
+    if (limit < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    __atomic_store_n(&chan->spin_limit, limit, __ATOMIC_RELAXED);
+    __atomic_store_n(&chan->spin, limit, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Sets what a send on the channel does when its buffer is full, so telemetry
+// and other lossy streams never stall the producer. CHAN_OVERFLOW_BLOCK waits
+// for room, as channels do by default. CHAN_OVERFLOW_FAIL returns -1 with
+// errno set to EAGAIN. CHAN_OVERFLOW_DROP_NEWEST discards the value being
+// sent and CHAN_OVERFLOW_DROP_OLDEST evicts the oldest buffered value (of the
+// same level on a priority channel) to make room, and both report the send as
+// successful. Every value refused or discarded is counted, see chan_dropped,
+// and discarded values are passed to on_drop, which may be NULL, after the
+// channel lock is released so it can free them. chan_select only picks a
+// send on a full channel once it has room, whatever the policy. Set the
+// policy before the channel is shared. Returns 0 if the policy was set or -1
+// with errno set to EINVAL if it is unknown or does not apply: only
+// CHAN_OVERFLOW_BLOCK applies to unbuffered, unbounded, sized, byte and
+// shared-memory channels, and CHAN_SPSC senders cannot evict.
+int chan_set_overflow(chan_t* chan, int policy, void (*on_drop)(void*))
+{
+    int bounded = chan->queue || chan->prio || chan_is_ring(chan);
+    if (policy < CHAN_OVERFLOW_BLOCK || policy > CHAN_OVERFLOW_DROP_OLDEST ||
+        (policy != CHAN_OVERFLOW_BLOCK && (!bounded || chan->elem_size ||
+        chan->shm)) || (policy == CHAN_OVERFLOW_DROP_OLDEST && chan->spsc))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&chan->m_mu);
+    chan->overflow = policy;
+    chan->on_drop = on_drop;
+    pthread_mutex_unlock(&chan->m_mu);
+    return 0;
+}
+
+// Returns the number of values the channel's overflow policy has refused or
+// discarded.
+uint64_t chan_dropped(chan_t* chan)
+{
+    return __atomic_load_n(&chan->dropped, __ATOMIC_RELAXED);
+}
+
+// Starts collecting statistics for the channel, which can then be read with
+// chan_stats. Counters are updated with relaxed atomics or under locks the
+// channel already holds, so they are cheap enough to leave on under load.
+// Returns 0 if statistics are being collected or -1 if they could not be
+// enabled. If -1 is returned, errno will be set.
+int chan_stats_enable(chan_t* chan)
+{
+    pthread_mutex_lock(&chan->m_mu);
+    if (chan->stats)
+    {
+        pthread_mutex_unlock(&chan->m_mu);
+        return 0;
+    }
+
+    size_t stamp_count = 0;
+    if (chan->queue)
+    {
+        stamp_count = chan->queue->capacity;
+    }
+    else if (chan->seg)
+    {
+        stamp_count = CHAN_STATS_STAMPS;
+    }
+
+    chan_stats_state_t* stats = (chan_stats_state_t*) calloc(1,
+        sizeof(chan_stats_state_t) + stamp_count * sizeof(uint64_t));
+    if (!stats)
+    {
+        pthread_mutex_unlock(&chan->m_mu);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Values already queued have no stamps and are skipped when received.
+    stats->stamp_count = stamp_count;
+    if (stamp_count)
+    {
+        stats->enqueued = buffered_chan_size(chan);
+    }
+
+    // Lock-free ring channels read the pointer without holding m_mu.
+    __atomic_store_n(&chan->stats, stats, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&chan->m_mu);
+    return 0;
+}
+
+// Copies a snapshot of the channel statistics into out. The high-water mark
+// covers buffered channels. The latency histogram covers unbuffered channels
+// and mutex-guarded buffered channels, but not CHAN_SPSC or CHAN_MPMC rings.
+// Values already buffered when statistics were enabled are not included.
+// Returns 0 on success or -1 with errno set to EINVAL if statistics are not
+// enabled for the channel.
+int chan_stats(chan_t* chan, chan_stats_t* out)
+{
+    chan_stats_state_t* stats = __atomic_load_n(&chan->stats, __ATOMIC_ACQUIRE);
+    if (!stats)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Every field is a uint64_t counter.
+    uint64_t* src = (uint64_t*) &stats->counters;
+    uint64_t* dst = (uint64_t*) out;
+    size_t i;
+    for (i = 0; i < sizeof(chan_stats_t) / sizeof(uint64_t); i++)
+    {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+// Returns a file descriptor which is readable while the channel has a value
+// to receive or has been closed, so it can be waited on with poll or epoll
+// alongside other descriptors and drained with non-blocking receives such as
+// chan_drain. The descriptor is created on the first call, belongs to the
+// channel and is closed by chan_dispose; it must not be read or written.
+// Senders only touch it when the channel goes from empty to non-empty. Returns
+// -1 if the descriptor could not be created. If -1 is returned, errno will be
+// set, to ENOSYS where eventfd is not available.
+int chan_fd(chan_t* chan)
+{
+    if (chan->shm)
+    {
+        // Other processes could not signal the descriptor.
+        errno = ENOTSUP;
+        return -1;
+    }
+
+#ifdef __linux__
+    pthread_mutex_lock(&chan->m_mu);
+    if (chan->fd < 0)
+    {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd < 0)
+        {
+            pthread_mutex_unlock(&chan->m_mu);
+            return -1;
+        }
+
+        // Senders on lock-free ring channels read fd without holding m_mu.
+        __atomic_store_n(&chan->fd, fd, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        chan_fd_clear(chan);
+    }
+    int fd = chan->fd;
+    pthread_mutex_unlock(&chan->m_mu);
+    return fd;
+#else
+    (void) chan;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static inline chan_stats_state_t* chan_stats_get(chan_t* chan)
+{
+    return __atomic_load_n(&chan->stats, __ATOMIC_ACQUIRE);
+}
+
+static inline uint64_t chan_stats_now(void)
+{
+    struct timespec ts;
+    chan_clock_now(&ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static inline void chan_stats_add(uint64_t* counter, uint64_t n)
+{
+    __atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+static void chan_stats_max(uint64_t* counter, uint64_t value)
+{
+    uint64_t current = __atomic_load_n(counter, __ATOMIC_RELAXED);
+    while (value > current && !__atomic_compare_exchange_n(counter, &current,
+            value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+// Adds a send to receive time to the latency histogram.
+static void chan_stats_latency(chan_stats_state_t* stats, uint64_t ns)
+{
+    int bucket = ns < 2 ? 0 : 63 - __builtin_clzll(ns);
+    if (bucket >= CHAN_STATS_BUCKETS)
+    {
+        bucket = CHAN_STATS_BUCKETS - 1;
+    }
+    chan_stats_add(&stats->counters.latency[bucket], 1);
+}
+
+// Waits on one of the channel conditions like chan_cond_wait, counting the
+// time spent parked towards the channel statistics. Must be called with m_mu
+// held.
+static int chan_park(chan_t* chan, chan_cond_t* cond,
+    const struct timespec* deadline)
+{
+    return chan_park_side(chan, cond, deadline, cond == chan_w_cond(chan));
+}
+
+// Waits on cond like chan_park, counting the time spent parked towards senders
+// if send is non-zero and towards receivers otherwise. Must be called with
+// m_mu held.
+static int chan_park_side(chan_t* chan, chan_cond_t* cond,
+    const struct timespec* deadline, int send)
+{
+    chan_stats_state_t* stats = chan_stats_get(chan);
+    if (!stats)
+    {
+        return chan_cond_wait(cond, &chan->m_mu, deadline);
+    }
+
+    uint64_t start = chan_stats_now();
+    int rc = chan_cond_wait(cond, &chan->m_mu, deadline);
+    uint64_t elapsed = chan_stats_now() - start;
+
+    chan_stats_t* counters = &stats->counters;
+    if (send)
+    {
+        chan_stats_add(&counters->send_blocks, 1);
+        chan_stats_add(&counters->send_blocked_ns, elapsed);
+        chan_stats_max(&counters->send_blocked_max_ns, elapsed);
+    }
+    else
+    {
+        chan_stats_add(&counters->recv_blocks, 1);
+        chan_stats_add(&counters->recv_blocked_ns, elapsed);
+        chan_stats_max(&counters->recv_blocked_max_ns, elapsed);
+    }
+    return rc;
+}
+
+// Records n values added to the buffer of a mutex-guarded buffered channel.
+// Must be called with m_mu held.
+static void chan_stats_enqueued(chan_t* chan, int n)
+{
+    chan_stats_state_t* stats = chan_stats_get(chan);
+    if (!stats || n <= 0)
+    {
+        return;
+    }
+
+    // Priority channels do not receive in send order, so their values are
+    // not stamped and only the counters are kept.
+    if (stats->stamp_count)
+    {
+        uint64_t now = chan_stats_now();
+        int i;
+        for (i = 0; i < n; i++)
+        {
+            stats->stamps[stats->enqueued++ % stats->stamp_count] = now;
+        }
+    }
+    chan_stats_add(&stats->counters.sends, n);
+    chan_stats_max(&stats->counters.high_water, buffered_chan_size(chan));
+}
+
+// Records the oldest value of a mutex-guarded buffered channel being evicted
+// by its overflow policy, which is not a receive. Must be called with m_mu
+// held.
+static void chan_stats_evicted(chan_t* chan)
+{
+    chan_stats_state_t* stats = chan_stats_get(chan);
+    if (stats && stats->stamp_count)
+    {
+        stats->dequeued++;
+    }
+}
+
+// Records n values removed from the buffer of a mutex-guarded buffered
+// channel. Must be called with m_mu held.
+static void chan_stats_dequeued(chan_t* chan, int n)
+{
+    chan_stats_state_t* stats = chan_stats_get(chan);
+    if (!stats || n <= 0)
+    {
+        return;
+    }
+
+    if (stats->stamp_count)
+    {
+        uint64_t now = chan_stats_now();
+        int i;
+        for (i = 0; i < n; i++)
+        {
+            // The stamp was overwritten if too many values were queued behind
+            // this one, and is 0 if it was queued before stats were enabled.
+            if (stats->enqueued - stats->dequeued <= stats->stamp_count)
+            {
+                uint64_t stamp =
+                    stats->stamps[stats->dequeued % stats->stamp_count];
+                if (stamp)
+                {
+                    chan_stats_latency(stats, now - stamp);
+                }
+            }
+            stats->dequeued++;
+        }
+    }
+    chan_stats_add(&stats->counters.recvs, n);
+}
+
+static void chan_stats_ring_pushed(chan_t* chan)
+{
+    chan_stats_state_t* stats = chan_stats_get(chan);
+    if (stats)
+    {
+        chan_stats_add(&stats->counters.sends, 1);
+        chan_stats_max(&stats->counters.high_water, chan_ring_size(chan));
+    }
+}
+
+static void chan_stats_ring_popped(chan_t* chan)
+{
+    chan_stats_state_t* stats = chan_stats_get(chan);
+    if (stats)
+    {
+        chan_stats_add(&stats->counters.recvs, 1);
+    }
+}
+
+// Returns the time to stamp a value passed through an unbuffered channel with,
+// or 0 if statistics are not enabled.
+static uint64_t chan_stats_stamp(chan_t* chan)
+{
+    return chan_stats_get(chan) ? chan_stats_now() : 0;
+}
+
+// Records a value handed from a sender to a receiver of an unbuffered channel,
+// and its latency if it was stamped when published. Must be called with m_mu
+// held.
+static void chan_stats_handed_off(chan_t* chan, uint64_t published)
+{
+    chan_stats_state_t* stats = chan_stats_get(chan);
+    if (stats)
+    {
+        chan_stats_add(&stats->counters.sends, 1);
+        chan_stats_add(&stats->counters.recvs, 1);
+        chan_stats_delivered(chan, published);
+    }
+}
+
+// Records the latency of an unbuffered value stamped when published, once its
+// receiver has it.
+static void chan_stats_delivered(chan_t* chan, uint64_t published)
+{
+    chan_stats_state_t* stats = chan_stats_get(chan);
+    if (stats && published)
+    {
+        chan_stats_latency(stats, chan_stats_now() - published);
+    }
+}
+
+// Returns non-zero if a receive on the channel would not block.
+static int chan_recv_pending(chan_t* chan)
+{
+    if (__atomic_load_n(&chan->closed, __ATOMIC_RELAXED))
+    {
+        return 1;
+    }
+    if (chan->queue)
+    {
+        return __atomic_load_n(&chan->queue->size, __ATOMIC_RELAXED) > 0;
+    }
+    if (chan->seg)
+    {
+        return __atomic_load_n(&chan->seg->size, __ATOMIC_RELAXED) > 0;
+    }
+    if (chan->prio)
+    {
+        return __atomic_load_n(&chan->prio->size, __ATOMIC_RELAXED) > 0;
+    }
+    if (chan_is_ring(chan))
+    {
+        return chan_ring_size(chan) > 0;
+    }
+    if (chan->bytes)
+    {
+        return byte_queue_used(chan->bytes) > 0;
+    }
+    return __atomic_load_n(&chan->w_waiting, __ATOMIC_RELAXED) > 0;
+}
+
+// Makes the readiness descriptor readable after a value was added, unless it
+// already is. Only the sender that flips fd_ready writes to the descriptor,
+// so a busy channel makes no system calls here.
+static void chan_fd_set(chan_t* chan)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&chan->fd_ready, __ATOMIC_RELAXED) == 0 &&
+        __atomic_exchange_n(&chan->fd_ready, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        uint64_t one = 1;
+        ssize_t rc = write(chan->fd, &one, sizeof(one));
+        (void) rc;
+    }
+}
+
+// Makes the readiness descriptor unreadable after the channel looked empty.
+// The descriptor is drained before fd_ready is cleared and the channel is
+// checked again afterwards, so a value added meanwhile leaves it readable.
+static void chan_fd_clear(chan_t* chan)
+{
+    if (__atomic_load_n(&chan->fd_ready, __ATOMIC_SEQ_CST) == 1)
+    {
+        uint64_t count;
+        ssize_t rc = read(chan->fd, &count, sizeof(count));
+        (void) rc;
+        __atomic_store_n(&chan->fd_ready, 0, __ATOMIC_SEQ_CST);
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (chan_recv_pending(chan))
+    {
+        chan_fd_set(chan);
+    }
+}
+
+// Called whenever a receive on the channel may have become possible. Marks
+// the channel ready in its readiness descriptor and its channel set, if it
+// has either; otherwise this costs two loads.
+static inline void chan_ready(chan_t* chan)
+{
+    if (__atomic_load_n(&chan->fd, __ATOMIC_RELAXED) >= 0)
+    {
+        chan_fd_set(chan);
+    }
+
+    chan_set_t* set = __atomic_load_n(&chan->set, __ATOMIC_ACQUIRE);
+    if (set)
+    {
+        chan_set_mark(set, chan->set_index);
+    }
+}
+
+// Sends a value into the channel. If the channel is unbuffered, this will
+// block until a receiver receives the value. If the channel is buffered and at
+// capacity, this will block until a receiver receives a value. Returns 0 if
+// the send succeeded or -1 if it failed. If -1 is returned, errno will be set.
+int chan_send(chan_t* chan, void* data)
+{
+    return chan_send_deadline(chan, data, NULL);
+}
+
+// Sends a value into a priority channel at the given level, blocking while
+// that level is at capacity. Returns 0 if the send succeeded or -1 if it
+// failed. If -1 is returned, errno will be set, to EINVAL if the channel is
+// not a priority channel or the level is out of range.
+int chan_send_prio(chan_t* chan, void* data, int level)
+{
+    if (!chan->prio || level < 0 || level >= chan->prio->level_count)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return buffered_chan_send(chan, data, level, NULL);
+}
+
+// Receives a value from the channel. This will block until there is data to
+// receive. Returns 0 if the receive succeeded or -1 if it failed. If -1 is
+// returned, errno will be set.
+int chan_recv(chan_t* chan, void** data)
+{
+    return chan_recv_deadline(chan, data, NULL);
+}
+
+// Like chan_send, but gives up if the send cannot complete within timeout.
+// A NULL timeout blocks like chan_send and a zero timeout only sends if it can
+// do so immediately. Returns 0 if the send succeeded or -1 if it failed. If
+// the timeout expired, errno will be set to ETIMEDOUT.
+int chan_send_timeout(chan_t* chan, void* data,
+    const struct timespec* timeout)
+{
+    if (!timeout)
+    {
+        return chan_send(chan, data);
+    }
+
+    struct timespec deadline;
+    chan_deadline(&deadline, timeout);
+    return chan_send_deadline(chan, data, &deadline);
+}
+
+// Like chan_recv, but gives up if nothing can be received within timeout. A
+// NULL timeout blocks like chan_recv and a zero timeout only receives if a
+// value is available immediately. Returns 0 if the receive succeeded or -1 if
+// it failed. If the timeout expired, errno will be set to ETIMEDOUT.
+int chan_recv_timeout(chan_t* chan, void** data,
+    const struct timespec* timeout)
+{
+    if (!timeout)
+    {
+        return chan_recv(chan, data);
+    }
+
+    struct timespec deadline;
+    chan_deadline(&deadline, timeout);
+    return chan_recv_deadline(chan, data, &deadline);
+}
+
+// Sends a value only if that can be done without blocking: into a buffered
+// channel with room, or to a receiver already blocked on an unbuffered
+// channel. A channel whose overflow policy never blocks applies it instead.
+// Readiness is probed without locking first, so a failed attempt is almost
+// free, and a send that goes ahead takes the channel lock once, or not at all
+// for CHAN_SPSC and CHAN_MPMC channels. Returns 0 if the value was sent or -1
+// with errno set, to EAGAIN if the send would block or EPIPE if the channel
+// is closed.
+int chan_try_send(chan_t* chan, void* data)
+{
+    if (chan->elem_size || chan->bytes)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (__atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE))
+    {
+        errno = EPIPE;
+        return -1;
+    }
+
+    if (chan_is_ring(chan))
+    {
+        if (ring_push(chan, data) == 0)
+        {
+            ring_chan_wake(chan, &chan->r_waiting, chan_r_cond(chan),
+                &chan->r_select, 0);
+            return 0;
+        }
+        if (chan->overflow != CHAN_OVERFLOW_BLOCK)
+        {
+            return ring_chan_send(chan, data, NULL);
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (chan_is_buffered(chan) && chan->overflow != CHAN_OVERFLOW_BLOCK)
+    {
+        // Never blocks.
+        return buffered_chan_send(chan, data, 0, NULL);
+    }
+
+    int ready = chan_is_buffered(chan) ? buffered_chan_can_send(chan) :
+        __atomic_load_n(&chan->r_waiting, __ATOMIC_RELAXED) > 0;
+    if (!ready)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    pthread_mutex_lock(&chan->m_mu);
+    int rc = chan_select_try_send(chan, &data);
+    pthread_mutex_unlock(&chan->m_mu);
+    if (rc <= 0)
+    {
+        errno = rc < 0 ? EPIPE : EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+// Receives a value only if one is available without blocking, from the
+// buffer or from a sender already blocked on an unbuffered channel. Like
+// chan_try_send, it probes without locking and takes the channel lock at most
+// once. Returns 0 if a value was received or -1 with errno set, to EAGAIN if
+// the receive would block or EPIPE if the channel is closed and empty.
+int chan_try_recv(chan_t* chan, void** data)
+{
+    if (chan->elem_size || chan->bytes)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (chan_is_ring(chan))
+    {
+        void* msg;
+        if (ring_pop(chan, &msg) != 0)
+        {
+            errno = __atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE) &&
+                chan_ring_size(chan) == 0 ? EPIPE : EAGAIN;
+            return -1;
+        }
+        if (data)
+        {
+            *data = msg;
+        }
+        ring_chan_wake(chan, &chan->w_waiting, chan_w_cond(chan),
+            &chan->w_select, 0);
+        return 0;
+    }
+
+    if (!chan_recv_pending(chan))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    pthread_mutex_lock(&chan->m_mu);
+    int rc = chan_select_try_recv(chan, data);
+    pthread_mutex_unlock(&chan->m_mu);
+    if (rc <= 0)
+    {
+        errno = rc < 0 ? EPIPE : EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+static int chan_send_deadline(chan_t* chan, void* data,
+    const struct timespec* deadline)
+{
+    if (chan->elem_size || chan->bytes)
+    {
+        // Sized channels only carry values through the typed interface and
+        // byte channels through reserve/commit and peek/consume.
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (chan_is_ring(chan))
+    {
+        return ring_chan_send(chan, data, deadline);
+    }
+
+    // Both check for a closed channel under the lock they take anyway.
+    return chan_is_buffered(chan) ?
+        buffered_chan_send(chan, data, 0, deadline) :
+        unbuffered_chan_send(chan, data, deadline);
+}
+
+static int chan_recv_deadline(chan_t* chan, void** data,
+    const struct timespec* deadline)
+{
+    if (chan->elem_size || chan->bytes)
+    {
+        // Sized channels only carry values through the typed interface and
+        // byte channels through reserve/commit and peek/consume.
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (chan_is_ring(chan))
+    {
+        return ring_chan_recv(chan, data, deadline);
+    }
+
+    return chan_is_buffered(chan) ?
+        buffered_chan_recv(chan, data, deadline) :
+        unbuffered_chan_recv(chan, data, deadline);
+}
+
+// Buffered channels keep their values in a fixed-size queue, in a segmented
+// one when unbounded or in one ring per level when prioritized. These route to
+// whichever the channel has and must be called with m_mu held. The level is
+// ignored by all but priority channels.
+
+static inline int buffered_chan_full(chan_t* chan, int level)
+{
+    if (chan->prio)
+    {
+        return prio_queue_full(chan->prio, level);
+    }
+    return chan->queue && chan->queue->size == chan->queue->capacity;
+}
+
+static size_t buffered_chan_size(chan_t* chan)
+{
+    return chan->queue ? (size_t) chan->queue->size :
+        chan->prio ? chan->prio->size : chan->seg->size;
+}
+
+static inline int buffered_chan_add(chan_t* chan, void* data, int level)
+{
+    int success = chan->queue ? queue_add(chan->queue, data) :
+        chan->prio ? prio_queue_add(chan->prio, level, data) :
+        seg_queue_add(chan->seg, data);
+    if (success == 0)
+    {
+        chan_stats_enqueued(chan, 1);
+        chan_ready(chan);
+    }
+    return success;
+}
+
+static inline void* buffered_chan_remove(chan_t* chan)
+{
+    void* data = chan->queue ? queue_remove(chan->queue) :
+        chan->prio ? prio_queue_remove(chan->prio) :
+        seg_queue_remove(chan->seg);
+    chan_stats_dequeued(chan, 1);
+    if (chan->fd >= 0 && buffered_chan_size(chan) == 0)
+    {
+        chan_fd_clear(chan);
+    }
+    return data;
+}
+
+static inline int buffered_chan_add_many(chan_t* chan, void* data[],
+    int count, int level)
+{
+    int added = chan->queue ? queue_add_many(chan->queue, data, count) :
+        chan->prio ? prio_queue_add_many(chan->prio, level, data, count) :
+        seg_queue_add_many(chan->seg, data, count);
+    chan_stats_enqueued(chan, added);
+    if (added > 0)
+    {
+        chan_ready(chan);
+    }
+    return added;
+}
+
+static inline int buffered_chan_remove_many(chan_t* chan, void* data[],
+    int count)
+{
+    int removed = chan->queue ? queue_remove_many(chan->queue, data, count) :
+        chan->prio ? prio_queue_remove_many(chan->prio, data, count) :
+        seg_queue_remove_many(chan->seg, data, count);
+    chan_stats_dequeued(chan, removed);
+    if (chan->fd >= 0 && buffered_chan_size(chan) == 0)
+    {
+        chan_fd_clear(chan);
+    }
+    return removed;
+}
+
+// Wakes a sender blocked on a full buffered channel after one value was
+// removed. Senders on a priority channel may be waiting for different levels,
+// so all of them are woken for the one whose level has room to proceed.
+static inline void buffered_chan_wake_sender(chan_t* chan)
+{
+    if (chan->prio)
+    {
+        chan_cond_broadcast(chan_w_cond(chan));
+    }
+    else
+    {
+        chan_cond_signal(chan_w_cond(chan));
+    }
+}
+
+// Applies the overflow policy of a full buffered channel to a send of data
+// at level. Must be called with m_mu held. Returns 1 if the oldest value at
+// level was evicted into dropped to make room, 0 if data was discarded, in
+// which case it is stored in dropped, or -1 with errno set to EAGAIN if the
+// send is refused.
+static int buffered_chan_overflow(chan_t* chan, void* data, int level,
+    void** dropped)
+{
+    __atomic_add_fetch(&chan->dropped, 1, __ATOMIC_RELAXED);
+    if (chan->overflow == CHAN_OVERFLOW_FAIL)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (chan->overflow == CHAN_OVERFLOW_DROP_NEWEST)
+    {
+        *dropped = data;
+        return 0;
+    }
+
+    *dropped = chan->queue ? queue_remove(chan->queue) :
+        prio_queue_remove_level(chan->prio, level);
+    chan_stats_evicted(chan);
+    return 1;
+}
+
+// Hands a value discarded by the overflow policy to the channel's drop
+// callback. Must be called without m_mu held.
+static void chan_drop(chan_t* chan, void* value)
+{
+    if (chan->on_drop)
+    {
+        chan->on_drop(value);
+    }
+}
+
+static int buffered_chan_send(chan_t* chan, void* data, int level,
+    const struct timespec* deadline)
+{
+    pthread_mutex_lock(&chan->m_mu);
+    if (chan->closed)
+    {
+        // Cannot send on closed channel.
+        pthread_mutex_unlock(&chan->m_mu);
+        errno = EPIPE;
+        return -1;
+    }
+
+    int evicted = 0;
+    void* dropped = NULL;
+    if (buffered_chan_full(chan, level))
+    {
+        if (chan->overflow != CHAN_OVERFLOW_BLOCK)
+        {
+            evicted = buffered_chan_overflow(chan, data, level, &dropped);
+            if (evicted <= 0)
+            {
+                pthread_mutex_unlock(&chan->m_mu);
+                if (evicted == 0)
+                {
+                    chan_drop(chan, dropped);
+                }
+                return evicted;
+            }
+        }
+        else
+        {
+            // Spin briefly in case a receiver is about to free a slot.
+            pthread_mutex_unlock(&chan->m_mu);
+            chan_spin(chan, buffered_chan_can_send, deadline);
+            pthread_mutex_lock(&chan->m_mu);
+        }
+    }
+
+    while (buffered_chan_full(chan, level))
+    {
+        if (chan->closed)
+        {
+            pthread_mutex_unlock(&chan->m_mu);
+            errno = EPIPE;
+            return -1;
+        }
+
+        // Block until something is removed.
+        chan->w_waiting++;
+        int rc = chan_park(chan, chan_w_cond(chan), deadline);
+        chan->w_waiting--;
+
+        if (rc == ETIMEDOUT && buffered_chan_full(chan, level))
+        {
+            pthread_mutex_unlock(&chan->m_mu);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+
+    int success = buffered_chan_add(chan, data, level);
+
+    if (chan->r_waiting > 0)
+    {
+        // Signal waiting reader.
+        chan_cond_signal(chan_r_cond(chan));
+    }
+    chan_notify_select(chan->r_select);
+
+    pthread_mutex_unlock(&chan->m_mu);
+    if (evicted)
+    {
+        chan_drop(chan, dropped);
+    }
+    return success;
+}
+
+static int buffered_chan_recv(chan_t* chan, void** data,
+    const struct timespec* deadline)
+{
+    pthread_mutex_lock(&chan->m_mu);
+    if (buffered_chan_size(chan) == 0 && !chan->closed)
+    {
+        // Spin briefly in case a sender is about to add something.
+        pthread_mutex_unlock(&chan->m_mu);
+        chan_spin(chan, buffered_chan_can_recv, deadline);
+        pthread_mutex_lock(&chan->m_mu);
+    }
+
+    while (buffered_chan_size(chan) == 0)
+    {
+        if (chan->closed)
+        {
+            pthread_mutex_unlock(&chan->m_mu);
+            errno = EPIPE;
+            return -1;
+        }
+
+        // Block until something is added.
+        chan->r_waiting++;
+        int rc = chan_park(chan, chan_r_cond(chan), deadline);
+        chan->r_waiting--;
+
+        if (rc == ETIMEDOUT && buffered_chan_size(chan) == 0)
+        {
+            pthread_mutex_unlock(&chan->m_mu);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+
+    void* msg = buffered_chan_remove(chan);
+    if (data)
+    {
+        *data = msg;
+    }
+
+    if (chan->w_waiting > 0)
+    {
+        // Signal waiting writer.
+        buffered_chan_wake_sender(chan);
+    }
+    chan_notify_select(chan->w_select);
+
+    pthread_mutex_unlock(&chan->m_mu);
+    return 0;
+}
+
+// Adds a value to the lock-free ring backing the channel. Returns 0 if the
+// add succeeded or -1 if the ring is full.
+static inline int ring_push(chan_t* chan, void* data)
+{
+    int success = chan->spsc ?
+        spsc_queue_push(chan->spsc, data) :
+        mpmc_queue_push(chan->mpmc, data);
+    if (success == 0)
+    {
+        if (__atomic_load_n(&chan->stats, __ATOMIC_RELAXED))
+        {
+            chan_stats_ring_pushed(chan);
+        }
+        chan_ready(chan);
+    }
+    return success;
+}
+
+// Removes a value from the lock-free ring backing the channel. Returns 0 if a
+// value was removed or -1 if the ring is empty.
+static inline int ring_pop(chan_t* chan, void** data)
+{
+    int success = chan->spsc ?
+        spsc_queue_pop(chan->spsc, data) :
+        mpmc_queue_pop(chan->mpmc, data);
+    if (success == 0)
+    {
+        if (__atomic_load_n(&chan->stats, __ATOMIC_RELAXED))
+        {
+            chan_stats_ring_popped(chan);
+        }
+        if (__atomic_load_n(&chan->fd, __ATOMIC_RELAXED) >= 0 &&
+            chan_ring_size(chan) == 0)
+        {
+            chan_fd_clear(chan);
+        }
+    }
+    return success;
+}
+
+// Applies the overflow policy of a full ring channel to a send of data, like
+// buffered_chan_overflow. Returns 1 if the oldest value was evicted and the
+// push should be retried, 0 if data was discarded or -1 with errno set to
+// EAGAIN if the send is refused.
+static int ring_chan_overflow(chan_t* chan, void* data)
+{
+    if (chan->overflow == CHAN_OVERFLOW_DROP_OLDEST)
+    {
+        // Receivers may take the value first, in which case the retried push
+        // finds the slot they freed.
+        void* oldest;
+        if (mpmc_queue_pop(chan->mpmc, &oldest) == 0)
+        {
+            __atomic_add_fetch(&chan->dropped, 1, __ATOMIC_RELAXED);
+            chan_drop(chan, oldest);
+        }
+        return 1;
+    }
+
+    __atomic_add_fetch(&chan->dropped, 1, __ATOMIC_RELAXED);
+    if (chan->overflow == CHAN_OVERFLOW_FAIL)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    chan_drop(chan, data);
+    return 0;
+}
+
+static int ring_chan_send(chan_t* chan, void* data,
+    const struct timespec* deadline)
+{
+    if (__atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE))
+    {
+        // Cannot send on closed channel.
+        errno = EPIPE;
+        return -1;
+    }
+
+    int spun = 0;
+    while (ring_push(chan, data) != 0)
+    {
+        if (chan->overflow != CHAN_OVERFLOW_BLOCK)
+        {
+            int rc = ring_chan_overflow(chan, data);
+            if (rc <= 0)
+            {
+                return rc;
+            }
+
+            // The oldest value was evicted, push into the slot it freed.
+            continue;
+        }
+
+        if (!spun)
+        {
+            // Spin briefly in case a receiver is about to free a slot.
+            spun = 1;
+            if (chan_spin(chan, ring_chan_can_send, deadline))
+            {
+                continue;
+            }
+        }
+
+        // Ring is full, park until a receiver frees a slot. The waiting
+        // count is published before the ring is re-checked so the receiver
+        // either sees us waiting or we see the slot it freed.
+        pthread_mutex_lock(&chan->m_mu);
+        __atomic_add_fetch(&chan->w_waiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int rc = 0;
+        if (!chan->closed && chan_ring_size(chan) >= chan_ring_capacity(chan))
+        {
+            rc = chan_park(chan, chan_w_cond(chan), deadline);
+        }
+        __atomic_sub_fetch(&chan->w_waiting, 1, __ATOMIC_SEQ_CST);
+        int closed = chan->closed;
+        pthread_mutex_unlock(&chan->m_mu);
+
+        if (closed)
+        {
+            errno = EPIPE;
+            return -1;
+        }
+
+        if (rc == ETIMEDOUT)
+        {
+            // Last attempt in case a slot was freed as we timed out.
+            if (ring_push(chan, data) == 0)
+            {
+                break;
+            }
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+
+    ring_chan_wake(chan, &chan->r_waiting, chan_r_cond(chan), &chan->r_select, 0);
+    return 0;
+}
+
+static int ring_chan_recv(chan_t* chan, void** data,
+    const struct timespec* deadline)
+{
+    void* msg;
+    int spun = 0;
+    while (ring_pop(chan, &msg) != 0)
+    {
+        if (__atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE))
+        {
+            // Anything sent before the close is still delivered.
+            if (ring_pop(chan, &msg) == 0)
+            {
+                break;
+            }
+            errno = EPIPE;
+            return -1;
+        }
+
+        if (!spun)
+        {
+            // Spin briefly in case a sender is about to add something.
+            spun = 1;
+            if (chan_spin(chan, ring_chan_can_recv, deadline))
+            {
+                continue;
+            }
+        }
+
+        // Ring is empty, park until a sender adds something. A value that
+        // is claimed but not yet published counts towards the size, so we
+        // retry instead of parking on it.
+        pthread_mutex_lock(&chan->m_mu);
+        __atomic_add_fetch(&chan->r_waiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int rc = 0;
+        if (!chan->closed && chan_ring_size(chan) == 0)
+        {
+            rc = chan_park(chan, chan_r_cond(chan), deadline);
+        }
+        __atomic_sub_fetch(&chan->r_waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&chan->m_mu);
+
+        if (rc == ETIMEDOUT)
+        {
+            // Last attempt in case a value arrived as we timed out.
+            if (ring_pop(chan, &msg) == 0)
+            {
+                break;
+            }
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+
+    if (data)
+    {
+        *data = msg;
+    }
+
+    ring_chan_wake(chan, &chan->w_waiting, chan_w_cond(chan), &chan->w_select, 0);
+    return 0;
+}
+
+// Wakes one thread, or all of them if all is set, parked on the other side of
+// a lock-free ring channel along with any selects waiting on that side. In the
+// common case nobody is waiting and this costs a fence and two loads.
+static void ring_chan_wake(chan_t* chan, int* waiting, chan_cond_t* cond,
+    select_link_t** select, int all)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED) > 0 ||
+        __atomic_load_n(select, __ATOMIC_RELAXED) != NULL)
+    {
+        pthread_mutex_lock(&chan->m_mu);
+        if (all)
+        {
+            chan_cond_broadcast(cond);
+        }
+        else
+        {
+            chan_cond_signal(cond);
+        }
+        chan_notify_select(*select);
+        pthread_mutex_unlock(&chan->m_mu);
+    }
+}
+
+static int unbuffered_chan_send(chan_t* chan, void* data,
+    const struct timespec* deadline)
+{
+    pthread_mutex_lock(&chan->m_mu);
+
+    if (chan->closed)
+    {
+        pthread_mutex_unlock(&chan->m_mu);
+        errno = EPIPE;
+        return -1;
+    }
+
+    chan_waiter_t* receiver = chan_waiter_pop(chan, 0);
+    if (receiver)
+    {
+        // Hand the value straight to the receiver that has waited longest and
+        // wake only that one.
+        unbuffered_chan_give(chan, receiver, data);
+        pthread_mutex_unlock(&chan->m_mu);
+        return 0;
+    }
+
+    chan_waiter_t self;
+    if (chan_cond_init(&self.cond) != 0)
+    {
+        pthread_mutex_unlock(&chan->m_mu);
+        errno = ENOMEM;
+        return -1;
+    }
+    self.data = data;
+    self.published = chan_stats_stamp(chan);
+    self.done = 0;
+    self.select = NULL;
+    chan_waiter_push(&chan->w_head, &chan->w_tail, &self);
+    chan_waiting_add(&chan->w_waiting, 1);
+    chan_ready(chan);
+    chan_notify_select(chan->r_select);
+
+    return unbuffered_chan_wait(chan, &self, 1, deadline);
+}
+
+static int unbuffered_chan_recv(chan_t* chan, void** data,
+    const struct timespec* deadline)
+{
+    pthread_mutex_lock(&chan->m_mu);
+
+    if (chan->closed)
+    {
+        pthread_mutex_unlock(&chan->m_mu);
+        errno = EPIPE;
+        return -1;
+    }
+
+    chan_waiter_t* sender = chan_waiter_pop(chan, 1);
+    if (sender)
+    {
+        // Take the value of the sender that has waited longest and release
+        // only that one.
+        unbuffered_chan_copy(chan, data, unbuffered_chan_take(chan, sender));
+        pthread_mutex_unlock(&chan->m_mu);
+        return 0;
+    }
+
+    chan_waiter_t self;
+    if (chan_cond_init(&self.cond) != 0)
+    {
+        pthread_mutex_unlock(&chan->m_mu);
+        errno = ENOMEM;
+        return -1;
+    }
+    self.data = data;
+    self.published = 0;
+    self.done = 0;
+    self.select = NULL;
+    chan_waiter_push(&chan->r_head, &chan->r_tail, &self);
+    chan_waiting_add(&chan->r_waiting, 1);
+
+    // A select waiting to send can now proceed.
+    chan_notify_select(chan->w_select);
+
+    return unbuffered_chan_wait(chan, &self, 0, deadline);
+}
+
+// Parks a sender or receiver queued on an unbuffered channel until another
+// thread pairs with it, the channel is closed or the deadline passes. Must be
+// called with m_mu held, which is released. Returns 0 if the waiter was paired
+// or -1 with errno set otherwise, in which case it has left the queue.
+static int unbuffered_chan_wait(chan_t* chan, chan_waiter_t* waiter, int send,
+    const struct timespec* deadline)
+{
+    int rc = 0;
+    while (!waiter->done && !chan->closed && rc != ETIMEDOUT)
+    {
+        rc = chan_park_side(chan, &waiter->cond, deadline, send);
+    }
+
+    int success = 0;
+    if (!waiter->done)
+    {
+        if (send)
+        {
+            chan_waiter_unlink(&chan->w_head, &chan->w_tail, waiter);
+            chan_waiting_add(&chan->w_waiting, -1);
+            if (chan->fd >= 0)
+            {
+                chan_fd_clear(chan);
+            }
+        }
+        else
+        {
+            chan_waiter_unlink(&chan->r_head, &chan->r_tail, waiter);
+            chan_waiting_add(&chan->r_waiting, -1);
+        }
+        errno = chan->closed ? EPIPE : ETIMEDOUT;
+        success = -1;
+    }
+    else if (!send)
+    {
+        chan_stats_delivered(chan, waiter->published);
+    }
+
+    // Whoever paired with the waiter signaled it under m_mu, so it is done
+    // with the condition by now.
+    pthread_mutex_unlock(&chan->m_mu);
+    chan_cond_destroy(&waiter->cond);
+    return success;
+}
+
+// Completes a receiver just removed from the queue of an unbuffered channel
+// with a value and wakes it. Must be called with m_mu held.
+static void unbuffered_chan_give(chan_t* chan, chan_waiter_t* receiver,
+    void* data)
+{
+    chan_waiting_add(&chan->r_waiting, -1);
+    unbuffered_chan_copy(chan, receiver->data, data);
+    receiver->published = chan_stats_stamp(chan);
+    receiver->done = 1;
+    chan_stats_handed_off(chan, 0);
+    chan_waiter_wake(receiver);
+}
+
+// Completes a sender just removed from the queue of an unbuffered channel,
+// waking it, and returns its value. Must be called with m_mu held.
+static void* unbuffered_chan_take(chan_t* chan, chan_waiter_t* sender)
+{
+    chan_waiting_add(&chan->w_waiting, -1);
+    sender->done = 1;
+    chan_stats_handed_off(chan, sender->published);
+    if (chan->fd >= 0)
+    {
+        chan_fd_clear(chan);
+    }
+    chan_waiter_wake(sender);
+    return sender->select ? *(void**)sender->data : sender->data;
+}
+
+// Stores a value taken from an unbuffered sender where the receiver asked for
+// it. Sized channels copy the element straight out of the blocked sender, in
+// which case dst and value both point to elements.
+static void unbuffered_chan_copy(chan_t* chan, void* dst, void* value)
+{
+    if (chan->elem_size)
+    {
+        memcpy(dst, value, chan->elem_size);
+    }
+    else if (dst)
+    {
+        *(void**) dst = value;
+    }
+}
+
+static void chan_waiter_push(chan_waiter_t** head, chan_waiter_t** tail,
+    chan_waiter_t* waiter)
+{
+    waiter->queued = 1;
+    waiter->next = NULL;
+    waiter->prev = *tail;
+    if (*tail)
+    {
+        (*tail)->next = waiter;
+    }
+    else
+    {
+        *head = waiter;
+    }
+    *tail = waiter;
+}
+
+// Removes the sender (send) or receiver that has waited longest on an
+// unbuffered channel, for the caller to pair with. Waiters of selects already
+// claimed through another case are dropped on the way. Must be called with
+// m_mu held.
+static chan_waiter_t* chan_waiter_pop(chan_t* chan, int send)
+{
+    chan_waiter_t** head = send ? &chan->w_head : &chan->r_head;
+    chan_waiter_t** tail = send ? &chan->w_tail : &chan->r_tail;
+    chan_waiter_t* waiter;
+    while ((waiter = *head) != NULL)
+    {
+        chan_waiter_unlink(head, tail, waiter);
+        int expected = -1;
+        if (!waiter->select || __atomic_compare_exchange_n(
+            &waiter->select->selected, &expected, waiter->index, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            return waiter;
+        }
+
+        if (send)
+        {
+            chan_waiting_add(&chan->w_waiting, -1);
+            if (chan->fd >= 0)
+            {
+                chan_fd_clear(chan);
+            }
+        }
+        else
+        {
+            chan_waiting_add(&chan->r_waiting, -1);
+        }
+    }
+    return NULL;
+}
+
+static void chan_waiter_unlink(chan_waiter_t** head, chan_waiter_t** tail,
+    chan_waiter_t* waiter)
+{
+    if (waiter->prev)
+    {
+        waiter->prev->next = waiter->next;
+    }
+    else
+    {
+        *head = waiter->next;
+    }
+
+    if (waiter->next)
+    {
+        waiter->next->prev = waiter->prev;
+    }
+    else
+    {
+        *tail = waiter->prev;
+    }
+    waiter->queued = 0;
+}
+
+// Adjusts the count of senders or receivers queued on an unbuffered channel.
+// The lock-free probes read it without m_mu, which must be held here.
+static inline void chan_waiting_add(int* waiting, int n)
+{
+    __atomic_store_n(waiting, *waiting + n, __ATOMIC_RELAXED);
+}
+
+// Wakes a waiter that was paired or whose channel was closed. Must be called
+// with m_mu held.
+static void chan_waiter_wake(chan_waiter_t* waiter)
+{
+    select_waiter_t* select = waiter->select;
+    if (!select)
+    {
+        chan_cond_signal(&waiter->cond);
+        return;
+    }
+
+    pthread_mutex_lock(&select->mu);
+    select->signaled = 1;
+    chan_cond_signal(&select->cond);
+    pthread_mutex_unlock(&select->mu);
+}
+
+// Sends count values from data into the channel in order, blocking until all
+// of them have been sent. Buffered channels move as many values as fit each
+// time the channel is locked and wake receivers once per batch rather than
+// once per value. Returns the number of values sent, which is less than count
+// only if the channel was closed, or -1 if none were sent. If fewer than count
+// values were sent, errno will be set.
+int chan_send_many(chan_t* chan, void* data[], int count)
+{
+    if (chan->elem_size || chan->bytes)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int sent = 0;
+    if (chan_is_buffered(chan))
+    {
+        sent = buffered_chan_send_many(chan, data, count);
+    }
+    else if (chan_is_ring(chan))
+    {
+        sent = ring_chan_send_many(chan, data, count);
+    }
+    else
+    {
+        while (sent < count && unbuffered_chan_send(chan, data[sent], NULL) == 0)
+        {
+            sent++;
+        }
+    }
+
+    return sent > 0 || count <= 0 ? sent : -1;
+}
+
+// Receives up to count values from the channel into data, blocking until at
+// least one is available. Buffered channels move every available value, up to
+// count, under one lock acquisition. Returns the number of values received or
+// -1 if the channel is closed and empty. If -1 is returned, errno will be set.
+int chan_recv_many(chan_t* chan, void* data[], int count)
+{
+    return chan_recv_many_impl(chan, data, count, 1);
+}
+
+// Receives everything currently buffered in the channel, up to count values,
+// without blocking. Returns the number of values received, which is 0 if the
+// channel is empty, or -1 if it is closed and empty. If -1 is returned, errno
+// will be set.
+int chan_drain(chan_t* chan, void* data[], int count)
+{
+    return chan_recv_many_impl(chan, data, count, 0);
+}
+
+static int chan_recv_many_impl(chan_t* chan, void* data[], int count,
+    int block)
+{
+    if (chan->elem_size || chan->bytes)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (count <= 0)
+    {
+        return 0;
+    }
+
+    if (chan_is_buffered(chan))
+    {
+        return buffered_chan_recv_many(chan, data, count, block);
+    }
+
+    if (chan_is_ring(chan))
+    {
+        return ring_chan_recv_many(chan, data, count, block);
+    }
+
+    // Unbuffered channels hand over one value per sender.
+    if (block)
+    {
+        return unbuffered_chan_recv(chan, &data[0], NULL) == 0 ? 1 : -1;
+    }
+
+    pthread_mutex_lock(&chan->m_mu);
+    int received = chan_select_try_recv(chan, &data[0]);
+    pthread_mutex_unlock(&chan->m_mu);
+    if (received < 0)
+    {
+        errno = EPIPE;
+    }
+    return received;
+}
+
+static int buffered_chan_send_many(chan_t* chan, void* data[], int count)
+{
+    int sent = 0;
+    pthread_mutex_lock(&chan->m_mu);
+    while (sent < count)
+    {
+        if (chan->closed)
+        {
+            errno = EPIPE;
+            break;
+        }
+
+        if (buffered_chan_full(chan, 0))
+        {
+            if (chan->overflow != CHAN_OVERFLOW_BLOCK)
+            {
+                // Apply the overflow policy to the next value on its own.
+                pthread_mutex_unlock(&chan->m_mu);
+                if (buffered_chan_send(chan, data[sent], 0, NULL) != 0)
+                {
+                    return sent;
+                }
+                sent++;
+                pthread_mutex_lock(&chan->m_mu);
+                continue;
+            }
+
+            // Block until something is removed.
+            chan->w_waiting++;
+            chan_park(chan, chan_w_cond(chan), NULL);
+            chan->w_waiting--;
+            continue;
+        }
+
+        int added = buffered_chan_add_many(chan, &data[sent], count - sent,
+            0);
+        sent += added;
+        if (added == 0)
+        {
+            // Only an unbounded channel that cannot grow adds nothing.
+            break;
+        }
+
+        if (chan->r_waiting > 0)
+        {
+            // Signal waiting readers, all of them if there is enough data.
+            if (added > 1)
+            {
+                chan_cond_broadcast(chan_r_cond(chan));
+            }
+            else
+            {
+                chan_cond_signal(chan_r_cond(chan));
+            }
+        }
+        chan_notify_select(chan->r_select);
+    }
+
+    pthread_mutex_unlock(&chan->m_mu);
+    return sent;
+}
+
+static int buffered_chan_recv_many(chan_t* chan, void* data[], int count,
+    int block)
+{
+    pthread_mutex_lock(&chan->m_mu);
+    while (buffered_chan_size(chan) == 0)
+    {
+        if (chan->closed)
+        {
+            pthread_mutex_unlock(&chan->m_mu);
+            errno = EPIPE;
+            return -1;
+        }
+
+        if (!block)
+        {
+            pthread_mutex_unlock(&chan->m_mu);
+            return 0;
+        }
+
+        // Block until something is added.
+        chan->r_waiting++;
+        chan_park(chan, chan_r_cond(chan), NULL);
+        chan->r_waiting--;
+    }
+
+    int removed = buffered_chan_remove_many(chan, data, count);
+
+    if (chan->w_waiting > 0)
+    {
+        // Signal waiting writers, all of them if there is enough room.
+        if (removed > 1)
+        {
+            chan_cond_broadcast(chan_w_cond(chan));
+        }
+        else
+        {
+            buffered_chan_wake_sender(chan);
+        }
+    }
+    chan_notify_select(chan->w_select);
+
+    pthread_mutex_unlock(&chan->m_mu);
+    return removed;
+}
+
+static int ring_chan_send_many(chan_t* chan, void* data[], int count)
+{
+    int sent = 0;
+    while (sent < count)
+    {
+        if (__atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE))
+        {
+            errno = EPIPE;
+            break;
+        }
+
+        // Fill whatever space is free and wake receivers once.
+        int added = 0;
+        while (sent < count && ring_push(chan, data[sent]) == 0)
+        {
+            sent++;
+            added++;
+        }
+        if (added > 0)
+        {
+            ring_chan_wake(chan, &chan->r_waiting, chan_r_cond(chan),
+                &chan->r_select, added > 1);
+        }
+
+        // Park on the next value if the ring filled up.
+        if (sent < count)
+        {
+            if (ring_chan_send(chan, data[sent], NULL) != 0)
+            {
+                break;
+            }
+            sent++;
+        }
+    }
+    return sent;
+}
+
+static int ring_chan_recv_many(chan_t* chan, void* data[], int count,
+    int block)
+{
+    int received = 0;
+    while (received < count && ring_pop(chan, &data[received]) == 0)
+    {
+        received++;
+    }
+
+    if (received == 0)
+    {
+        if (!block)
+        {
+            if (__atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE) &&
+                chan_ring_size(chan) == 0)
+            {
+                errno = EPIPE;
+                return -1;
+            }
+            return 0;
+        }
+
+        // Park on the first value, then take whatever followed it.
+        if (ring_chan_recv(chan, &data[0], NULL) != 0)
+        {
+            return -1;
+        }
+        received = 1;
+        while (received < count && ring_pop(chan, &data[received]) == 0)
+        {
+            received++;
+        }
+    }
+
+    ring_chan_wake(chan, &chan->w_waiting, chan_w_cond(chan), &chan->w_select,
+        received > 1);
+    return received;
+}
+
+// Sends a copy of the element at elem on a sized channel. Buffered channels
+// copy it into the buffer. Unbuffered channels publish a pointer to it and
+// block until the receiver has copied it out.
+static int sized_chan_send(chan_t* chan, const void* elem)
+{
+    if (chan->shm)
+    {
+        return shm_chan_send(chan, elem);
+    }
+
+    if (!chan_is_buffered(chan))
+    {
+        return unbuffered_chan_send(chan, (void*) elem, NULL);
+    }
+
+    pthread_mutex_lock(&chan->m_mu);
+    if (chan->closed)
+    {
+        // Cannot send on closed channel.
+        pthread_mutex_unlock(&chan->m_mu);
+        errno = EPIPE;
+        return -1;
+    }
+
+    if (chan->queue->size == chan->queue->capacity)
+    {
+        pthread_mutex_unlock(&chan->m_mu);
+        chan_spin(chan, buffered_chan_can_send, NULL);
+        pthread_mutex_lock(&chan->m_mu);
+    }
+
+    while (chan->queue->size == chan->queue->capacity)
+    {
+        if (chan->closed)
+        {
+            pthread_mutex_unlock(&chan->m_mu);
+            errno = EPIPE;
+            return -1;
+        }
+
+        // Block until something is removed.
+        chan->w_waiting++;
+        chan_park(chan, chan_w_cond(chan), NULL);
+        chan->w_waiting--;
+    }
+
+    int success = queue_add_elem(chan->queue, elem);
+    if (success == 0)
+    {
+        chan_stats_enqueued(chan, 1);
+        chan_ready(chan);
+    }
+
+    if (chan->r_waiting > 0)
+    {
+        // Signal waiting reader.
+        chan_cond_signal(chan_r_cond(chan));
+    }
+
+    pthread_mutex_unlock(&chan->m_mu);
+    return success;
+}
+
+// Receives an element from a sized channel into elem.
+static int sized_chan_recv(chan_t* chan, void* elem)
+{
+    if (chan->shm)
+    {
+        return shm_chan_recv(chan, elem);
+    }
+
+    if (!chan_is_buffered(chan))
+    {
+        return unbuffered_chan_recv(chan, (void**) elem, NULL);
+    }
+
+    pthread_mutex_lock(&chan->m_mu);
+    if (chan->queue->size == 0 && !chan->closed)
+    {
+        pthread_mutex_unlock(&chan->m_mu);
+        chan_spin(chan, buffered_chan_can_recv, NULL);
+        pthread_mutex_lock(&chan->m_mu);
+    }
+
+    while (chan->queue->size == 0)
+    {
+        if (chan->closed)
+        {
+            pthread_mutex_unlock(&chan->m_mu);
+            errno = EPIPE;
+            return -1;
+        }
+
+        // Block until something is added.
+        chan->r_waiting++;
+        chan_park(chan, chan_r_cond(chan), NULL);
+        chan->r_waiting--;
+    }
+
+    queue_remove_elem(chan->queue, elem);
+    chan_stats_dequeued(chan, 1);
+    if (chan->fd >= 0 && chan->queue->size == 0)
+    {
+        chan_fd_clear(chan);
+    }
+
+    if (chan->w_waiting > 0)
+    {
+        // Signal waiting writer.
+        chan_cond_signal(chan_w_cond(chan));
+    }
+
+    pthread_mutex_unlock(&chan->m_mu);
+    return 0;
+}
+
+// Shared-memory channels keep all of their state in the mapping and only use
+// its process-shared lock and conditions, never the ones in chan_t.
+
+// Locks the shared-memory channel. If a process died holding the lock, the
+// lock is taken over and the channel is used as the dead process left it.
+static void shm_chan_lock(chan_shm_t* shm)
+{
+    int rc = pthread_mutex_lock(&shm->mu);
+#ifdef __linux__
+    if (rc == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&shm->mu);
+    }
+#else
+    (void) rc;
+#endif
+}
+
+static void shm_chan_wait(chan_shm_t* shm, pthread_cond_t* cond)
+{
+    int rc = pthread_cond_wait(cond, &shm->mu);
+#ifdef __linux__
+    if (rc == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(&shm->mu);
+    }
+#else
+    (void) rc;
+#endif
+}
+
+static inline char* shm_chan_slot(chan_shm_t* shm, size_t i)
+{
+    return (char*) shm + CHAN_SHM_HEADER + (i % shm->capacity) * shm->elem_size;
+}
+
+// Copies elem into a shared-memory channel, blocking while it is full.
+static int shm_chan_send(chan_t* chan, const void* elem)
+{
+    chan_shm_t* shm = chan->shm;
+    shm_chan_lock(shm);
+    while (shm->size == shm->capacity && !shm->closed)
+    {
+        // Block until something is removed.
+        shm->w_waiting++;
+        shm_chan_wait(shm, &shm->w_cond);
+        shm->w_waiting--;
+    }
+
+    if (shm->closed)
+    {
+        // Cannot send on closed channel.
+        pthread_mutex_unlock(&shm->mu);
+        errno = EPIPE;
+        return -1;
+    }
+
+    memcpy(shm_chan_slot(shm, shm->head + shm->size), elem, shm->elem_size);
+    shm->size++;
+
+    if (shm->r_waiting > 0)
+    {
+        // Signal waiting reader.
+        pthread_cond_signal(&shm->r_cond);
+    }
+
+    pthread_mutex_unlock(&shm->mu);
+    return 0;
+}
+
+// Copies the oldest element of a shared-memory channel into elem, blocking
+// while it is empty.
+static int shm_chan_recv(chan_t* chan, void* elem)
+{
+    chan_shm_t* shm = chan->shm;
+    shm_chan_lock(shm);
+    while (shm->size == 0)
+    {
+        if (shm->closed)
+        {
+            pthread_mutex_unlock(&shm->mu);
+            errno = EPIPE;
+            return -1;
+        }
+
+        // Block until something is added.
+        shm->r_waiting++;
+        shm_chan_wait(shm, &shm->r_cond);
+        shm->r_waiting--;
+    }
+
+    memcpy(elem, shm_chan_slot(shm, shm->head), shm->elem_size);
+    shm->head = (shm->head + 1) % shm->capacity;
+    shm->size--;
+
+    if (shm->w_waiting > 0)
+    {
+        // Signal waiting writer.
+        pthread_cond_signal(&shm->w_cond);
+    }
+
+    pthread_mutex_unlock(&shm->mu);
+    return 0;
+}
+
+static int shm_chan_close(chan_t* chan)
+{
+    chan_shm_t* shm = chan->shm;
+    int success = 0;
+    shm_chan_lock(shm);
+    if (shm->closed)
+    {
+        // Channel already closed.
+        success = -1;
+        errno = EPIPE;
+    }
+    else
+    {
+        __atomic_store_n(&shm->closed, 1, __ATOMIC_RELEASE);
+        pthread_cond_broadcast(&shm->r_cond);
+        pthread_cond_broadcast(&shm->w_cond);
+    }
+    pthread_mutex_unlock(&shm->mu);
+    return success;
+}
+
+// Reserves room for a message of up to len bytes in a byte channel and returns
+// a pointer to it, 8-byte aligned, for the caller to fill. Blocks until there
+// is room. The reservation holds w_mu until the same thread calls chan_commit.
+// Returns NULL if it failed, in which case errno will be set to EPIPE if the
+// channel is closed or EMSGSIZE if the message can never fit.
+void* chan_reserve(chan_t* chan, size_t len)
+{
+    if (!chan->bytes)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    chan_mutex_lock(&chan->w_mu, NULL);
+    void* buf;
+    for (;;)
+    {
+        if (__atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE))
+        {
+            // Cannot send on closed channel.
+            pthread_mutex_unlock(&chan->w_mu);
+            errno = EPIPE;
+            return NULL;
+        }
+
+        buf = byte_queue_reserve(chan->bytes, len);
+        if (!buf && errno == EAGAIN && byte_queue_used(chan->bytes) == 0)
+        {
+            // The ring is empty, but the message would straddle its end and
+            // there is no room for the padding as well. Hold off receivers,
+            // which never wait on w_mu, and move both ends to the front.
+            chan_mutex_lock(&chan->r_mu, NULL);
+            byte_queue_rewind(chan->bytes);
+            pthread_mutex_unlock(&chan->r_mu);
+            buf = byte_queue_reserve(chan->bytes, len);
+        }
+        if (buf)
+        {
+            break;
+        }
+        if (errno == EMSGSIZE)
+        {
+            pthread_mutex_unlock(&chan->w_mu);
+            return NULL;
+        }
+
+        // Ring is full, park until a receiver consumes enough. As with the
+        // lock-free rings, the waiting count is published before the ring is
+        // re-checked so the receiver either sees us waiting or we see the room
+        // it freed.
+        pthread_mutex_lock(&chan->m_mu);
+        __atomic_add_fetch(&chan->w_waiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!chan->closed && !byte_queue_fits(chan->bytes, len))
+        {
+            chan_park(chan, chan_w_cond(chan), NULL);
+        }
+        __atomic_sub_fetch(&chan->w_waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&chan->m_mu);
+    }
+    return buf;
+}
+
+// Publishes the message reserved by chan_reserve, len bytes long, to
+// receivers and releases w_mu. Returns 0 if the message was published or -1
+// with errno set to EINVAL if len is longer than the reservation, in which
+// case the reservation is still held.
+int chan_commit(chan_t* chan, size_t len)
+{
+    if (!chan->bytes || byte_queue_commit(chan->bytes, len) != 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_unlock(&chan->w_mu);
+
+    ring_chan_wake(chan, &chan->r_waiting, chan_r_cond(chan), &chan->r_select, 0);
+    chan_ready(chan);
+    return 0;
+}
+
+// Returns a pointer to the oldest message in a byte channel and stores its
+// length in len, blocking until there is one. The message is held, along with
+// r_mu, until the same thread calls chan_consume. Returns NULL if the channel
+// is closed and empty. If NULL is returned, errno will be set.
+const void* chan_peek_msg(chan_t* chan, size_t* len)
+{
+    if (!chan->bytes)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    chan_mutex_lock(&chan->r_mu, NULL);
+    const void* msg;
+    while (!(msg = byte_queue_peek(chan->bytes, len)))
+    {
+        if (__atomic_load_n(&chan->closed, __ATOMIC_ACQUIRE))
+        {
+            // Anything committed before the close is still delivered.
+            msg = byte_queue_peek(chan->bytes, len);
+            if (msg)
+            {
+                break;
+            }
+            pthread_mutex_unlock(&chan->r_mu);
+            errno = EPIPE;
+            return NULL;
+        }
+
+        // Ring is empty, park until a sender commits something. r_mu is
+        // released meanwhile so a sender can rewind the empty ring.
+        pthread_mutex_unlock(&chan->r_mu);
+        pthread_mutex_lock(&chan->m_mu);
+        __atomic_add_fetch(&chan->r_waiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!chan->closed && byte_queue_used(chan->bytes) == 0)
+        {
+            chan_park(chan, chan_r_cond(chan), NULL);
+        }
+        __atomic_sub_fetch(&chan->r_waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&chan->m_mu);
+        chan_mutex_lock(&chan->r_mu, NULL);
+    }
+    return msg;
+}
+
+// Removes the message returned by chan_peek_msg, freeing its room for
+// senders, and releases r_mu. Returns 0 on success.
+int chan_consume(chan_t* chan)
+{
+    if (!chan->bytes)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    byte_queue_consume(chan->bytes);
+    pthread_mutex_unlock(&chan->r_mu);
+
+    ring_chan_wake(chan, &chan->w_waiting, chan_w_cond(chan), &chan->w_select, 0);
+    if (__atomic_load_n(&chan->fd, __ATOMIC_RELAXED) >= 0 &&
+        byte_queue_used(chan->bytes) == 0)
+    {
+        chan_fd_clear(chan);
+    }
+    return 0;
+}
+
+// Returns the number of items in the channel buffer. If the channel is
+// unbuffered, this will return 0. For byte channels, this is the number of
+// bytes in use, including headers and padding. The size is read without
+// locking, so it is a snapshot that may be stale by the time it is used.
+int chan_size(chan_t* chan)
+{
+    int size = 0;
+    if (chan_is_buffered(chan))
+    {
+        size_t buffered = chan->queue ?
+            (size_t) __atomic_load_n(&chan->queue->size, __ATOMIC_RELAXED) :
+            chan->prio ?
+            __atomic_load_n(&chan->prio->size, __ATOMIC_RELAXED) :
+            __atomic_load_n(&chan->seg->size, __ATOMIC_RELAXED);
+        size = buffered > INT_MAX ? INT_MAX : (int) buffered;
+    }
+    else if (chan_is_ring(chan))
+    {
+        size = (int) chan_ring_size(chan);
+    }
+    else if (chan->bytes)
+    {
+        size_t used = byte_queue_used(chan->bytes);
+        size = used > INT_MAX ? INT_MAX : (int) used;
+    }
+    else if (chan->shm)
+    {
+        size = (int) __atomic_load_n(&chan->shm->size, __ATOMIC_RELAXED);
+    }
+    return size;
+}
+
+// A case of a select. waiter is what the select queues on an unbuffered
+// channel while it is blocked.
+typedef struct
+{
+    int           recv;
+    chan_t*       chan;
+    void*         msg_in;
+    int           index;
+    chan_waiter_t waiter;
+} select_op_t;
+
+// Most cases a select keeps its bookkeeping for on the stack. Larger selects
+// allocate it instead, since tasks run on small stacks without a guard page.
+#define CHAN_SELECT_STACK 16
+
+static int chan_select_impl(chan_t* recv_chans[], int recv_count,
+    void** recv_out, chan_t* send_chans[], int send_count, void* send_msgs[],
+    int block, const struct timespec* deadline);
+
+// A select statement chooses which of a set of possible send or receive
+// operations will proceed. The return value indicates which channel's
+// operation has proceeded. If more than one operation can proceed, one is
+// selected randomly. If none can proceed, -1 is returned. Select is intended
+// to be used in conjunction with a switch statement. In the case of a receive
+// operation, the received value will be pointed to by the provided pointer. In
+// the case of a send, the value at the same index as the channel will be sent.
+int chan_select(chan_t* recv_chans[], int recv_count, void** recv_out,
+    chan_t* send_chans[], int send_count, void* send_msgs[])
+{
+    return chan_select_impl(recv_chans, recv_count, recv_out,
+        send_chans, send_count, send_msgs, 0, NULL);
+}
+
+// Like chan_select, but blocks until one of the operations can proceed instead
+// of returning -1. Returns -1 and sets errno to EPIPE if every channel is
+// closed such that none of the operations can ever proceed.
+int chan_select_wait(chan_t* recv_chans[], int recv_count, void** recv_out,
+    chan_t* send_chans[], int send_count, void* send_msgs[])
+{
+    return chan_select_impl(recv_chans, recv_count, recv_out,
+        send_chans, send_count, send_msgs, 1, NULL);
+}
+
+// Like chan_select_wait, but gives up if none of the operations can proceed
+// within timeout. A NULL timeout blocks like chan_select_wait. If the timeout
+// expired, -1 is returned and errno is set to ETIMEDOUT.
+int chan_select_timeout(chan_t* recv_chans[], int recv_count, void** recv_out,
+    chan_t* send_chans[], int send_count, void* send_msgs[],
+    const struct timespec* timeout)
+{
+    if (!timeout)
+    {
+        return chan_select_wait(recv_chans, recv_count, recv_out,
+            send_chans, send_count, send_msgs);
+    }
+
+    struct timespec deadline;
+    chan_deadline(&deadline, timeout);
+    return chan_select_impl(recv_chans, recv_count, recv_out,
+        send_chans, send_count, send_msgs, 1, &deadline);
+}
+
+// Allocates and returns a new, empty channel set with room for capacity
+// channels. Sets errno and returns NULL if initialization failed.
+chan_set_t* chan_set_init(int capacity)
+{
+    if (capacity <= 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    chan_set_t* set = (chan_set_t*) malloc(sizeof(chan_set_t));
+    if (!set)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    set->words = (capacity + 63) / 64;
+    set->chans = (chan_t**) calloc(capacity, sizeof(chan_t*));
+    set->ready = (uint64_t*) calloc(set->words, sizeof(uint64_t));
+    set->done = (uint64_t*) calloc(set->words, sizeof(uint64_t));
+    if (!set->chans || !set->ready || !set->done)
+    {
+        free(set->chans);
+        free(set->ready);
+        free(set->done);
+        free(set);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&set->mu, NULL) != 0)
+    {
+        free(set->chans);
+        free(set->ready);
+        free(set->done);
+        free(set);
+        return NULL;
+    }
+
+    if (chan_cond_init(&set->cond) != 0)
+    {
+        pthread_mutex_destroy(&set->mu);
+        free(set->chans);
+        free(set->ready);
+        free(set->done);
+        free(set);
+        return NULL;
+    }
+
+    set->waiting = 0;
+    set->capacity = capacity;
+    set->count = 0;
+    set->done_count = 0;
+    set->cursor = 0;
+    return set;
+}
+
+// Releases the set resources, removing any channels still in it. No other
+// thread may be using the set or sending on its channels.
+void chan_set_dispose(chan_set_t* set)
+{
+    int i;
+    for (i = 0; i < set->capacity; i++)
+    {
+        if (set->chans[i])
+        {
+            __atomic_store_n(&set->chans[i]->set, NULL, __ATOMIC_RELEASE);
+        }
+    }
+
+    pthread_mutex_destroy(&set->mu);
+    chan_cond_destroy(&set->cond);
+    free(set->chans);
+    free(set->ready);
+    free(set->done);
+    free(set);
+}
+
+// Adds a channel to the set for receiving. A channel can be in at most one
+// set at a time. Returns the index the set's selects report the channel
+// under, or -1 if it could not be added. If -1 is returned, errno will be set,
+// to ENOSPC if the set is full, EBUSY if the channel is already in a set or
+// EINVAL if the channel does not carry pointers.
+int chan_set_add(chan_set_t* set, chan_t* chan)
+{
+    if (chan->elem_size || chan->bytes || chan->shm)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&set->mu);
+    if (__atomic_load_n(&chan->set, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_unlock(&set->mu);
+        errno = EBUSY;
+        return -1;
+    }
+
+    int index;
+    for (index = 0; index < set->capacity && set->chans[index]; index++)
+    {
+    }
+    if (index == set->capacity)
+    {
+        pthread_mutex_unlock(&set->mu);
+        errno = ENOSPC;
+        return -1;
+    }
+
+    chan->set_index = index;
+    __atomic_store_n(&set->chans[index], chan, __ATOMIC_RELEASE);
+    __atomic_store_n(&chan->set, set, __ATOMIC_SEQ_CST);
+    set->count++;
+    pthread_mutex_unlock(&set->mu);
+
+    // Values sent before the channel joined never marked it.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (chan_recv_pending(chan))
+    {
+        chan_set_mark(set, index);
+    }
+    return index;
+}
+
+// Removes a channel from the set. Must not be called while a select on the
+// set is running. Returns 0 if the channel was removed or -1 with errno set to
+// EINVAL if it is not in the set.
+int chan_set_remove(chan_set_t* set, chan_t* chan)
+{
+    pthread_mutex_lock(&set->mu);
+    if (__atomic_load_n(&chan->set, __ATOMIC_ACQUIRE) != set)
+    {
+        pthread_mutex_unlock(&set->mu);
+        errno = EINVAL;
+        return -1;
+    }
+
+    int index = chan->set_index;
+    uint64_t bit = 1ull << (index % 64);
+    __atomic_store_n(&chan->set, NULL, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&set->chans[index], NULL, __ATOMIC_RELEASE);
+    __atomic_and_fetch(&set->ready[index / 64], ~bit, __ATOMIC_SEQ_CST);
+    if (__atomic_fetch_and(&set->done[index / 64], ~bit, __ATOMIC_SEQ_CST) &
+        bit)
+    {
+        __atomic_sub_fetch(&set->done_count, 1, __ATOMIC_SEQ_CST);
+    }
+    set->count--;
+    pthread_mutex_unlock(&set->mu);
+    return 0;
+}
+
+// Receives from whichever channel in the set has a value, without blocking.
+// Only channels marked ready since they were last tried are visited, so the
+// cost follows the number of ready channels rather than the size of the set.
+// Returns the index of the channel received from, as returned by
+// chan_set_add, or -1 if none had a value.
+int chan_set_select(chan_set_t* set, void** recv_out)
+{
+    return chan_set_select_impl(set, recv_out, 0, NULL);
+}
+
+// Like chan_set_select, but blocks until one of the channels has a value.
+// Returns -1 and sets errno to EPIPE if every channel in the set is closed
+// and empty.
+int chan_set_select_wait(chan_set_t* set, void** recv_out)
+{
+    return chan_set_select_impl(set, recv_out, 1, NULL);
+}
+
+// Like chan_set_select_wait, but gives up if none of the channels has a value
+// within timeout. A NULL timeout blocks like chan_set_select_wait. If the
+// timeout expired, -1 is returned and errno is set to ETIMEDOUT.
+int chan_set_select_timeout(chan_set_t* set, void** recv_out,
+    const struct timespec* timeout)
+{
+    if (!timeout)
+    {
+        return chan_set_select_wait(set, recv_out);
+    }
+
+    struct timespec deadline;
+    chan_deadline(&deadline, timeout);
+    return chan_set_select_impl(set, recv_out, 1, &deadline);
+}
+
+// Sets the ready bit of the channel at index, waking a parked select if the
+// bit was clear. The bit is tested first so a busy channel whose bit is
+// already set does not keep writing to the shared word.
+static void chan_set_mark(chan_set_t* set, int index)
+{
+    uint64_t* word = &set->ready[index / 64];
+    uint64_t bit = 1ull << (index % 64);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(word, __ATOMIC_RELAXED) & bit)
+    {
+        return;
+    }
+
+    __atomic_fetch_or(word, bit, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&set->waiting, __ATOMIC_RELAXED) > 0)
+    {
+        pthread_mutex_lock(&set->mu);
+        chan_cond_signal(&set->cond);
+        pthread_mutex_unlock(&set->mu);
+    }
+}
+
+// Returns non-zero if any channel in the set is marked ready.
+static int chan_set_any_ready(chan_set_t* set)
+{
+    int w;
+    for (w = 0; w < set->words; w++)
+    {
+        if (__atomic_load_n(&set->ready[w], __ATOMIC_SEQ_CST))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Makes one pass over the ready bitmap, starting after the channel chosen
+// last time so busy channels cannot starve the others. Each marked channel
+// has its bit cleared before it is tried, so a value sent meanwhile marks it
+// again. Returns the index received from or -1 if none had a value.
+static int chan_set_poll(chan_set_t* set, void** recv_out)
+{
+    int start = __atomic_load_n(&set->cursor, __ATOMIC_RELAXED);
+    int w0 = start / 64;
+    int w;
+    for (w = 0; w <= set->words; w++)
+    {
+        // The first word is visited twice, from the cursor on and then below
+        // it, so the pass wraps around exactly once.
+        int word_index = (w0 + w) % set->words;
+        uint64_t mask = ~0ull;
+        if (w == 0)
+        {
+            mask <<= start % 64;
+        }
+        else if (w == set->words)
+        {
+            mask = (1ull << (start % 64)) - 1;
+        }
+
+        uint64_t bits = __atomic_load_n(&set->ready[word_index],
+            __ATOMIC_SEQ_CST) & mask;
+        while (bits)
+        {
+            int b = __builtin_ctzll(bits);
+            bits &= bits - 1;
+            int index = word_index * 64 + b;
+            uint64_t bit = 1ull << b;
+            __atomic_and_fetch(&set->ready[word_index], ~bit,
+                __ATOMIC_SEQ_CST);
+
+            chan_t* chan = __atomic_load_n(&set->chans[index],
+                __ATOMIC_ACQUIRE);
+            if (!chan)
+            {
+                continue;
+            }
+
+            pthread_mutex_lock(&chan->m_mu);
+            int rc = chan_select_try_recv(chan, recv_out);
+            pthread_mutex_unlock(&chan->m_mu);
+            if (rc > 0)
+            {
+                // Leave the channel marked if it has more to give.
+                if (chan_recv_pending(chan))
+                {
+                    chan_set_mark(set, index);
+                }
+                __atomic_store_n(&set->cursor, (index + 1) % set->capacity,
+                    __ATOMIC_RELAXED);
+                return index;
+            }
+            if (rc < 0 && !(__atomic_fetch_or(&set->done[word_index], bit,
+                __ATOMIC_SEQ_CST) & bit))
+            {
+                __atomic_add_fetch(&set->done_count, 1, __ATOMIC_SEQ_CST);
+            }
+        }
+    }
+    return -1;
+}
+
+static int chan_set_select_impl(chan_set_t* set, void** recv_out, int block,
+    const struct timespec* deadline)
+{
+    for (;;)
+    {
+        int index = chan_set_poll(set, recv_out);
+        if (index >= 0 || !block)
+        {
+            return index;
+        }
+
+        // Nothing is ready, park until a channel is marked. The waiting
+        // count is published before the bitmap is re-checked so a sender
+        // either sees us waiting or we see its mark.
+        pthread_mutex_lock(&set->mu);
+        __atomic_add_fetch(&set->waiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int rc = 0;
+        int closed = set->done_count == set->count;
+        if (!closed && !chan_set_any_ready(set))
+        {
+            rc = chan_cond_wait(&set->cond, &set->mu, deadline);
+        }
+        __atomic_sub_fetch(&set->waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&set->mu);
+
+        if (closed && !chan_set_any_ready(set))
+        {
+            errno = EPIPE;
+            return -1;
+        }
+
+        if (rc == ETIMEDOUT)
+        {
+            // Last attempt in case a channel was marked as we timed out.
+            index = chan_set_poll(set, recv_out);
+            if (index < 0)
+            {
+                errno = ETIMEDOUT;
+            }
+            return index;
+        }
+    }
+}
+
+// Allocates and returns a new broadcast channel whose ring holds capacity
+// values, rounded up to a power of two and at least 2. Sets errno and returns
+// NULL if initialization failed.
+chan_bcast_t* chan_bcast_init(size_t capacity)
+{
+    chan_bcast_t* bcast = (chan_bcast_t*) malloc(sizeof(chan_bcast_t));
+    if (!bcast)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    bcast->ring = bcast_queue_init(capacity);
+    if (!bcast->ring)
+    {
+        free(bcast);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&bcast->w_mu, NULL) != 0)
+    {
+        bcast_queue_dispose(bcast->ring);
+        free(bcast);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&bcast->m_mu, NULL) != 0)
+    {
+        pthread_mutex_destroy(&bcast->w_mu);
+        bcast_queue_dispose(bcast->ring);
+        free(bcast);
+        return NULL;
+    }
+
+    if (chan_cond_init(&bcast->r_cond) != 0)
+    {
+        pthread_mutex_destroy(&bcast->m_mu);
+        pthread_mutex_destroy(&bcast->w_mu);
+        bcast_queue_dispose(bcast->ring);
+        free(bcast);
+        return NULL;
+    }
+
+    if (chan_cond_init(&bcast->w_cond) != 0)
+    {
+        chan_cond_destroy(&bcast->r_cond);
+        pthread_mutex_destroy(&bcast->m_mu);
+        pthread_mutex_destroy(&bcast->w_mu);
+        bcast_queue_dispose(bcast->ring);
+        free(bcast);
+        return NULL;
+    }
+
+    bcast->r_waiting = 0;
+    bcast->w_waiting = 0;
+    bcast->closed = 0;
+    bcast->gate = 0;
+    bcast->subs = NULL;
+    bcast->sub_count = 0;
+    bcast->sub_capacity = 0;
+    return bcast;
+}
+
+// Releases the broadcast channel resources, including any subscribers that
+// have not unsubscribed.
+void chan_bcast_dispose(chan_bcast_t* bcast)
+{
+    int i;
+    for (i = 0; i < bcast->sub_count; i++)
+    {
+        free(bcast->subs[i]);
+    }
+    free(bcast->subs);
+
+    pthread_mutex_destroy(&bcast->w_mu);
+    pthread_mutex_destroy(&bcast->m_mu);
+    chan_cond_destroy(&bcast->r_cond);
+    chan_cond_destroy(&bcast->w_cond);
+    bcast_queue_dispose(bcast->ring);
+    free(bcast);
+}
+
+// Closes the broadcast channel. Subscribers receive what was sent before the
+// close and then get an error. Returns 0 if the channel was closed or -1 with
+// errno set to EPIPE if it already was.
+int chan_bcast_close(chan_bcast_t* bcast)
+{
+    int success = 0;
+    pthread_mutex_lock(&bcast->m_mu);
+    if (bcast->closed)
+    {
+        // Channel already closed.
+        success = -1;
+        errno = EPIPE;
+    }
+    else
+    {
+        __atomic_store_n(&bcast->closed, 1, __ATOMIC_RELEASE);
+        chan_cond_broadcast(&bcast->r_cond);
+        chan_cond_broadcast(&bcast->w_cond);
+    }
+    pthread_mutex_unlock(&bcast->m_mu);
+    return success;
+}
+
+// Returns the position of the slowest lossless subscriber, or the producer's
+// own position if there is none. Must be called with m_mu held.
+static size_t chan_bcast_gate(chan_bcast_t* bcast)
+{
+    size_t gate = bcast->ring->tail;
+    int i;
+    for (i = 0; i < bcast->sub_count; i++)
+    {
+        chan_sub_t* sub = bcast->subs[i];
+        if (sub->flags & CHAN_SUB_LOSSY)
+        {
+            continue;
+        }
+
+        size_t next = __atomic_load_n(&sub->next, __ATOMIC_ACQUIRE);
+        if (next < gate)
+        {
+            gate = next;
+        }
+    }
+    return gate;
+}
+
+// Sends a value to every current subscriber. The value is stored once in the
+// ring and every subscriber reads the same pointer. Blocks while the slowest
+// lossless subscriber is a full ring behind. Returns 0 if the value was sent
+// or -1 with errno set to EPIPE if the channel is closed.
+int chan_bcast_send(chan_bcast_t* bcast, void* data)
+{
+    chan_mutex_lock(&bcast->w_mu, NULL);
+    bcast_queue_t* ring = bcast->ring;
+    size_t tail = ring->tail;
+    while (tail - bcast->gate >= ring->capacity)
+    {
+        // Ring looks full, find out how far the subscribers really are and
+        // park if the slowest one still needs the oldest slot. The waiting
+        // count is published before the positions are re-read so a
+        // subscriber either sees us waiting or we see it move.
+        pthread_mutex_lock(&bcast->m_mu);
+        __atomic_add_fetch(&bcast->w_waiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        bcast->gate = chan_bcast_gate(bcast);
+        if (!bcast->closed && tail - bcast->gate >= ring->capacity)
+        {
+            chan_cond_wait(&bcast->w_cond, &bcast->m_mu, NULL);
+        }
+        __atomic_sub_fetch(&bcast->w_waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&bcast->m_mu);
+
+        if (__atomic_load_n(&bcast->closed, __ATOMIC_ACQUIRE))
+        {
+            break;
+        }
+    }
+
+    if (__atomic_load_n(&bcast->closed, __ATOMIC_ACQUIRE))
+    {
+        // Cannot send on closed channel.
+        pthread_mutex_unlock(&bcast->w_mu);
+        errno = EPIPE;
+        return -1;
+    }
+
+    bcast_queue_publish(ring, data);
+    pthread_mutex_unlock(&bcast->w_mu);
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&bcast->r_waiting, __ATOMIC_RELAXED) > 0)
+    {
+        pthread_mutex_lock(&bcast->m_mu);
+        chan_cond_broadcast(&bcast->r_cond);
+        pthread_mutex_unlock(&bcast->m_mu);
+    }
+    return 0;
+}
+
+// Adds a subscriber which receives every value sent from now on. With
+// CHAN_SUB_LOSSY in flags, the subscriber does not hold the producer back;
+// if it falls a full ring behind it skips ahead and counts the values it
+// missed. Returns NULL if the subscriber could not be added. If NULL is
+// returned, errno will be set.
+chan_sub_t* chan_bcast_subscribe(chan_bcast_t* bcast, int flags)
+{
+    chan_sub_t* sub = (chan_sub_t*) malloc(sizeof(chan_sub_t));
+    if (!sub)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    pthread_mutex_lock(&bcast->m_mu);
+    if (bcast->sub_count == bcast->sub_capacity)
+    {
+        int capacity = bcast->sub_capacity ? bcast->sub_capacity * 2 : 4;
+        chan_sub_t** subs = (chan_sub_t**) realloc(bcast->subs,
+            capacity * sizeof(chan_sub_t*));
+        if (!subs)
+        {
+            pthread_mutex_unlock(&bcast->m_mu);
+            free(sub);
+            errno = ENOMEM;
+            return NULL;
+        }
+        bcast->subs = subs;
+        bcast->sub_capacity = capacity;
+    }
+
+    // The producer recomputes its gate under m_mu, so it either sees this
+    // subscriber or gated on positions no later than the tail read here.
+    sub->bcast = bcast;
+    sub->next = __atomic_load_n(&bcast->ring->tail, __ATOMIC_ACQUIRE);
+    sub->flags = flags;
+    sub->dropped = 0;
+    bcast->subs[bcast->sub_count++] = sub;
+    pthread_mutex_unlock(&bcast->m_mu);
+    return sub;
+}
+
+// Removes a subscriber and releases it. Must not be called while the
+// subscriber is receiving.
+void chan_bcast_unsubscribe(chan_sub_t* sub)
+{
+    chan_bcast_t* bcast = sub->bcast;
+    pthread_mutex_lock(&bcast->m_mu);
+    int i;
+    for (i = 0; i < bcast->sub_count; i++)
+    {
+        if (bcast->subs[i] == sub)
+        {
+            bcast->subs[i] = bcast->subs[--bcast->sub_count];
+            break;
+        }
+    }
+
+    // The producer may have been waiting on this subscriber.
+    chan_cond_signal(&bcast->w_cond);
+    pthread_mutex_unlock(&bcast->m_mu);
+    free(sub);
+}
+
+// Receives the next value for the subscriber, blocking until one is sent.
+// Returns 0 if a value was received or -1 with errno set to EPIPE if the
+// channel is closed and the subscriber has received everything sent before.
+int chan_sub_recv(chan_sub_t* sub, void** data)
+{
+    chan_bcast_t* bcast = sub->bcast;
+    bcast_queue_t* ring = bcast->ring;
+    void* msg;
+    int rc;
+    while ((rc = bcast_queue_read(ring, sub->next, &msg)) != 1)
+    {
+        if (rc < 0)
+        {
+            // Lapped by the producer, which only happens to lossy
+            // subscribers. Skip to the oldest value still in the ring.
+            size_t oldest = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) -
+                ring->capacity + 1;
+            __atomic_add_fetch(&sub->dropped, oldest - sub->next,
+                __ATOMIC_RELAXED);
+            __atomic_store_n(&sub->next, oldest, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        if (__atomic_load_n(&bcast->closed, __ATOMIC_ACQUIRE))
+        {
+            // Anything sent before the close is still delivered.
+            if (bcast_queue_read(ring, sub->next, &msg) != 0)
+            {
+                continue;
+            }
+            errno = EPIPE;
+            return -1;
+        }
+
+        // Nothing new, park until the producer publishes.
+        pthread_mutex_lock(&bcast->m_mu);
+        __atomic_add_fetch(&bcast->r_waiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (!bcast->closed &&
+            __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) <= sub->next)
+        {
+            chan_cond_wait(&bcast->r_cond, &bcast->m_mu, NULL);
+        }
+        __atomic_sub_fetch(&bcast->r_waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&bcast->m_mu);
+    }
+
+    // Release the slot before waking the producer that may be waiting on it.
+    __atomic_store_n(&sub->next, sub->next + 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&bcast->w_waiting, __ATOMIC_RELAXED) > 0)
+    {
+        pthread_mutex_lock(&bcast->m_mu);
+        chan_cond_signal(&bcast->w_cond);
+        pthread_mutex_unlock(&bcast->m_mu);
+    }
+
+    if (data)
+    {
+        *data = msg;
+    }
+    return 0;
+}
+
+// Returns how many values a CHAN_SUB_LOSSY subscriber has skipped because it
+// fell too far behind.
+uint64_t chan_sub_dropped(chan_sub_t* sub)
+{
+    return __atomic_load_n(&sub->dropped, __ATOMIC_RELAXED);
+}
+
+static int chan_addr_cmp(const void* a, const void* b)
+{
+    uintptr_t x = (uintptr_t) *(chan_t* const*) a;
+    uintptr_t y = (uintptr_t) *(chan_t* const*) b;
+    return x < y ? -1 : x > y;
+}
+
+static void chan_lock_all(chan_t* chans[], int count)
+{
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        pthread_mutex_lock(&chans[i]->m_mu);
+    }
+}
+
+static void chan_unlock_all(chan_t* chans[], int count, chan_t* except)
+{
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        if (chans[i] != except)
+        {
+            pthread_mutex_unlock(&chans[i]->m_mu);
+        }
     }
-
-    pthread_mutex_unlock(&chan->m_mu);
-    return success;
 }
 
-static int buffered_chan_recv(chan_t* chan, void** data)
+// Attempts a receive on a channel whose m_mu is held. Returns 1 if a value was
+// received, 0 if the receive would block or -1 if it can never proceed
+// because the channel is closed and empty.
+static int chan_select_try_recv(chan_t* chan, void** data)
 {
-    pthread_mutex_lock(&chan->m_mu);
-    while (chan->queue->size == 0)
+    void* msg;
+    if (chan_is_buffered(chan))
+    {
+        if (buffered_chan_size(chan) == 0)
+        {
+            return chan->closed ? -1 : 0;
+        }
+
+        msg = buffered_chan_remove(chan);
+        if (chan->w_waiting > 0)
+        {
+            buffered_chan_wake_sender(chan);
+        }
+        chan_notify_select(chan->w_select);
+    }
+    else if (chan_is_ring(chan))
+    {
+        if (ring_pop(chan, &msg) != 0)
+        {
+            return chan->closed && chan_ring_size(chan) == 0 ? -1 : 0;
+        }
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&chan->w_waiting, __ATOMIC_RELAXED) > 0)
+        {
+            chan_cond_signal(chan_w_cond(chan));
+        }
+        chan_notify_select(chan->w_select);
+    }
+    else
     {
         if (chan->closed)
         {
-            pthread_mutex_unlock(&chan->m_mu);
-            errno = EPIPE;
             return -1;
         }
 
-        // Block until something is added.
-        chan->r_waiting++;
-        pthread_cond_wait(&chan->r_cond, &chan->m_mu);
-        chan->r_waiting--;
+        // Take the value of the longest blocked sender and release it.
+        chan_waiter_t* sender = chan_waiter_pop(chan, 1);
+        if (!sender)
+        {
+            return 0;
+        }
+        msg = unbuffered_chan_take(chan, sender);
     }
 
-    void* msg = queue_remove(chan->queue);
     if (data)
     {
         *data = msg;
     }
-
-    if (chan->w_waiting > 0)
-    {
-        // Signal waiting writer.
-        pthread_cond_signal(&chan->w_cond);
-    }
-
-    pthread_mutex_unlock(&chan->m_mu);
-    return 0;
+    return 1;
 }
 
-static int unbuffered_chan_send(chan_t* chan, void* data)
+// Attempts a send on a channel whose m_mu is held. Returns 1 if the value was
+// sent, 0 if the send would block or -1 if it can never proceed because the
+// channel is closed. data points to the value, which is only read once the
+// send can proceed, as chan_select callers may pass fewer values than cases
+// for channels that are not ready.
+static int chan_select_try_send(chan_t* chan, void** data)
 {
-    pthread_mutex_lock(&chan->w_mu);
-    pthread_mutex_lock(&chan->m_mu);
-
     if (chan->closed)
     {
-        pthread_mutex_unlock(&chan->m_mu);
-        pthread_mutex_unlock(&chan->w_mu);
-        errno = EPIPE;
         return -1;
     }
 
-    chan->data = data;
-    chan->w_waiting++;
-
-    if (chan->r_waiting > 0)
+    if (chan_is_buffered(chan))
     {
-        // Signal waiting reader.
-        pthread_cond_signal(&chan->r_cond);
+        if (buffered_chan_full(chan, 0) ||
+            buffered_chan_add(chan, *data, 0) != 0)
+        {
+            return 0;
+        }
+
+        if (chan->r_waiting > 0)
+        {
+            chan_cond_signal(chan_r_cond(chan));
+        }
+        chan_notify_select(chan->r_select);
+        return 1;
     }
 
-    // Block until reader consumed chan->data.
-    pthread_cond_wait(&chan->w_cond, &chan->m_mu);
+    if (chan_is_ring(chan))
+    {
+        if (chan_ring_size(chan) >= chan_ring_capacity(chan) ||
+            ring_push(chan, *data) != 0)
+        {
+            return 0;
+        }
 
-    pthread_mutex_unlock(&chan->m_mu);
-    pthread_mutex_unlock(&chan->w_mu);
-    return 0;
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&chan->r_waiting, __ATOMIC_RELAXED) > 0)
+        {
+            chan_cond_signal(chan_r_cond(chan));
+        }
+        chan_notify_select(chan->r_select);
+        return 1;
+    }
+
+    // An unbuffered send needs a blocked receiver, which gets the value
+    // directly.
+    chan_waiter_t* receiver = chan_waiter_pop(chan, 0);
+    if (!receiver)
+    {
+        return 0;
+    }
+    unbuffered_chan_give(chan, receiver, *data);
+    return 1;
 }
 
-static int unbuffered_chan_recv(chan_t* chan, void** data)
+static void select_link(select_link_t** list, select_link_t* link)
 {
-    pthread_mutex_lock(&chan->r_mu);
-    pthread_mutex_lock(&chan->m_mu);
-
-    while (!chan->closed && !chan->w_waiting)
+    link->prev = NULL;
+    link->next = *list;
+    if (*list)
     {
-        // Block until writer has set chan->data.
-        chan->r_waiting++;
-        pthread_cond_wait(&chan->r_cond, &chan->m_mu);
-        chan->r_waiting--;
+        (*list)->prev = link;
     }
 
-    if (chan->closed)
+    // Lock-free ring channels check the list head without taking m_mu.
+    __atomic_store_n(list, link, __ATOMIC_SEQ_CST);
+}
+
+static void select_unlink(select_link_t** list, select_link_t* link)
+{
+    if (link->prev)
     {
-        pthread_mutex_unlock(&chan->m_mu);
-        pthread_mutex_unlock(&chan->r_mu);
-        errno = EPIPE;
-        return -1;
+        link->prev->next = link->next;
     }
-
-    if (data)
+    else
     {
-        *data = chan->data;
+        __atomic_store_n(list, link->next, __ATOMIC_SEQ_CST);
     }
-    chan->w_waiting--;
-
-    // Signal waiting writer.
-    pthread_cond_signal(&chan->w_cond);
 
-    pthread_mutex_unlock(&chan->m_mu);
-    pthread_mutex_unlock(&chan->r_mu);
-    return 0;
+    if (link->next)
+    {
+        link->next->prev = link->prev;
+    }
 }
 
-// Returns the number of items in the channel buffer. If the channel is
-// unbuffered, this will return 0.
-int chan_size(chan_t* chan)
+// Wakes every select waiting in the given list. Must be called with the
+// owning channel's m_mu held.
+static void chan_notify_select(select_link_t* list)
 {
-    int size = 0;
-    if (chan_is_buffered(chan))
+    for (; list; list = list->next)
     {
-        pthread_mutex_lock(&chan->m_mu);
-        size = chan->queue->size;
-        pthread_mutex_unlock(&chan->m_mu);
+        select_waiter_t* waiter = list->waiter;
+        pthread_mutex_lock(&waiter->mu);
+        waiter->signaled = 1;
+        chan_cond_signal(&waiter->cond);
+        pthread_mutex_unlock(&waiter->mu);
     }
-    return size;
 }
 
-typedef struct
-{
-    int     recv;
-    chan_t* chan;
-    void*   msg_in;
-    int     index;
-} select_op_t;
-
-// A select statement chooses which of a set of possible send or receive
-// operations will proceed. The return value indicates which channel's
-// operation has proceeded. If more than one operation can proceed, one is
-// selected randomly. If none can proceed, -1 is returned. Select is intended
-// to be used in conjunction with a switch statement. In the case of a receive
-// operation, the received value will be pointed to by the provided pointer. In
-// the case of a send, the value at the same index as the channel will be sent.
-int chan_select(chan_t* recv_chans[], int recv_count, void** recv_out,
-    chan_t* send_chans[], int send_count, void* send_msgs[])
+static int chan_select_impl(chan_t* recv_chans[], int recv_count,
+    void** recv_out, chan_t* send_chans[], int send_count, void* send_msgs[],
+    int block, const struct timespec* deadline)
 {
-    // TODO: Add support for blocking selects.
+    int count = recv_count + send_count;
+    if (count == 0)
+    {
+        if (block)
+        {
+            errno = EINVAL;
+        }
+        return -1;
+    }
 
-    select_op_t candidates[recv_count + send_count];
-    int count = 0;
     int i;
-
-    // Determine receive candidates.
-    for (i = 0; i < recv_count; i++)
+    for (i = 0; i < count; i++)
     {
-        chan_t* chan = recv_chans[i];
-        if (chan_can_recv(chan))
+        chan_t* chan = i < recv_count ? recv_chans[i] :
+            send_chans[i - recv_count];
+        if (chan->elem_size || chan->bytes)
         {
-            select_op_t op;
-            op.recv = 1;
-            op.chan = chan;
-            op.index = i;
-            candidates[count++] = op;
+            // Sized and byte channels have their own interfaces.
+            errno = EINVAL;
+            return -1;
         }
     }
 
-    // Determine send candidates.
-    for (i = 0; i < send_count; i++)
+    select_op_t   ops_buf[CHAN_SELECT_STACK];
+    chan_t*       locks_buf[CHAN_SELECT_STACK];
+    select_link_t links_buf[CHAN_SELECT_STACK];
+    select_op_t*   ops = ops_buf;
+    chan_t**       locks = locks_buf;
+    select_link_t* links = links_buf;
+    void*          heap = NULL;
+    if (count > CHAN_SELECT_STACK)
     {
-        chan_t* chan = send_chans[i];
-        if (chan_can_send(chan))
+        heap = malloc(count * (sizeof(select_op_t) + sizeof(select_link_t) +
+            sizeof(chan_t*)));
+        if (!heap)
         {
-            select_op_t op;
-            op.recv = 0;
-            op.chan = chan;
-            op.msg_in = send_msgs[i];
-            op.index = i + recv_count;
-            candidates[count++] = op;
+            errno = ENOMEM;
+            return -1;
         }
+        ops = (select_op_t*) heap;
+        links = (select_link_t*) (ops + count);
+        locks = (chan_t**) (links + count);
     }
-    
-    if (count == 0)
+
+    for (i = 0; i < count; i++)
     {
-        return -1;
+        select_op_t op;
+        op.recv = i < recv_count;
+        op.chan = op.recv ? recv_chans[i] : send_chans[i - recv_count];
+        op.index = i;
+        ops[i] = op;
+        locks[i] = op.chan;
+    }
+
+    // Channels are always locked in address order so that concurrent selects
+    // over overlapping sets cannot deadlock.
+    qsort(locks, count, sizeof(chan_t*), chan_addr_cmp);
+    int lock_count = 0;
+    for (i = 0; i < count; i++)
+    {
+        if (lock_count == 0 || locks[lock_count - 1] != locks[i])
+        {
+            locks[lock_count++] = locks[i];
+        }
     }
 
     // Seed rand using current time in nanoseconds.
     struct timespec ts;
     current_utc_time(&ts);
-    srand(ts.tv_nsec);
+    unsigned int seed = (unsigned int) ts.tv_nsec;
+
+    select_waiter_t waiter;
+    int waiter_init = 0;
+    int expired = 0;
+    int selected = -1;
 
-    // Select candidate and perform operation.
-    select_op_t select = candidates[rand() % count];
-    if (select.recv && chan_recv(select.chan, recv_out) != 0)
+    chan_lock_all(locks, lock_count);
+    for (;;)
     {
-        return -1;
+        // Start at a random case so that no channel is favored.
+        int start = rand_r(&seed) % count;
+        int dead = 0;
+        int k;
+        for (k = 0; k < count && selected < 0; k++)
+        {
+            select_op_t* op = &ops[(start + k) % count];
+            int result = op->recv ?
+                chan_select_try_recv(op->chan, recv_out) :
+                chan_select_try_send(op->chan,
+                    &send_msgs[op->index - recv_count]);
+            if (result == 1)
+            {
+                selected = op->index;
+            }
+            else if (result < 0)
+            {
+                dead++;
+            }
+        }
+
+        if (selected >= 0 || !block || dead == count || expired)
+        {
+            if (selected < 0 && block)
+            {
+                errno = expired ? ETIMEDOUT : EPIPE;
+            }
+            break;
+        }
+
+        if (!waiter_init)
+        {
+            if (pthread_mutex_init(&waiter.mu, NULL) != 0)
+            {
+                break;
+            }
+            if (chan_cond_init(&waiter.cond) != 0)
+            {
+                pthread_mutex_destroy(&waiter.mu);
+                break;
+            }
+            waiter_init = 1;
+        }
+
+        // Nothing is ready, register on every channel and sleep until one of
+        // them changes. Unbuffered channels only ever pair a sender with a
+        // receiver that is already queued, so queue there too, which lets
+        // another select on the other side complete this one.
+        waiter.signaled = 0;
+        waiter.selected = -1;
+        for (i = 0; i < count; i++)
+        {
+            chan_t* chan = ops[i].chan;
+            links[i].waiter = &waiter;
+            select_link(ops[i].recv ? &chan->r_select : &chan->w_select,
+                &links[i]);
+            if (chan_is_buffered(chan) || chan_is_ring(chan))
+            {
+                continue;
+            }
+
+            chan_waiter_t* self = &ops[i].waiter;
+            self->done = 0;
+            self->select = &waiter;
+            self->index = ops[i].index;
+            if (ops[i].recv)
+            {
+                self->data = recv_out;
+                self->published = 0;
+                chan_waiter_push(&chan->r_head, &chan->r_tail, self);
+                chan_waiting_add(&chan->r_waiting, 1);
+            }
+            else
+            {
+                self->data = &send_msgs[ops[i].index - recv_count];
+                self->published = chan_stats_stamp(chan);
+                chan_waiter_push(&chan->w_head, &chan->w_tail, self);
+                chan_waiting_add(&chan->w_waiting, 1);
+                chan_ready(chan);
+            }
+        }
+
+        // Lock-free ring channels do not take m_mu to add or remove values,
+        // so check them again now that we are visible to them.
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        for (i = 0; i < count; i++)
+        {
+            chan_t* chan = ops[i].chan;
+            if (chan_is_ring(chan) && (ops[i].recv ?
+                chan_ring_size(chan) > 0 :
+                chan_ring_size(chan) < chan_ring_capacity(chan)))
+            {
+                waiter.signaled = 1;
+            }
+        }
+
+        chan_unlock_all(locks, lock_count, NULL);
+        pthread_mutex_lock(&waiter.mu);
+        while (!waiter.signaled && !expired)
+        {
+            // Once the deadline passes, make one last attempt before giving
+            // up.
+            expired = chan_cond_wait(&waiter.cond, &waiter.mu, deadline) ==
+                ETIMEDOUT;
+        }
+        pthread_mutex_unlock(&waiter.mu);
+        chan_lock_all(locks, lock_count);
+
+        for (i = 0; i < count; i++)
+        {
+            chan_t* chan = ops[i].chan;
+            chan_waiter_t* self = &ops[i].waiter;
+            select_unlink(ops[i].recv ? &chan->r_select : &chan->w_select,
+                &links[i]);
+            if (chan_is_buffered(chan) || chan_is_ring(chan) || !self->queued)
+            {
+                continue;
+            }
+
+            if (ops[i].recv)
+            {
+                chan_waiter_unlink(&chan->r_head, &chan->r_tail, self);
+                chan_waiting_add(&chan->r_waiting, -1);
+            }
+            else
+            {
+                chan_waiter_unlink(&chan->w_head, &chan->w_tail, self);
+                chan_waiting_add(&chan->w_waiting, -1);
+                if (chan->fd >= 0)
+                {
+                    chan_fd_clear(chan);
+                }
+            }
+        }
+
+        // Whoever claimed the select has already completed the case, and
+        // did so under a lock we now hold.
+        selected = __atomic_load_n(&waiter.selected, __ATOMIC_RELAXED);
+        if (selected >= 0 && ops[selected].recv)
+        {
+            chan_stats_delivered(ops[selected].chan,
+                ops[selected].waiter.published);
+        }
     }
-    else if (!select.recv && chan_send(select.chan, select.msg_in) != 0)
+    chan_unlock_all(locks, lock_count, NULL);
+
+    if (waiter_init)
     {
-        return -1;
+        chan_cond_destroy(&waiter.cond);
+        pthread_mutex_destroy(&waiter.mu);
     }
-
-    return select.index;
+    free(heap);
+    return selected;
 }
 
-static int chan_can_recv(chan_t* chan)
+static int chan_is_buffered(chan_t* chan)
 {
-    if (chan_is_buffered(chan))
-    {
-        return chan_size(chan) > 0;
-    }
-
-    pthread_mutex_lock(&chan->m_mu);
-    int sender = chan->w_waiting > 0;
-    pthread_mutex_unlock(&chan->m_mu);
-    return sender;
+    return chan->queue != NULL || chan->seg != NULL || chan->prio != NULL;
 }
 
-static int chan_can_send(chan_t* chan)
+static int chan_is_ring(chan_t* chan)
 {
-    int send;
-    if (chan_is_buffered(chan))
-    {
-        // Can send if buffered channel is not full.
-        pthread_mutex_lock(&chan->m_mu);
-        send = chan->queue->size < chan->queue->capacity;
-        pthread_mutex_unlock(&chan->m_mu);
-    }
-    else
-    {
-        // Can send if unbuffered channel has receiver.
-        pthread_mutex_lock(&chan->m_mu);
-        send = chan->r_waiting > 0;
-        pthread_mutex_unlock(&chan->m_mu);
-    }
+    return chan->spsc != NULL || chan->mpmc != NULL;
+}
 
-    return send;
+static size_t chan_ring_size(chan_t* chan)
+{
+    return chan->spsc ?
+        spsc_queue_size(chan->spsc) :
+        mpmc_queue_size(chan->mpmc);
 }
 
-static int chan_is_buffered(chan_t* chan)
+static size_t chan_ring_capacity(chan_t* chan)
 {
-    return chan->queue != NULL;
+    return chan->spsc ? chan->spsc->capacity : chan->mpmc->capacity;
 }
 
-int chan_send_int32(chan_t* chan, int32_t data)
+// Sends a copy of size bytes at data. Sized channels copy it into the buffer
+// (or straight to the receiver if unbuffered), other channels box it in a heap
+// allocation that the receiver frees.
+static int chan_send_typed(chan_t* chan, const void* data, size_t size)
 {
-    int32_t* wrapped = malloc(sizeof(int32_t));
+    if (chan->elem_size)
+    {
+        if (chan->elem_size != size)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        return sized_chan_send(chan, data);
+    }
+
+    void* wrapped = malloc(size);
     if (!wrapped)
     {
         return -1;
     }
 
-    *wrapped = data;
+    memcpy(wrapped, data, size);
 
     int success = chan_send(chan, wrapped);
     if (success != 0)
@@ -511,111 +4880,66 @@ int chan_send_int32(chan_t* chan, int32_t data)
     return success;
 }
 
-int chan_recv_int32(chan_t* chan, int32_t* data)
+// Receives size bytes into data that were sent with chan_send_typed.
+static int chan_recv_typed(chan_t* chan, void* data, size_t size)
 {
-    int32_t* wrapped = NULL;
-    int success = chan_recv(chan, (void*) &wrapped);
+    if (chan->elem_size)
+    {
+        if (chan->elem_size != size)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        return sized_chan_recv(chan, data);
+    }
+
+    void* wrapped = NULL;
+    int success = chan_recv(chan, &wrapped);
     if (wrapped != NULL)
     {
-        *data = *wrapped;
+        memcpy(data, wrapped, size);
         free(wrapped);
     }
 
     return success;
 }
 
-int chan_send_int64(chan_t* chan, int64_t data)
+int chan_send_int32(chan_t* chan, int32_t data)
 {
-    int64_t* wrapped = malloc(sizeof(int64_t));
-    if (!wrapped)
-    {
-        return -1;
-    }
-
-    *wrapped = data;
+    return chan_send_typed(chan, &data, sizeof(int32_t));
+}
 
-    int success = chan_send(chan, wrapped);
-    if (success != 0)
-    {
-        free(wrapped);
-    }
+int chan_recv_int32(chan_t* chan, int32_t* data)
+{
+    return chan_recv_typed(chan, data, sizeof(int32_t));
+}
 
-    return success;
+int chan_send_int64(chan_t* chan, int64_t data)
+{
+    return chan_send_typed(chan, &data, sizeof(int64_t));
 }
 
 int chan_recv_int64(chan_t* chan, int64_t* data)
 {
-    int64_t* wrapped = NULL;
-    int success = chan_recv(chan, (void*) &wrapped);
-    if (wrapped != NULL)
-    {
-        *data = *wrapped;
-        free(wrapped);
-    }
-
-    return success;
+    return chan_recv_typed(chan, data, sizeof(int64_t));
 }
 
 int chan_send_double(chan_t* chan, double data)
 {
-    double* wrapped = malloc(sizeof(double));
-    if (!wrapped)
-    {
-        return -1;
-    }
-
-    *wrapped = data;
-
-    int success = chan_send(chan, wrapped);
-    if (success != 0)
-    {
-        free(wrapped);
-    }
-
-    return success;
+    return chan_send_typed(chan, &data, sizeof(double));
 }
 
 int chan_recv_double(chan_t* chan, double* data)
 {
-    double* wrapped = NULL;
-    int success = chan_recv(chan, (void*) &wrapped);
-    if (wrapped != NULL)
-    {
-        *data = *wrapped;
-        free(wrapped);
-    }
-
-    return success;
+    return chan_recv_typed(chan, data, sizeof(double));
 }
 
 int chan_send_buf(chan_t* chan, void* data, size_t size)
 {
-    void* wrapped = malloc(size);
-    if (!wrapped)
-    {
-        return -1;
-    }
-
-    memcpy(wrapped, data, size);
-
-    int success = chan_send(chan, wrapped);
-    if (success != 0)
-    {
-        free(wrapped);
-    }
-
-    return success;
+    return chan_send_typed(chan, data, size);
 }
 
 int chan_recv_buf(chan_t* chan, void* data, size_t size)
 {
-    void* wrapped = NULL;
-    int success = chan_recv(chan, (void*) &wrapped);
-    if (wrapped != NULL)
-    {
-        memcpy(data, wrapped, size);
-        free(wrapped);
-    }
-
-    return success;
+    return chan_recv_typed(chan, data, size);
 }
@@ -3,9 +3,82 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include <time.h>
 
+#include "byte_queue.h"
+#include "chan_mem.h"
+#include "chan_pool.h"
+#include "chan_sched.h"
+#include "chan_stage.h"
+#include "mpmc_queue.h"
+#include "prio_queue.h"
 #include "queue.h"
+#include "seg_queue.h"
+#include "spsc_queue.h"
 
+// Flags for chan_init_flags selecting the engine behind a buffered channel.
+// By default a buffered channel is a circular buffer guarded by the channel
+// mutex.
+#define CHAN_SPSC 0x1 // Wait-free ring for one sender and one receiver.
+#define CHAN_MPMC 0x2 // Lock-free ring for any number of senders/receivers.
+#define CHAN_UNBOUNDED 0x4 // Growable list of segments, sends never block.
+
+// Flags for chan_init_opts placing the channel memory.
+#define CHAN_HUGEPAGES 0x8 // Back large buffers with huge pages.
+#define CHAN_NUMA 0x10 // Place the channel and buffer on chan_opts_t.numa_node.
+
+// Most disposed channels a thread can keep for reuse, see chan_cache_enable.
+#define CHAN_CACHE_MAX 64
+
+// Default upper bound on how many times a blocked send or receive polls the
+// channel before parking the thread. See chan_set_spin.
+#define CHAN_SPIN_DEFAULT 128
+
+// Overflow policies for chan_set_overflow, deciding what a send on a full
+// buffered channel does.
+#define CHAN_OVERFLOW_BLOCK 0 // Wait for room, the default.
+#define CHAN_OVERFLOW_FAIL 1 // Fail with EAGAIN.
+#define CHAN_OVERFLOW_DROP_NEWEST 2 // Drop the value being sent.
+#define CHAN_OVERFLOW_DROP_OLDEST 3 // Evict the oldest buffered value.
+
+
+// A futex word that blocked threads park on in place of a condition variable
+// when the library is built with CHAN_FUTEX (Linux only). seq moves on with
+// every wakeup and waiters counts the sleeping threads, so a wakeup with
+// nobody asleep makes no system call.
+typedef struct chan_futex_t
+{
+    uint32_t seq;
+    uint32_t waiters;
+} chan_futex_t;
+
+// Number of buckets in the latency histogram of chan_stats_t. Bucket i counts
+// values that spent from 2^i up to 2^(i+1) nanoseconds in the channel, and the
+// last bucket also counts anything slower.
+#define CHAN_STATS_BUCKETS 32
+
+// Runtime statistics of a channel, see chan_stats.
+typedef struct chan_stats_t
+{
+    uint64_t sends;               // Values sent
+    uint64_t recvs;               // Values received
+    uint64_t send_blocks;         // Times a sender parked
+    uint64_t recv_blocks;         // Times a receiver parked
+    uint64_t send_blocked_ns;     // Total time senders spent parked
+    uint64_t recv_blocked_ns;     // Total time receivers spent parked
+    uint64_t send_blocked_max_ns; // Longest a sender spent parked at once
+    uint64_t recv_blocked_max_ns; // Longest a receiver spent parked at once
+    uint64_t high_water;          // Most values buffered at one time
+    uint64_t latency[CHAN_STATS_BUCKETS]; // Send to receive time histogram
+} chan_stats_t;
+
+// Options for chan_init_opts. Fields not needed can be left zero.
+typedef struct chan_opts_t
+{
+    size_t capacity;  // As for chan_init_flags
+    int    flags;     // CHAN_SPSC, CHAN_MPMC, CHAN_UNBOUNDED and placement
+    int    numa_node; // Node to allocate on when flags has CHAN_NUMA
+} chan_opts_t;
 
 // Defines a thread-safe communication pipe. Channels are either buffered or
 // unbuffered. An unbuffered channel is synchronized. Receiving on either type
@@ -13,33 +86,203 @@
 // unbuffered, the sender blocks until the receiver has received the value. If
 // the channel is buffered, the sender only blocks until the value has been
 // copied to the buffer, meaning it will block if the channel is full.
+//
+// Channels are allocated on a cache line and their state is grouped by who
+// writes it: what is fixed at creation, what every operation touches, what
+// senders park on and what receivers park on. Padding keeps the groups on
+// separate cache lines, so the fields senders and receivers of a lock-free
+// ring channel update do not false-share.
 typedef struct chan_t
 {
     // Buffered channel properties
     queue_t*         queue;
-    
-    // Unbuffered channel properties
-    pthread_mutex_t  r_mu;
-    pthread_mutex_t  w_mu;
-    void*            data;
+
+    // Unbounded channel properties
+    seg_queue_t*     seg;
+
+    // Priority channel properties
+    prio_queue_t*    prio;
+
+    // Lock-free ring channel properties
+    spsc_queue_t*    spsc;
+    mpmc_queue_t*    mpmc;
+
+    // Byte channel properties
+    byte_queue_t*    bytes;
+
+    // Shared-memory channel mapping, which holds the channel state in place
+    // of the fields below
+    struct chan_shm_t* shm;
+
+    size_t           elem_size;
+
+    // Configured spin-then-park bound
+    int              spin_limit;
+
+    // What a send on a full buffered channel does, see chan_set_overflow
+    int              overflow;
+    void             (*on_drop)(void*);
+
+    // Statistics, NULL unless enabled with chan_stats_enable
+    struct chan_stats_state_t* stats;
+
+    // Channel set the channel belongs to, if any, and its index there
+    struct chan_set_t* set;
+    int              set_index;
+
+    // Whether the channel was made by chan_init, with any queue in the same
+    // allocation right behind it, so chan_dispose may cache it for reuse
+    int              plain;
 
     // Shared properties
     pthread_mutex_t  m_mu;
-    pthread_cond_t   r_cond;
-    pthread_cond_t   w_cond;
     int              closed;
-    int              r_waiting;
+
+    // Current spin budget
+    int              spin;
+
+    // Readiness descriptor, -1 until created by chan_fd, and whether it is
+    // currently readable
+    int              fd;
+    int              fd_ready;
+    char             pad0[CHAN_CACHE_LINE];
+
+    // Sender properties, including the queue of senders blocked on an
+    // unbuffered channel
+    pthread_mutex_t  w_mu;
+    pthread_cond_t   w_cond;
+    chan_futex_t     w_futex;
     int              w_waiting;
+    struct select_link_t* w_select;
+    struct chan_waiter_t* w_head;
+    struct chan_waiter_t* w_tail;
+    uint64_t         dropped;
+    char             pad1[CHAN_CACHE_LINE];
+
+    // Receiver properties
+    pthread_mutex_t  r_mu;
+    pthread_cond_t   r_cond;
+    chan_futex_t     r_futex;
+    int              r_waiting;
+    struct select_link_t* r_select;
+    struct chan_waiter_t* r_head;
+    struct chan_waiter_t* r_tail;
+    char             pad2[CHAN_CACHE_LINE];
 } chan_t;
 
+// A fixed-capacity set of channels to receive from, see chan_set_init.
+typedef struct chan_set_t chan_set_t;
+
+// A channel delivering every value to every subscriber, see chan_bcast_init.
+typedef struct chan_bcast_t chan_bcast_t;
+typedef struct chan_sub_t chan_sub_t;
+
+// Flag for chan_bcast_subscribe: the subscriber may fall behind and miss
+// values instead of holding the producer back.
+#define CHAN_SUB_LOSSY 0x1
+
 // Allocates and returns a new channel. The capacity specifies whether the
 // channel should be buffered or not. A capacity of 0 will create an unbuffered
 // channel. Sets errno and returns NULL if initialization failed.
 chan_t* chan_init(size_t capacity);
 
-// Releases the channel resources.
+// Allocates and returns a new channel like chan_init, using the buffered
+// engine selected by flags. With CHAN_SPSC or CHAN_MPMC, sends and receives go
+// through a lock-free ring and only take the channel lock to park when the
+// ring is full or empty. The two flags are mutually exclusive and require a
+// capacity greater than 0. CHAN_UNBOUNDED takes a capacity of 0 and grows the
+// buffer a segment at a time as needed. Sets errno and returns NULL if
+// initialization failed.
+chan_t* chan_init_flags(size_t capacity, int flags);
+
+// Allocates and returns a new channel like chan_init_flags with the capacity
+// and flags in opts, which may also place the channel memory. CHAN_NUMA
+// allocates the channel and its buffer on opts->numa_node, so a pipeline
+// stage pinned to a socket talks through local memory (Linux only).
+// CHAN_HUGEPAGES backs buffers of a megabyte or more with huge pages, from the
+// reserved pool if there is one and transparent huge pages otherwise, cutting
+// TLB misses on rings of millions of slots. Neither applies to CHAN_UNBOUNDED
+// channels. chan_init_flags rejects CHAN_NUMA. Sets errno and returns NULL if
+// initialization failed, to EINVAL if the node does not exist.
+chan_t* chan_init_opts(const chan_opts_t* opts);
+
+// Allocates and returns a new buffered channel for use by exactly one sending
+// thread and one receiving thread. Equivalent to chan_init_flags with
+// CHAN_SPSC. Using the channel from more than one sender or more than one
+// receiver (including through chan_select) is undefined. Sets errno and
+// returns NULL if initialization failed.
+chan_t* chan_init_spsc(size_t capacity);
+
+// Allocates and returns a new buffered channel with no capacity limit, so
+// sends never block. Equivalent to chan_init_flags with a capacity of 0 and
+// CHAN_UNBOUNDED. Sets errno and returns NULL if initialization failed.
+chan_t* chan_init_unbounded(void);
+
+// Allocates and returns a new channel which carries fixed-size elements of
+// elem_size bytes by value. Buffered channels store elements in a contiguous
+// buffer and unbuffered channels copy them straight from sender to receiver,
+// so no heap allocation is made per value. A capacity of 0 will create an
+// unbuffered channel. Values are sent and received with the typed interface
+// (chan_send_int32, chan_recv_buf, etc.) using a matching size; pointer-based
+// operations fail with EINVAL. Sets errno and returns NULL if initialization
+// failed.
+chan_t* chan_init_sized(size_t capacity, size_t elem_size);
+
+// Allocates and returns a new channel which carries variable-length messages
+// in a ring of capacity bytes. Messages are written and read in place with
+// chan_reserve/chan_commit and chan_peek_msg/chan_consume, so nothing is
+// copied or allocated per message. Each message also takes an 8-byte header
+// and is padded to a multiple of 8 bytes. Pointer-based and typed operations
+// and chan_select fail with EINVAL. Sets errno and returns NULL if
+// initialization failed.
+chan_t* chan_init_bytes(size_t capacity);
+
+// Allocates and returns a new buffered channel serving levels priority levels
+// (1 to 32), each with its own buffer of capacity values. Values are sent at
+// a level with chan_send_prio, where higher levels are more urgent, and every
+// receive takes the oldest value of the highest non-empty level, so urgent
+// values overtake any backlog. A sender only blocks when its own level is
+// full. chan_send and the other sending operations use level 0. Statistics
+// do not include latency for priority channels. Sets errno and returns NULL
+// if initialization failed.
+chan_t* chan_init_priority(size_t capacity, int levels);
+
+// Opens the shared-memory channel called name, creating it if it does not
+// exist yet, so that processes can exchange values without pipes. The channel
+// is buffered, holding up to capacity elements of elem_size bytes, and lives
+// in a POSIX shared memory object (name follows shm_open rules, e.g.
+// "/jobs"). Values are copied in and out by value with the typed interface
+// (chan_send_buf, chan_recv_int64, etc.), since pointers mean nothing in
+// another address space; pointer-based operations, chan_select and chan_fd
+// fail. Blocked processes wait on process-shared condition variables. A NULL
+// name creates an anonymous mapping shared with child processes forked
+// afterwards. Every process must use the same build of the library and
+// dispose of its handle with chan_dispose. Sets errno and returns NULL if the
+// channel could not be opened, to EINVAL if it exists with a different
+// capacity or element size.
+chan_t* chan_open_shm(const char* name, size_t capacity, size_t elem_size);
+
+// Removes the name of a shared-memory channel created by chan_open_shm. The
+// channel itself stays usable by processes that have it open and is freed
+// once the last of them disposes of it. Returns 0 on success or -1 with errno
+// set if it failed.
+int chan_unlink_shm(const char* name);
+
+// Releases the channel resources. If channel caching is enabled, a channel
+// made by chan_init may instead be kept by the calling thread for reuse.
 void chan_dispose(chan_t* chan);
 
+// Sets how many disposed channels each thread keeps for chan_init to reuse,
+// from 0 (the default, which disables caching) up to CHAN_CACHE_MAX. Only
+// channels made by chan_init, or chan_init_flags without flags, are cached,
+// and only for reuse at the same capacity. A cached channel keeps its
+// mutexes and condition variables initialized and, if buffered, its buffer,
+// so reusing it costs no allocation. The calling thread's cache is trimmed to
+// the new size at once, those of other threads as they next dispose of a
+// channel, and each thread's cache is freed when it exits. Returns 0 on
+// success or -1 with errno set to EINVAL if per_thread is out of range.
+int chan_cache_enable(int per_thread);
+
 // Once a channel is closed, data cannot be sent into it. If the channel is
 // buffered, data can be read from it until it is empty, after which reads will
 // return an error code. Reading from a closed channel that is unbuffered will
@@ -51,18 +294,155 @@ int chan_close(chan_t* chan);
 // Returns 0 if the channel is open and 1 if it is closed.
 int chan_is_closed(chan_t* chan);
 
+// Sets the most times a send or receive that would block on a buffered
+// channel polls it, with a CPU pause hint in between, before parking the
+// thread. Channels start at CHAN_SPIN_DEFAULT. Within this bound the channel
+// tunes its own budget from how long recent waits took, spinning for about
+// twice a typical wait and backing off when spinning does not pay. A limit of
+// 0 disables spinning. Returns 0 if the limit was set or -1 if it was
+// negative.
+int chan_set_spin(chan_t* chan, int limit);
+
+// Sets what a send on the channel does when its buffer is full, so telemetry
+// and other lossy streams never stall the producer. CHAN_OVERFLOW_BLOCK waits
+// for room, as channels do by default. CHAN_OVERFLOW_FAIL returns -1 with
+// errno set to EAGAIN. CHAN_OVERFLOW_DROP_NEWEST discards the value being
+// sent and CHAN_OVERFLOW_DROP_OLDEST evicts the oldest buffered value (of the
+// same level on a priority channel) to make room, and both report the send as
+// successful. Every value refused or discarded is counted, see chan_dropped,
+// and discarded values are passed to on_drop, which may be NULL, after the
+// channel lock is released so it can free them. chan_select only picks a
+// send on a full channel once it has room, whatever the policy. Set the
+// policy before the channel is shared. Returns 0 if the policy was set or -1
+// with errno set to EINVAL if it is unknown or does not apply: only
+// CHAN_OVERFLOW_BLOCK applies to unbuffered, unbounded, sized, byte and
+// shared-memory channels, and CHAN_SPSC senders cannot evict.
+int chan_set_overflow(chan_t* chan, int policy, void (*on_drop)(void*));
+
+// Returns the number of values the channel's overflow policy has refused or
+// discarded.
+uint64_t chan_dropped(chan_t* chan);
+
+// Starts collecting statistics for the channel, which can then be read with
+// chan_stats. Counters are updated with relaxed atomics or under locks the
+// channel already holds, so they are cheap enough to leave on under load.
+// Returns 0 if statistics are being collected or -1 if they could not be
+// enabled. If -1 is returned, errno will be set.
+int chan_stats_enable(chan_t* chan);
+
+// Copies a snapshot of the channel statistics into out. The high-water mark
+// covers buffered channels. The latency histogram covers unbuffered channels
+// and mutex-guarded buffered channels, but not CHAN_SPSC or CHAN_MPMC rings.
+// Values already buffered when statistics were enabled are not included.
+// Returns 0 on success or -1 with errno set to EINVAL if statistics are not
+// enabled for the channel.
+int chan_stats(chan_t* chan, chan_stats_t* out);
+
+// Returns a file descriptor which is readable while the channel has a value
+// to receive or has been closed, so it can be waited on with poll or epoll
+// alongside other descriptors and drained with non-blocking receives such as
+// chan_drain. The descriptor is created on the first call, belongs to the
+// channel and is closed by chan_dispose; it must not be read or written.
+// Senders only touch it when the channel goes from empty to non-empty. Returns
+// -1 if the descriptor could not be created. If -1 is returned, errno will be
+// set, to ENOSYS where eventfd is not available.
+int chan_fd(chan_t* chan);
+
 // Sends a value into the channel. If the channel is unbuffered, this will
 // block until a receiver receives the value. If the channel is buffered and at
 // capacity, this will block until a receiver receives a value. Returns 0 if
 // the send succeeded or -1 if it failed.
 int chan_send(chan_t* chan, void* data);
 
+// Sends a value into a priority channel at the given level, blocking while
+// that level is at capacity. Returns 0 if the send succeeded or -1 if it
+// failed. If -1 is returned, errno will be set, to EINVAL if the channel is
+// not a priority channel or the level is out of range.
+int chan_send_prio(chan_t* chan, void* data, int level);
+
 // Receives a value from the channel. This will block until there is data to
 // receive. Returns 0 if the receive succeeded or -1 if it failed.
 int chan_recv(chan_t* chan, void** data);
 
+// Like chan_send, but gives up if the send cannot complete within timeout.
+// A NULL timeout blocks like chan_send and a zero timeout only sends if it can
+// do so immediately. Returns 0 if the send succeeded or -1 if it failed. If
+// the timeout expired, errno will be set to ETIMEDOUT.
+int chan_send_timeout(chan_t* chan, void* data,
+    const struct timespec* timeout);
+
+// Like chan_recv, but gives up if nothing can be received within timeout. A
+// NULL timeout blocks like chan_recv and a zero timeout only receives if a
+// value is available immediately. Returns 0 if the receive succeeded or -1 if
+// it failed. If the timeout expired, errno will be set to ETIMEDOUT.
+int chan_recv_timeout(chan_t* chan, void** data,
+    const struct timespec* timeout);
+
+// Sends a value only if that can be done without blocking: into a buffered
+// channel with room, or to a receiver already blocked on an unbuffered
+// channel. A channel whose overflow policy never blocks applies it instead.
+// Readiness is probed without locking first, so a failed attempt is almost
+// free, and a send that goes ahead takes the channel lock once, or not at all
+// for CHAN_SPSC and CHAN_MPMC channels. Returns 0 if the value was sent or -1
+// with errno set, to EAGAIN if the send would block or EPIPE if the channel
+// is closed.
+int chan_try_send(chan_t* chan, void* data);
+
+// Receives a value only if one is available without blocking, from the
+// buffer or from a sender already blocked on an unbuffered channel. Like
+// chan_try_send, it probes without locking and takes the channel lock at most
+// once. Returns 0 if a value was received or -1 with errno set, to EAGAIN if
+// the receive would block or EPIPE if the channel is closed and empty.
+int chan_try_recv(chan_t* chan, void** data);
+
+// Sends count values from data into the channel in order, blocking until all
+// of them have been sent. Buffered channels move as many values as fit each
+// time the channel is locked and wake receivers once per batch rather than
+// once per value. Returns the number of values sent, which is less than count
+// only if the channel was closed, or -1 if none were sent. If fewer than count
+// values were sent, errno will be set.
+int chan_send_many(chan_t* chan, void* data[], int count);
+
+// Receives up to count values from the channel into data, blocking until at
+// least one is available. Buffered channels move every available value, up to
+// count, under one lock acquisition. Returns the number of values received or
+// -1 if the channel is closed and empty. If -1 is returned, errno will be set.
+int chan_recv_many(chan_t* chan, void* data[], int count);
+
+// Receives everything currently buffered in the channel, up to count values,
+// without blocking. Returns the number of values received, which is 0 if the
+// channel is empty, or -1 if it is closed and empty. If -1 is returned, errno
+// will be set.
+int chan_drain(chan_t* chan, void* data[], int count);
+
+// Reserves room for a message of up to len bytes in a byte channel and returns
+// a pointer to it, 8-byte aligned, for the caller to fill. Blocks until there
+// is room. Senders are serialized: the reservation is held, and other senders
+// wait, until the same thread calls chan_commit. Returns NULL if it failed, in
+// which case errno will be set to EPIPE if the channel is closed or EMSGSIZE
+// if the message can never fit.
+void* chan_reserve(chan_t* chan, size_t len);
+
+// Publishes the message reserved by chan_reserve, len bytes long, to
+// receivers. len may be less than the reserved length. Returns 0 if the
+// message was published or -1 with errno set to EINVAL if len is longer than
+// the reservation, in which case the reservation is still held.
+int chan_commit(chan_t* chan, size_t len);
+
+// Returns a pointer to the oldest message in a byte channel and stores its
+// length in len, blocking until there is one. The message stays in the ring,
+// and other receivers wait, until the same thread calls chan_consume, so the
+// pointer is valid until then. Returns NULL if the channel is closed and
+// empty. If NULL is returned, errno will be set.
+const void* chan_peek_msg(chan_t* chan, size_t* len);
+
+// Removes the message returned by chan_peek_msg, freeing its room for
+// senders. Returns 0 on success.
+int chan_consume(chan_t* chan);
+
 // Returns the number of items in the channel buffer. If the channel is
-// unbuffered, this will return 0.
+// unbuffered, this will return 0. For byte channels, this is the number of
+// bytes in use, including headers and padding.
 int chan_size(chan_t* chan);
 
 // A select statement chooses which of a set of possible send or receive
@@ -75,7 +455,110 @@ int chan_size(chan_t* chan);
 int chan_select(chan_t* recv_chans[], int recv_count, void** recv_out,
     chan_t* send_chans[], int send_count, void* send_msgs[]);
 
-// Typed interface to send/recv chan.
+// Like chan_select, but blocks until one of the operations can proceed instead
+// of returning -1. The chosen operation is committed while all involved
+// channels are locked, so it cannot be lost to another thread. Returns -1 and
+// sets errno to EPIPE if every channel is closed such that none of the
+// operations can ever proceed.
+int chan_select_wait(chan_t* recv_chans[], int recv_count, void** recv_out,
+    chan_t* send_chans[], int send_count, void* send_msgs[]);
+
+// Like chan_select_wait, but gives up if none of the operations can proceed
+// within timeout. A NULL timeout blocks like chan_select_wait. If the timeout
+// expired, -1 is returned and errno is set to ETIMEDOUT.
+int chan_select_timeout(chan_t* recv_chans[], int recv_count, void** recv_out,
+    chan_t* send_chans[], int send_count, void* send_msgs[],
+    const struct timespec* timeout);
+
+// Allocates and returns a new, empty channel set with room for capacity
+// channels. A set is a persistent receive-only select: channels are added
+// once and mark themselves in the set's readiness bitmap whenever a receive
+// on them may have become possible, so selecting on the set only visits the
+// channels that were marked instead of locking every one. This suits selects
+// over thousands of mostly idle channels. Sets errno and returns NULL if
+// initialization failed.
+chan_set_t* chan_set_init(int capacity);
+
+// Releases the set resources, removing any channels still in it. No other
+// thread may be using the set or sending on its channels.
+void chan_set_dispose(chan_set_t* set);
+
+// Adds a channel to the set for receiving. A channel can be in at most one
+// set at a time. Returns the index the set's selects report the channel
+// under, or -1 if it could not be added. If -1 is returned, errno will be set,
+// to ENOSPC if the set is full, EBUSY if the channel is already in a set or
+// EINVAL if the channel does not carry pointers.
+int chan_set_add(chan_set_t* set, chan_t* chan);
+
+// Removes a channel from the set. Must not be called while a select on the
+// set is running. Returns 0 if the channel was removed or -1 with errno set to
+// EINVAL if it is not in the set.
+int chan_set_remove(chan_set_t* set, chan_t* chan);
+
+// Receives from whichever channel in the set has a value, without blocking.
+// Channels are visited round-robin. Returns the index of the channel received
+// from, as returned by chan_set_add, or -1 if none had a value.
+int chan_set_select(chan_set_t* set, void** recv_out);
+
+// Like chan_set_select, but blocks until one of the channels has a value.
+// Returns -1 and sets errno to EPIPE if every channel in the set is closed
+// and empty.
+int chan_set_select_wait(chan_set_t* set, void** recv_out);
+
+// Like chan_set_select_wait, but gives up if none of the channels has a value
+// within timeout. A NULL timeout blocks like chan_set_select_wait. If the
+// timeout expired, -1 is returned and errno is set to ETIMEDOUT.
+int chan_set_select_timeout(chan_set_t* set, void** recv_out,
+    const struct timespec* timeout);
+
+// Allocates and returns a new broadcast channel whose ring holds capacity
+// values, rounded up to a power of two and at least 2. Every value sent is
+// stored once and received by every subscriber, each reading the ring at its
+// own position, in the style of the LMAX Disruptor. The producer is only held
+// back by the slowest subscriber that may not miss values. Sets errno and
+// returns NULL if initialization failed.
+chan_bcast_t* chan_bcast_init(size_t capacity);
+
+// Releases the broadcast channel resources, including any subscribers that
+// have not unsubscribed.
+void chan_bcast_dispose(chan_bcast_t* bcast);
+
+// Closes the broadcast channel. Subscribers receive what was sent before the
+// close and then get an error. Returns 0 if the channel was closed or -1 with
+// errno set to EPIPE if it already was.
+int chan_bcast_close(chan_bcast_t* bcast);
+
+// Sends a value to every current subscriber. The value is stored once in the
+// ring and every subscriber reads the same pointer, so it must stay valid and
+// unchanged while any of them may use it. Senders are serialized. Blocks while
+// the slowest lossless subscriber is a full ring behind. Returns 0 if the
+// value was sent or -1 with errno set to EPIPE if the channel is closed.
+int chan_bcast_send(chan_bcast_t* bcast, void* data);
+
+// Adds a subscriber which receives every value sent from now on. With
+// CHAN_SUB_LOSSY in flags, the subscriber does not hold the producer back;
+// if it falls a full ring behind it skips ahead and counts the values it
+// missed. A subscriber must only be used by one thread at a time. Returns
+// NULL if the subscriber could not be added. If NULL is returned, errno will
+// be set.
+chan_sub_t* chan_bcast_subscribe(chan_bcast_t* bcast, int flags);
+
+// Removes a subscriber and releases it. Must not be called while the
+// subscriber is receiving.
+void chan_bcast_unsubscribe(chan_sub_t* sub);
+
+// Receives the next value for the subscriber, blocking until one is sent.
+// Returns 0 if a value was received or -1 with errno set to EPIPE if the
+// channel is closed and the subscriber has received everything sent before.
+int chan_sub_recv(chan_sub_t* sub, void** data);
+
+// Returns how many values a CHAN_SUB_LOSSY subscriber has skipped because it
+// fell too far behind.
+uint64_t chan_sub_dropped(chan_sub_t* sub);
+
+// Typed interface to send/recv chan. On channels created with chan_init_sized
+// the value is copied by value and its size must match the element size.
+// Otherwise each value is boxed in a heap allocation that the receiver frees.
 int chan_send_int32(chan_t*, int32_t);
 int chan_send_int64(chan_t*, int64_t);
 #if ULONG_MAX == 4294967295UL
@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+
+#ifdef __APPLE__
+#define _XOPEN_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "chan_mem.h"
+#include "spsc_queue.h"
+
+// Size of huge pages assumed when rounding MAP_HUGETLB mappings.
+#define CHAN_MEM_HUGE_PAGE (2 * 1024 * 1024)
+
+// The mbind policy binding pages to the given nodes, from <numaif.h>.
+#define CHAN_MEM_MPOL_BIND 2
+
+// Bookkeeping kept in the cache line in front of every block, so a block can
+// be released without the caller remembering how it was placed.
+typedef struct chan_mem_header_t
+{
+    size_t map_size; // Size of the mapping, or 0 for heap memory
+    char   pad[CHAN_CACHE_LINE - sizeof(size_t)];
+} chan_mem_header_t;
+
+// Maps size bytes of anonymous memory as mem describes. Returns MAP_FAILED
+// and sets errno if it failed.
+static void* chan_mem_map(size_t size, const chan_mem_t* mem)
+{
+#ifdef __linux__
+    void* addr = MAP_FAILED;
+    int prot = PROT_READ | PROT_WRITE;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if (mem->flags & CHAN_MEM_HUGEPAGES)
+    {
+        addr = mmap(NULL, size, prot, flags | MAP_HUGETLB, -1, 0);
+        if (addr == MAP_FAILED)
+        {
+            // No huge pages are reserved; ask for transparent ones instead.
+            addr = mmap(NULL, size, prot, flags, -1, 0);
+            if (addr != MAP_FAILED)
+            {
+                madvise(addr, size, MADV_HUGEPAGE);
+            }
+        }
+    }
+    else
+    {
+        addr = mmap(NULL, size, prot, flags, -1, 0);
+    }
+    if (addr == MAP_FAILED)
+    {
+        return MAP_FAILED;
+    }
+
+    if (mem->flags & CHAN_MEM_NUMA)
+    {
+        // Nothing has touched the pages yet, so binding now places all of
+        // them on the node whichever thread faults them in.
+        unsigned long mask[16] = { 0 };
+        size_t bits = 8 * sizeof(unsigned long);
+        if (mem->node < 0 || (size_t) mem->node >= 16 * bits)
+        {
+            munmap(addr, size);
+            errno = EINVAL;
+            return MAP_FAILED;
+        }
+        mask[mem->node / bits] = 1ul << (mem->node % bits);
+        if (syscall(SYS_mbind, addr, size, CHAN_MEM_MPOL_BIND, mask,
+                16 * bits, 0) != 0)
+        {
+            int err = errno;
+            munmap(addr, size);
+            errno = err;
+            return MAP_FAILED;
+        }
+    }
+    return addr;
+#else
+    (void) size;
+    (void) mem;
+    errno = ENOSYS;
+    return MAP_FAILED;
+#endif
+}
+
+// Allocates size bytes aligned to CHAN_CACHE_LINE and placed as described by
+// mem, which may be NULL. Blocks with CHAN_MEM_HUGEPAGES are mapped with
+// MAP_HUGETLB, falling back to transparent huge pages when none are reserved;
+// the flag is ignored for blocks under half a huge page, which would mostly
+// waste it. Blocks with CHAN_MEM_NUMA are mapped and bound to the node so their pages
+// are only ever allocated there. The memory is not initialized. Returns NULL
+// and sets errno if the block could not be allocated or placed, to ENOSYS if
+// the placement is not supported on this platform.
+void* chan_mem_alloc(size_t size, const chan_mem_t* mem)
+{
+    if (size > SIZE_MAX - CHAN_MEM_HUGE_PAGE - sizeof(chan_mem_header_t))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size += sizeof(chan_mem_header_t);
+
+    chan_mem_t place = { 0, 0 };
+    if (mem)
+    {
+        place = *mem;
+    }
+    if (size < CHAN_MEM_HUGE_PAGE / 2)
+    {
+        place.flags &= ~CHAN_MEM_HUGEPAGES;
+    }
+
+    chan_mem_header_t* header;
+    if (place.flags)
+    {
+        // Mappings must be a whole number of pages long.
+        size_t page = place.flags & CHAN_MEM_HUGEPAGES ?
+            CHAN_MEM_HUGE_PAGE : (size_t) sysconf(_SC_PAGESIZE);
+        size = (size + page - 1) / page * page;
+        void* addr = chan_mem_map(size, &place);
+        if (addr == MAP_FAILED)
+        {
+            return NULL;
+        }
+        header = (chan_mem_header_t*) addr;
+        header->map_size = size;
+    }
+    else
+    {
+        void* addr;
+        if (posix_memalign(&addr, CHAN_CACHE_LINE, size) != 0)
+        {
+            errno = ENOMEM;
+            return NULL;
+        }
+        header = (chan_mem_header_t*) addr;
+        header->map_size = 0;
+    }
+    return header + 1;
+}
+
+// Releases a block returned by chan_mem_alloc. Does nothing if ptr is NULL.
+void chan_mem_free(void* ptr)
+{
+    if (!ptr)
+    {
+        return;
+    }
+
+    chan_mem_header_t* header = (chan_mem_header_t*) ptr - 1;
+    if (header->map_size)
+    {
+        munmap(header, header->map_size);
+    }
+    else
+    {
+        free(header);
+    }
+}
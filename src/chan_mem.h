@@ -0,0 +1,31 @@
+#ifndef chan_mem_h
+#define chan_mem_h
+
+#include <stddef.h>
+
+// Flags for chan_mem_t.
+#define CHAN_MEM_HUGEPAGES 0x1 // Back the block with huge pages.
+#define CHAN_MEM_NUMA 0x2      // Bind the block to node.
+
+// Describes where a block of channel memory should be placed. A NULL
+// chan_mem_t, or one with no flags, asks for ordinary heap memory.
+typedef struct chan_mem_t
+{
+    int flags;
+    int node;
+} chan_mem_t;
+
+// Allocates size bytes aligned to CHAN_CACHE_LINE and placed as described by
+// mem, which may be NULL. Blocks with CHAN_MEM_HUGEPAGES are mapped with
+// MAP_HUGETLB, falling back to transparent huge pages when none are reserved;
+// the flag is ignored for blocks under half a huge page, which would mostly
+// waste it. Blocks with CHAN_MEM_NUMA are mapped and bound to the node so their pages
+// are only ever allocated there. The memory is not initialized. Returns NULL
+// and sets errno if the block could not be allocated or placed, to ENOSYS if
+// the placement is not supported on this platform.
+void* chan_mem_alloc(size_t size, const chan_mem_t* mem);
+
+// Releases a block returned by chan_mem_alloc. Does nothing if ptr is NULL.
+void chan_mem_free(void* ptr);
+
+#endif
@@ -0,0 +1,647 @@
+#define _GNU_SOURCE
+
+#ifdef __APPLE__
+#define _XOPEN_SOURCE
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "chan_pool.h"
+#include "seg_queue.h"
+#include "steal_queue.h"
+
+// Most jobs moved from an inbox to a deque at a time.
+#define CHAN_POOL_BATCH 64
+
+// A worker thread of a pool and the queues it owns. Its deque is only pushed
+// to by the worker itself; jobs from other threads land in its inbox, which
+// the worker moves onto the deque in batches.
+typedef struct chan_pool_worker_t
+{
+    struct chan_pool_t* pool;
+    int                 index;
+    int                 cpu;
+    unsigned            seed;
+    pthread_t           thread;
+    steal_queue_t*      deque;
+
+    // Jobs sent from outside the pool, guarded by in_mu. in_size mirrors the
+    // inbox size so it can be checked without the lock.
+    pthread_mutex_t     in_mu;
+    seg_queue_t*        inbox;
+    size_t              in_size;
+
+    // Results of the jobs this worker ran, guarded by out_mu.
+    pthread_mutex_t     out_mu;
+    seg_queue_t*        results;
+    size_t              out_size;
+
+    // Keeps workers from sharing a cache line.
+    char                pad[CHAN_CACHE_LINE];
+} chan_pool_worker_t;
+
+struct chan_pool_t
+{
+    void*               (*fn)(void*);
+    int                 flags;
+    int                 worker_count;
+    chan_pool_worker_t* workers;
+    unsigned            next;
+    int                 closed;
+
+    // Set by chan_pool_close once no sender can queue another job, guarded
+    // by mu. Workers only exit after seeing it.
+    int                 drained;
+
+    // Guards sleeping: idle workers wait on idle_cond and receivers waiting
+    // for a result on res_cond. idle and r_waiting count them so the fast
+    // paths only take mu when somebody needs waking.
+    pthread_mutex_t     mu;
+    pthread_cond_t      idle_cond;
+    pthread_cond_t      res_cond;
+    int                 idle;
+    int                 r_waiting;
+    int                 live;
+};
+
+static pthread_once_t chan_pool_once = PTHREAD_ONCE_INIT;
+static pthread_key_t chan_pool_key;
+
+static void chan_pool_key_init(void)
+{
+    pthread_key_create(&chan_pool_key, NULL);
+}
+
+// Moves up to count jobs from the inbox of victim onto the deque of self,
+// which must be the calling worker. Returns the number of jobs moved.
+static int chan_pool_refill(chan_pool_worker_t* self,
+    chan_pool_worker_t* victim, int count)
+{
+    if (__atomic_load_n(&victim->in_size, __ATOMIC_ACQUIRE) == 0)
+    {
+        return 0;
+    }
+
+    size_t room = self->deque->capacity - steal_queue_size(self->deque);
+    count = count > CHAN_POOL_BATCH ? CHAN_POOL_BATCH : count;
+    count = (size_t) count > room ? (int) room : count;
+
+    void* jobs[CHAN_POOL_BATCH];
+    pthread_mutex_lock(&victim->in_mu);
+    if (victim != self)
+    {
+        // Leave the owner at least half of its inbox.
+        int half = (int) ((victim->inbox->size + 1) / 2);
+        count = count > half ? half : count;
+    }
+    int n = seg_queue_remove_many(victim->inbox, jobs, count);
+    __atomic_store_n(&victim->in_size, victim->inbox->size, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&victim->in_mu);
+
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        steal_queue_push(self->deque, jobs[i]);
+    }
+    return n;
+}
+
+// Takes the next job for a worker: from its own deque, then its inbox, then
+// the deques and inboxes of the other workers. Returns 1 if a job was taken.
+static int chan_pool_take(chan_pool_worker_t* self, void** job)
+{
+    if (steal_queue_pop(self->deque, job) == 0)
+    {
+        return 1;
+    }
+    if (chan_pool_refill(self, self, CHAN_POOL_BATCH) > 0 &&
+        steal_queue_pop(self->deque, job) == 0)
+    {
+        return 1;
+    }
+
+    chan_pool_t* pool = self->pool;
+    int n = pool->worker_count;
+    int start = rand_r(&self->seed) % n;
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        chan_pool_worker_t* victim = &pool->workers[(start + i) % n];
+        if (victim == self)
+        {
+            continue;
+        }
+
+        // A lost race means the deque still had items, so try again.
+        int rc;
+        do
+        {
+            rc = steal_queue_steal(victim->deque, job);
+        } while (rc == -1);
+        if (rc == 1)
+        {
+            return 1;
+        }
+        if (chan_pool_refill(self, victim, CHAN_POOL_BATCH) > 0 &&
+            steal_queue_pop(self->deque, job) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Returns non-zero if any worker has a job queued. Used by a worker about to
+// sleep after publishing that it is idle.
+static int chan_pool_pending(chan_pool_t* pool)
+{
+    int i;
+    for (i = 0; i < pool->worker_count; i++)
+    {
+        chan_pool_worker_t* worker = &pool->workers[i];
+        if (steal_queue_size(worker->deque) > 0 ||
+            __atomic_load_n(&worker->in_size, __ATOMIC_ACQUIRE) > 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Returns non-zero if any worker holds a result.
+static int chan_pool_has_results(chan_pool_t* pool)
+{
+    int i;
+    for (i = 0; i < pool->worker_count; i++)
+    {
+        if (__atomic_load_n(&pool->workers[i].out_size, __ATOMIC_ACQUIRE) > 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Wakes an idle worker after a job was queued, if there is one.
+static void chan_pool_wake(chan_pool_t* pool)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->idle, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&pool->mu);
+        pthread_cond_signal(&pool->idle_cond);
+        pthread_mutex_unlock(&pool->mu);
+    }
+}
+
+// Keeps the result of a job and wakes a receiver waiting for one.
+static void chan_pool_put_result(chan_pool_worker_t* self, void* result)
+{
+    pthread_mutex_lock(&self->out_mu);
+    if (seg_queue_add(self->results, result) == 0)
+    {
+        __atomic_store_n(&self->out_size, self->results->size,
+            __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&self->out_mu);
+
+    chan_pool_t* pool = self->pool;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pool->r_waiting, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&pool->mu);
+        pthread_cond_signal(&pool->res_cond);
+        pthread_mutex_unlock(&pool->mu);
+    }
+}
+
+static void* chan_pool_worker_main(void* arg)
+{
+    chan_pool_worker_t* self = (chan_pool_worker_t*) arg;
+    chan_pool_t* pool = self->pool;
+    pthread_setspecific(chan_pool_key, self);
+
+#ifdef __linux__
+    if (self->cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(self->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+#endif
+
+    for (;;)
+    {
+        void* job;
+        if (chan_pool_take(self, &job))
+        {
+            void* result = pool->fn(job);
+            if (pool->flags & CHAN_POOL_RESULTS)
+            {
+                chan_pool_put_result(self, result);
+            }
+            continue;
+        }
+
+        // Publish that we are idle before the final look for work, so a
+        // sender either sees us idle or we see its job.
+        pthread_mutex_lock(&pool->mu);
+        __atomic_add_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int stop = 0;
+        int drained = pool->drained;
+        if (!chan_pool_pending(pool))
+        {
+            if (drained)
+            {
+                stop = 1;
+            }
+            else
+            {
+                pthread_cond_wait(&pool->idle_cond, &pool->mu);
+            }
+        }
+        __atomic_sub_fetch(&pool->idle, 1, __ATOMIC_SEQ_CST);
+        if (stop)
+        {
+            // Receivers may be waiting for results that will never come.
+            pool->live--;
+            pthread_cond_broadcast(&pool->res_cond);
+            pthread_cond_broadcast(&pool->idle_cond);
+            pthread_mutex_unlock(&pool->mu);
+            return NULL;
+        }
+        pthread_mutex_unlock(&pool->mu);
+    }
+}
+
+// Releases the queues and locks of the first count workers.
+static void chan_pool_free_workers(chan_pool_t* pool, int count)
+{
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        chan_pool_worker_t* worker = &pool->workers[i];
+        steal_queue_dispose(worker->deque);
+        seg_queue_dispose(worker->inbox);
+        seg_queue_dispose(worker->results);
+        pthread_mutex_destroy(&worker->in_mu);
+        pthread_mutex_destroy(&worker->out_mu);
+    }
+    chan_mem_free(pool->workers);
+}
+
+// Sets up a worker's queues and locks. Returns 0 on success or -1 with errno
+// set.
+static int chan_pool_worker_init(chan_pool_t* pool, chan_pool_worker_t* worker,
+    int index, int cpu)
+{
+    worker->pool = pool;
+    worker->index = index;
+    worker->cpu = cpu;
+    worker->seed = (unsigned) index + 1;
+    worker->in_size = 0;
+    worker->out_size = 0;
+    worker->deque = steal_queue_init(CHAN_POOL_DEQUE_SIZE);
+    worker->inbox = seg_queue_init();
+    worker->results = seg_queue_init();
+    if (!worker->deque || !worker->inbox || !worker->results)
+    {
+        if (worker->deque)
+        {
+            steal_queue_dispose(worker->deque);
+        }
+        if (worker->inbox)
+        {
+            seg_queue_dispose(worker->inbox);
+        }
+        if (worker->results)
+        {
+            seg_queue_dispose(worker->results);
+        }
+        errno = ENOMEM;
+        return -1;
+    }
+
+    if (pthread_mutex_init(&worker->in_mu, NULL) != 0)
+    {
+        steal_queue_dispose(worker->deque);
+        seg_queue_dispose(worker->inbox);
+        seg_queue_dispose(worker->results);
+        errno = ENOMEM;
+        return -1;
+    }
+    if (pthread_mutex_init(&worker->out_mu, NULL) != 0)
+    {
+        pthread_mutex_destroy(&worker->in_mu);
+        steal_queue_dispose(worker->deque);
+        seg_queue_dispose(worker->inbox);
+        seg_queue_dispose(worker->results);
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}
+
+// Returns the CPU worker index should be pinned to, the index-th CPU in the
+// process's affinity mask, or -1 if it cannot be pinned.
+static int chan_pool_cpu(int index)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0 || CPU_COUNT(&set) == 0)
+    {
+        return -1;
+    }
+
+    int n = index % CPU_COUNT(&set);
+    int cpu;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &set) && n-- == 0)
+        {
+            return cpu;
+        }
+    }
+#else
+    (void) index;
+#endif
+    return -1;
+}
+
+// Allocates and returns a pool of worker threads, each calling fn on the
+// jobs sent to the pool. With CHAN_POOL_RESULTS, the value fn returns for
+// each job is kept for chan_pool_recv; otherwise it is ignored. With
+// CHAN_POOL_PIN, worker i is pinned to the i-th CPU the process may run on
+// (Linux only). Returns NULL and sets errno if initialization failed.
+chan_pool_t* chan_pool_init(int workers, void* (*fn)(void*), int flags)
+{
+    if (workers < 1 || !fn ||
+        (flags & ~(CHAN_POOL_RESULTS | CHAN_POOL_PIN)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    pthread_once(&chan_pool_once, chan_pool_key_init);
+
+    chan_pool_t* pool = (chan_pool_t*) malloc(sizeof(chan_pool_t));
+    if (!pool)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    pool->fn = fn;
+    pool->flags = flags;
+    pool->worker_count = workers;
+    pool->next = 0;
+    pool->closed = 0;
+    pool->drained = 0;
+    pool->idle = 0;
+    pool->r_waiting = 0;
+    pool->live = workers;
+
+    pool->workers = (chan_pool_worker_t*) chan_mem_alloc(
+        workers * sizeof(chan_pool_worker_t), NULL);
+    if (!pool->workers)
+    {
+        free(pool);
+        return NULL;
+    }
+
+    int i;
+    for (i = 0; i < workers; i++)
+    {
+        int cpu = flags & CHAN_POOL_PIN ? chan_pool_cpu(i) : -1;
+        if (chan_pool_worker_init(pool, &pool->workers[i], i, cpu) != 0)
+        {
+            int err = errno;
+            chan_pool_free_workers(pool, i);
+            free(pool);
+            errno = err;
+            return NULL;
+        }
+    }
+
+    if (pthread_mutex_init(&pool->mu, NULL) != 0)
+    {
+        chan_pool_free_workers(pool, workers);
+        free(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (pthread_cond_init(&pool->idle_cond, NULL) != 0)
+    {
+        pthread_mutex_destroy(&pool->mu);
+        chan_pool_free_workers(pool, workers);
+        free(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (pthread_cond_init(&pool->res_cond, NULL) != 0)
+    {
+        pthread_cond_destroy(&pool->idle_cond);
+        pthread_mutex_destroy(&pool->mu);
+        chan_pool_free_workers(pool, workers);
+        free(pool);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (i = 0; i < workers; i++)
+    {
+        int rc = pthread_create(&pool->workers[i].thread, NULL,
+            chan_pool_worker_main, &pool->workers[i]);
+        if (rc != 0)
+        {
+            // Let the workers already started exit, then tear down.
+            chan_pool_close(pool);
+            int j;
+            for (j = 0; j < i; j++)
+            {
+                pthread_join(pool->workers[j].thread, NULL);
+            }
+            pthread_cond_destroy(&pool->res_cond);
+            pthread_cond_destroy(&pool->idle_cond);
+            pthread_mutex_destroy(&pool->mu);
+            chan_pool_free_workers(pool, workers);
+            free(pool);
+            errno = rc;
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+// Closes the pool if it is open, waits for its workers to finish the jobs
+// already sent and releases the pool. Results not received are dropped.
+void chan_pool_dispose(chan_pool_t* pool)
+{
+    if (!__atomic_load_n(&pool->closed, __ATOMIC_ACQUIRE))
+    {
+        chan_pool_close(pool);
+    }
+
+    int i;
+    for (i = 0; i < pool->worker_count; i++)
+    {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    pthread_cond_destroy(&pool->res_cond);
+    pthread_cond_destroy(&pool->idle_cond);
+    pthread_mutex_destroy(&pool->mu);
+    chan_pool_free_workers(pool, pool->worker_count);
+    free(pool);
+}
+
+// Sends a job to the pool, like chan_send on an unbounded channel: it never
+// blocks. A job sent from one of the pool's workers goes onto that worker's
+// own deque without taking a lock; other threads spread their jobs over the
+// workers' inboxes. Returns 0 if the job was sent or -1 with errno set to
+// EPIPE if the pool is closed.
+int chan_pool_send(chan_pool_t* pool, void* job)
+{
+    chan_pool_worker_t* self =
+        (chan_pool_worker_t*) pthread_getspecific(chan_pool_key);
+    int local = self && self->pool == pool;
+    if (local)
+    {
+        if (__atomic_load_n(&pool->closed, __ATOMIC_ACQUIRE))
+        {
+            errno = EPIPE;
+            return -1;
+        }
+
+        // The worker is still running, so it will see the job before it
+        // exits even if the pool is closed meanwhile.
+        if (steal_queue_push(self->deque, job) == 0)
+        {
+            chan_pool_wake(pool);
+            return 0;
+        }
+    }
+    else
+    {
+        unsigned n = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        self = &pool->workers[n % pool->worker_count];
+    }
+
+    // closed is checked under in_mu, which chan_pool_close takes after
+    // setting it, so no job lands in an inbox after the workers' last look.
+    // A worker overflowing into its own inbox will still see its job.
+    pthread_mutex_lock(&self->in_mu);
+    if (!local && __atomic_load_n(&pool->closed, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_unlock(&self->in_mu);
+        errno = EPIPE;
+        return -1;
+    }
+    if (seg_queue_add(self->inbox, job) != 0)
+    {
+        pthread_mutex_unlock(&self->in_mu);
+        return -1;
+    }
+    __atomic_store_n(&self->in_size, self->inbox->size, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&self->in_mu);
+
+    chan_pool_wake(pool);
+    return 0;
+}
+
+// Receives the result of a job from a pool created with CHAN_POOL_RESULTS,
+// blocking until one is available. Returns 0 if a result was received or -1
+// with errno set, to EPIPE once the pool is closed and every result has been
+// received, or EINVAL if the pool does not keep results.
+int chan_pool_recv(chan_pool_t* pool, void** result)
+{
+    if (!(pool->flags & CHAN_POOL_RESULTS))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (;;)
+    {
+        unsigned start = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+        int i;
+        for (i = 0; i < pool->worker_count; i++)
+        {
+            chan_pool_worker_t* worker =
+                &pool->workers[(start + i) % pool->worker_count];
+            if (__atomic_load_n(&worker->out_size, __ATOMIC_ACQUIRE) == 0)
+            {
+                continue;
+            }
+
+            pthread_mutex_lock(&worker->out_mu);
+            int got = worker->results->size > 0;
+            if (got)
+            {
+                *result = seg_queue_remove(worker->results);
+                __atomic_store_n(&worker->out_size, worker->results->size,
+                    __ATOMIC_RELEASE);
+            }
+            pthread_mutex_unlock(&worker->out_mu);
+            if (got)
+            {
+                return 0;
+            }
+        }
+
+        pthread_mutex_lock(&pool->mu);
+        __atomic_add_fetch(&pool->r_waiting, 1, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        int done = 0;
+        if (!chan_pool_has_results(pool))
+        {
+            if (pool->live == 0)
+            {
+                done = 1;
+            }
+            else
+            {
+                pthread_cond_wait(&pool->res_cond, &pool->mu);
+            }
+        }
+        __atomic_sub_fetch(&pool->r_waiting, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&pool->mu);
+        if (done)
+        {
+            errno = EPIPE;
+            return -1;
+        }
+    }
+}
+
+// Closes the pool so no more jobs can be sent. The workers finish the jobs
+// already sent, then exit. Returns 0 if the pool was closed or -1 with errno
+// set to EPIPE if it already was.
+int chan_pool_close(chan_pool_t* pool)
+{
+    pthread_mutex_lock(&pool->mu);
+    if (pool->closed)
+    {
+        pthread_mutex_unlock(&pool->mu);
+        errno = EPIPE;
+        return -1;
+    }
+    __atomic_store_n(&pool->closed, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pool->mu);
+
+    // Wait out senders that saw the pool open before queueing their job.
+    int i;
+    for (i = 0; i < pool->worker_count; i++)
+    {
+        pthread_mutex_lock(&pool->workers[i].in_mu);
+        pthread_mutex_unlock(&pool->workers[i].in_mu);
+    }
+
+    pthread_mutex_lock(&pool->mu);
+    pool->drained = 1;
+    pthread_cond_broadcast(&pool->idle_cond);
+    pthread_mutex_unlock(&pool->mu);
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef chan_pool_h
+#define chan_pool_h
+
+#include <stddef.h>
+
+// Flags for chan_pool_init.
+#define CHAN_POOL_RESULTS 0x1 // Keep job results for chan_pool_recv.
+#define CHAN_POOL_PIN 0x2 // Pin each worker to one of the process's CPUs.
+
+// Number of jobs each worker's deque can hold. Jobs beyond that wait in the
+// worker's inbox.
+#define CHAN_POOL_DEQUE_SIZE 1024
+
+// A pool of worker threads running jobs, see chan_pool_init.
+typedef struct chan_pool_t chan_pool_t;
+
+// Allocates and returns a pool of worker threads, each calling fn on the
+// jobs sent to the pool. Every worker has its own deque of jobs, and a worker
+// that runs out steals from the others, so workers mostly touch only their
+// own state. With CHAN_POOL_RESULTS, the value fn returns for each job is
+// kept for chan_pool_recv; otherwise it is ignored. With CHAN_POOL_PIN,
+// worker i is pinned to the i-th CPU the process may run on (Linux only).
+// Returns NULL and sets errno if initialization failed.
+chan_pool_t* chan_pool_init(int workers, void* (*fn)(void*), int flags);
+
+// Closes the pool if it is open, waits for its workers to finish the jobs
+// already sent and releases the pool. Results not received are dropped.
+void chan_pool_dispose(chan_pool_t* pool);
+
+// Sends a job to the pool, like chan_send on an unbounded channel: it never
+// blocks. A job sent from one of the pool's workers goes onto that worker's
+// own deque without taking a lock; other threads spread their jobs over the
+// workers' inboxes. Jobs run in no particular order. Returns 0 if the job was
+// sent or -1 with errno set to EPIPE if the pool is closed.
+int chan_pool_send(chan_pool_t* pool, void* job);
+
+// Receives the result of a job from a pool created with CHAN_POOL_RESULTS,
+// blocking until one is available. Returns 0 if a result was received or -1
+// with errno set, to EPIPE once the pool is closed and every result has been
+// received, or EINVAL if the pool does not keep results.
+int chan_pool_recv(chan_pool_t* pool, void** result);
+
+// Closes the pool so no more jobs can be sent. The workers finish the jobs
+// already sent, then exit. Returns 0 if the pool was closed or -1 with errno
+// set to EPIPE if it already was.
+int chan_pool_close(chan_pool_t* pool);
+
+#endif
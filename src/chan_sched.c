@@ -0,0 +1,723 @@
+#define _GNU_SOURCE
+
+#ifdef __APPLE__
+#define _XOPEN_SOURCE
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+#include "chan_sched.h"
+
+// Number of wait lists parked tasks are hashed into by key.
+#define CHAN_SCHED_BUCKETS 4096
+
+#if !defined(MAP_STACK)
+#define MAP_STACK 0
+#endif
+
+// Task states. A task parks by setting PARKING before it becomes visible to
+// wakers, and its worker moves it on to PARKED once it has switched away. A
+// waker that finds PARKING leaves WOKEN for the worker to see instead of
+// queueing a task that is still running.
+enum
+{
+    TASK_RUNNING,
+    TASK_PARKING,
+    TASK_PARKED,
+    TASK_WOKEN
+};
+
+typedef struct chan_worker_t chan_worker_t;
+
+struct chan_task_t
+{
+    ucontext_t       ctx;
+    void             (*fn)(void*);
+    void*            arg;
+    chan_worker_t*   worker;
+    char*            stack;
+    size_t           stack_size;
+    int              state;
+    int              done;
+
+    // What the task is parked on, NULL once woken. Guarded by the lock of the
+    // key's bucket.
+    const void*      key;
+    int              timed_out;
+    chan_task_t*     prev;
+    chan_task_t*     next;
+
+    // Deadline of the current park, owned by the task's worker.
+    struct timespec  deadline;
+    int              has_deadline;
+    int              timer_listed;
+    chan_task_t*     timer_next;
+
+    // Link in the worker's run queue.
+    chan_task_t*     run_next;
+};
+
+// A worker thread. The run queue is guarded by mu; the timer list and
+// current are only touched by the worker itself.
+struct chan_worker_t
+{
+    pthread_t        thread;
+    ucontext_t       ctx;
+    chan_task_t*     current;
+    pthread_mutex_t  mu;
+    pthread_cond_t   cond;
+    chan_task_t*     head;
+    chan_task_t*     tail;
+    int              stopping;
+    chan_task_t*     timers;
+    struct timespec  timer_min;
+};
+
+// A list of tasks parked on keys that hash to the same bucket.
+typedef struct chan_sched_bucket_t
+{
+    pthread_mutex_t  mu;
+    chan_task_t*     head;
+    chan_task_t*     tail;
+} chan_sched_bucket_t;
+
+static pthread_once_t chan_sched_once = PTHREAD_ONCE_INIT;
+static pthread_key_t chan_sched_key;
+static pthread_mutex_t chan_sched_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t chan_sched_done = PTHREAD_COND_INITIALIZER;
+static chan_sched_bucket_t chan_sched_buckets[CHAN_SCHED_BUCKETS];
+
+// Whether the runtime is running, read without chan_sched_mu on every
+// channel wait.
+static int chan_sched_running = 0;
+
+// Number of tasks parked in the buckets.
+static int chan_sched_parked = 0;
+
+static chan_worker_t* chan_sched_workers = NULL;
+static int chan_sched_worker_count = 0;
+static size_t chan_sched_stack_size = 0;
+static long chan_sched_live = 0;
+
+// Finished tasks kept with their stacks for chan_go to reuse, linked through
+// run_next and guarded by chan_sched_mu.
+static chan_task_t* chan_sched_spare = NULL;
+static unsigned chan_sched_next = 0;
+
+static void chan_sched_global_init(void)
+{
+    pthread_key_create(&chan_sched_key, NULL);
+    int i;
+    for (i = 0; i < CHAN_SCHED_BUCKETS; i++)
+    {
+        pthread_mutex_init(&chan_sched_buckets[i].mu, NULL);
+        chan_sched_buckets[i].head = NULL;
+        chan_sched_buckets[i].tail = NULL;
+    }
+}
+
+// Reads the clock channel deadlines are measured on.
+static void chan_sched_now(struct timespec* ts)
+{
+#if defined(__MACH__) || defined(_WIN32)
+    clock_gettime(CLOCK_REALTIME, ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, ts);
+#endif
+}
+
+static inline int chan_sched_before(const struct timespec* a,
+    const struct timespec* b)
+{
+    return a->tv_sec < b->tv_sec ||
+        (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static inline chan_sched_bucket_t* chan_sched_bucket(const void* key)
+{
+    uintptr_t k = (uintptr_t) key;
+    return &chan_sched_buckets[(k >> 6 ^ k >> 14) % CHAN_SCHED_BUCKETS];
+}
+
+// Adds a task to the back of its worker's run queue.
+static void chan_worker_push(chan_worker_t* worker, chan_task_t* task)
+{
+    task->run_next = NULL;
+    pthread_mutex_lock(&worker->mu);
+    if (worker->tail)
+    {
+        worker->tail->run_next = task;
+    }
+    else
+    {
+        worker->head = task;
+        pthread_cond_signal(&worker->cond);
+    }
+    worker->tail = task;
+    pthread_mutex_unlock(&worker->mu);
+}
+
+// Makes a task woken from a park runnable again.
+static void chan_task_resume(chan_task_t* task)
+{
+    if (__atomic_exchange_n(&task->state, TASK_WOKEN, __ATOMIC_ACQ_REL) ==
+        TASK_PARKED)
+    {
+        chan_worker_push(task->worker, task);
+    }
+}
+
+// Removes a task from its bucket. Must be called with the bucket lock held.
+static void chan_sched_unlink(chan_sched_bucket_t* bucket, chan_task_t* task)
+{
+    if (task->prev)
+    {
+        task->prev->next = task->next;
+    }
+    else
+    {
+        bucket->head = task->next;
+    }
+    if (task->next)
+    {
+        task->next->prev = task->prev;
+    }
+    else
+    {
+        bucket->tail = task->prev;
+    }
+    __atomic_store_n(&task->key, NULL, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&chan_sched_parked, 1, __ATOMIC_SEQ_CST);
+}
+
+// Wakes the worker's parked tasks whose deadline has passed and works out
+// when the next one is due.
+static void chan_worker_expire(chan_worker_t* worker)
+{
+    if (!worker->timers)
+    {
+        return;
+    }
+
+    struct timespec now;
+    chan_sched_now(&now);
+    if (chan_sched_before(&now, &worker->timer_min))
+    {
+        return;
+    }
+
+    chan_task_t** link = &worker->timers;
+    int first = 1;
+    while (*link)
+    {
+        chan_task_t* task = *link;
+        const void* key = __atomic_load_n(&task->key, __ATOMIC_RELAXED);
+        int keep = 0;
+        if (key && task->has_deadline)
+        {
+            chan_sched_bucket_t* bucket = chan_sched_bucket(key);
+            pthread_mutex_lock(&bucket->mu);
+            if (task->key == key)
+            {
+                if (chan_sched_before(&now, &task->deadline))
+                {
+                    keep = 1;
+                }
+                else
+                {
+                    chan_sched_unlink(bucket, task);
+                    task->timed_out = 1;
+                }
+            }
+            pthread_mutex_unlock(&bucket->mu);
+            if (!keep && task->timed_out)
+            {
+                chan_task_resume(task);
+            }
+        }
+
+        if (keep)
+        {
+            if (first || chan_sched_before(&task->deadline, &worker->timer_min))
+            {
+                worker->timer_min = task->deadline;
+                first = 0;
+            }
+            link = &task->timer_next;
+        }
+        else
+        {
+            *link = task->timer_next;
+            task->timer_listed = 0;
+        }
+    }
+}
+
+// Returns the next task to run, waiting for one if there is none. Returns
+// NULL once the worker is stopping.
+static chan_task_t* chan_worker_next(chan_worker_t* worker)
+{
+    for (;;)
+    {
+        chan_worker_expire(worker);
+
+        pthread_mutex_lock(&worker->mu);
+        chan_task_t* task = worker->head;
+        if (task)
+        {
+            worker->head = task->run_next;
+            if (!worker->head)
+            {
+                worker->tail = NULL;
+            }
+            pthread_mutex_unlock(&worker->mu);
+            return task;
+        }
+        if (worker->stopping)
+        {
+            pthread_mutex_unlock(&worker->mu);
+            return NULL;
+        }
+
+        if (worker->timers)
+        {
+            pthread_cond_timedwait(&worker->cond, &worker->mu,
+                &worker->timer_min);
+        }
+        else
+        {
+            pthread_cond_wait(&worker->cond, &worker->mu);
+        }
+        pthread_mutex_unlock(&worker->mu);
+    }
+}
+
+static void chan_task_free(chan_task_t* task)
+{
+    munmap(task->stack, task->stack_size);
+    free(task);
+}
+
+// Takes a finished task off its worker's timer list.
+static void chan_worker_untime(chan_worker_t* worker, chan_task_t* task)
+{
+    chan_task_t** link = &worker->timers;
+    while (*link != task)
+    {
+        link = &(*link)->timer_next;
+    }
+    *link = task->timer_next;
+    task->timer_listed = 0;
+}
+
+static void chan_task_entry(void)
+{
+    chan_worker_t* worker =
+        (chan_worker_t*) pthread_getspecific(chan_sched_key);
+    chan_task_t* task = worker->current;
+    task->fn(task->arg);
+    task->done = 1;
+
+    // Returning resumes the worker through uc_link.
+}
+
+static void* chan_worker_main(void* arg)
+{
+    chan_worker_t* worker = (chan_worker_t*) arg;
+    pthread_setspecific(chan_sched_key, worker);
+
+    chan_task_t* task;
+    while ((task = chan_worker_next(worker)))
+    {
+        __atomic_store_n(&task->state, TASK_RUNNING, __ATOMIC_RELAXED);
+        worker->current = task;
+        swapcontext(&worker->ctx, &task->ctx);
+        worker->current = NULL;
+
+        if (task->done)
+        {
+            if (task->timer_listed)
+            {
+                chan_worker_untime(worker, task);
+            }
+            pthread_mutex_lock(&chan_sched_mu);
+            task->run_next = chan_sched_spare;
+            chan_sched_spare = task;
+            if (--chan_sched_live == 0)
+            {
+                pthread_cond_broadcast(&chan_sched_done);
+            }
+            pthread_mutex_unlock(&chan_sched_mu);
+        }
+        else if (__atomic_load_n(&task->state, __ATOMIC_RELAXED) ==
+            TASK_RUNNING)
+        {
+            // The task yielded.
+            chan_worker_push(worker, task);
+        }
+        else
+        {
+            if (task->has_deadline)
+            {
+                if (!task->timer_listed)
+                {
+                    task->timer_listed = 1;
+                    task->timer_next = worker->timers;
+                    worker->timers = task;
+                    if (!task->timer_next ||
+                        chan_sched_before(&task->deadline, &worker->timer_min))
+                    {
+                        worker->timer_min = task->deadline;
+                    }
+                }
+                else if (chan_sched_before(&task->deadline,
+                    &worker->timer_min))
+                {
+                    worker->timer_min = task->deadline;
+                }
+            }
+
+            // A wakeup that came in while switching away is handled here.
+            if (__atomic_exchange_n(&task->state, TASK_PARKED,
+                __ATOMIC_ACQ_REL) == TASK_WOKEN)
+            {
+                chan_worker_push(worker, task);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Initializes a worker condition variable whose timed waits use the channel
+// clock.
+static int chan_worker_cond_init(pthread_cond_t* cond)
+{
+#if defined(__MACH__) || defined(_WIN32)
+    return pthread_cond_init(cond, NULL);
+#else
+    pthread_condattr_t attr;
+    if (pthread_condattr_init(&attr) != 0)
+    {
+        return -1;
+    }
+
+    int success = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) == 0 &&
+        pthread_cond_init(cond, &attr) == 0 ? 0 : -1;
+    pthread_condattr_destroy(&attr);
+    return success;
+#endif
+}
+
+// Destroys the locks of the first count workers and frees the workers.
+static void chan_sched_free_workers(chan_worker_t* pool, int count)
+{
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        pthread_mutex_destroy(&pool[i].mu);
+        pthread_cond_destroy(&pool[i].cond);
+    }
+    free(pool);
+}
+
+// Starts the task runtime with the given number of worker threads, each
+// running tasks with stacks of stack_size bytes (0 for
+// CHAN_SCHED_STACK_DEFAULT). Returns 0 on success or -1 with errno set, to
+// EINVAL if the runtime is already running or workers is less than 1.
+int chan_sched_init(int workers, size_t stack_size)
+{
+    pthread_once(&chan_sched_once, chan_sched_global_init);
+    if (workers < 1 || __atomic_load_n(&chan_sched_running, __ATOMIC_ACQUIRE))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    stack_size = stack_size ? stack_size : CHAN_SCHED_STACK_DEFAULT;
+    stack_size = (stack_size + page - 1) / page * page;
+
+    chan_worker_t* pool = (chan_worker_t*) calloc(workers,
+        sizeof(chan_worker_t));
+    if (!pool)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < workers; i++)
+    {
+        if (pthread_mutex_init(&pool[i].mu, NULL) != 0)
+        {
+            chan_sched_free_workers(pool, i);
+            errno = ENOMEM;
+            return -1;
+        }
+        if (chan_worker_cond_init(&pool[i].cond) != 0)
+        {
+            pthread_mutex_destroy(&pool[i].mu);
+            chan_sched_free_workers(pool, i);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    chan_sched_workers = pool;
+    chan_sched_worker_count = workers;
+    chan_sched_stack_size = stack_size;
+    chan_sched_live = 0;
+    __atomic_store_n(&chan_sched_running, 1, __ATOMIC_RELEASE);
+
+    for (i = 0; i < workers; i++)
+    {
+        int rc = pthread_create(&pool[i].thread, NULL, chan_worker_main,
+            &pool[i]);
+        if (rc != 0)
+        {
+            // Stop the workers already started, which releases them, and
+            // release the rest here.
+            chan_sched_worker_count = i;
+            int j;
+            for (j = i; j < workers; j++)
+            {
+                pthread_mutex_destroy(&pool[j].mu);
+                pthread_cond_destroy(&pool[j].cond);
+            }
+            chan_sched_shutdown();
+            errno = rc;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Waits for every task to finish, then stops the worker threads and releases
+// the runtime so it can be started again. Must not be called from a task.
+// Returns 0 on success or -1 with errno set, to EINVAL if the runtime is not
+// running or EDEADLK if called from a task.
+int chan_sched_shutdown(void)
+{
+    if (!__atomic_load_n(&chan_sched_running, __ATOMIC_ACQUIRE))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (chan_task_current())
+    {
+        errno = EDEADLK;
+        return -1;
+    }
+
+    pthread_mutex_lock(&chan_sched_mu);
+    while (chan_sched_live > 0)
+    {
+        pthread_cond_wait(&chan_sched_done, &chan_sched_mu);
+    }
+    pthread_mutex_unlock(&chan_sched_mu);
+
+    int i;
+    for (i = 0; i < chan_sched_worker_count; i++)
+    {
+        chan_worker_t* worker = &chan_sched_workers[i];
+        pthread_mutex_lock(&worker->mu);
+        worker->stopping = 1;
+        pthread_cond_signal(&worker->cond);
+        pthread_mutex_unlock(&worker->mu);
+    }
+    for (i = 0; i < chan_sched_worker_count; i++)
+    {
+        pthread_join(chan_sched_workers[i].thread, NULL);
+    }
+
+    __atomic_store_n(&chan_sched_running, 0, __ATOMIC_RELEASE);
+    chan_sched_free_workers(chan_sched_workers, chan_sched_worker_count);
+    chan_sched_workers = NULL;
+    chan_sched_worker_count = 0;
+    while (chan_sched_spare)
+    {
+        chan_task_t* task = chan_sched_spare;
+        chan_sched_spare = task->run_next;
+        chan_task_free(task);
+    }
+    return 0;
+}
+
+// Starts a task running fn(arg) on one of the worker threads. A task must not
+// hold a blocking mutex across a channel operation, as another task on the
+// same worker waiting for it would deadlock the worker. Returns 0 on success
+// or -1 with errno set, to EINVAL if the runtime is not running.
+int chan_go(void (*fn)(void*), void* arg)
+{
+    if (!__atomic_load_n(&chan_sched_running, __ATOMIC_ACQUIRE))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&chan_sched_mu);
+    chan_task_t* task = chan_sched_spare;
+    if (task)
+    {
+        chan_sched_spare = task->run_next;
+    }
+    pthread_mutex_unlock(&chan_sched_mu);
+
+    // Stacks have no guard page: it would split the mapping, and the kernel
+    // limits a process to around 64k mappings, far fewer than the tasks we
+    // want to run.
+    if (!task)
+    {
+        task = (chan_task_t*) calloc(1, sizeof(chan_task_t));
+        if (!task)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+        task->stack_size = chan_sched_stack_size;
+        task->stack = (char*) mmap(NULL, task->stack_size,
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK,
+            -1, 0);
+        if (task->stack == MAP_FAILED)
+        {
+            free(task);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    unsigned n = __atomic_fetch_add(&chan_sched_next, 1, __ATOMIC_RELAXED);
+    chan_worker_t* worker = &chan_sched_workers[n % chan_sched_worker_count];
+    task->fn = fn;
+    task->arg = arg;
+    task->worker = worker;
+    task->state = TASK_RUNNING;
+    task->done = 0;
+    if (getcontext(&task->ctx) != 0)
+    {
+        chan_task_free(task);
+        return -1;
+    }
+    task->ctx.uc_stack.ss_sp = task->stack;
+    task->ctx.uc_stack.ss_size = task->stack_size;
+    task->ctx.uc_link = &worker->ctx;
+    makecontext(&task->ctx, chan_task_entry, 0);
+
+    pthread_mutex_lock(&chan_sched_mu);
+    chan_sched_live++;
+    pthread_mutex_unlock(&chan_sched_mu);
+    chan_worker_push(worker, task);
+    return 0;
+}
+
+// Lets the worker run its other tasks before coming back to the calling task.
+// Outside a task, yields the thread instead.
+void chan_yield(void)
+{
+    chan_task_t* task = chan_task_current();
+    if (!task)
+    {
+        sched_yield();
+        return;
+    }
+    swapcontext(&task->ctx, &task->worker->ctx);
+}
+
+// Returns the task running on the calling thread, or NULL outside a task.
+chan_task_t* chan_task_current(void)
+{
+    if (!__atomic_load_n(&chan_sched_running, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+
+    chan_worker_t* worker =
+        (chan_worker_t*) pthread_getspecific(chan_sched_key);
+    return worker ? worker->current : NULL;
+}
+
+// Suspends the current task until chan_task_wake is called with key, like a
+// condition variable wait. Returns 0 once woken or ETIMEDOUT if the deadline
+// passed first.
+int chan_task_park(const void* key, pthread_mutex_t* mu,
+    const struct timespec* deadline)
+{
+    chan_task_t* task = chan_task_current();
+    task->has_deadline = deadline != NULL;
+    if (deadline)
+    {
+        task->deadline = *deadline;
+    }
+    task->timed_out = 0;
+
+    // The state must say PARKING before a waker can find the task.
+    __atomic_store_n(&task->state, TASK_PARKING, __ATOMIC_RELAXED);
+    chan_sched_bucket_t* bucket = chan_sched_bucket(key);
+    pthread_mutex_lock(&bucket->mu);
+    task->next = NULL;
+    task->prev = bucket->tail;
+    if (bucket->tail)
+    {
+        bucket->tail->next = task;
+    }
+    else
+    {
+        bucket->head = task;
+    }
+    bucket->tail = task;
+    __atomic_store_n(&task->key, key, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&chan_sched_parked, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&bucket->mu);
+
+    pthread_mutex_unlock(mu);
+    swapcontext(&task->ctx, &task->worker->ctx);
+    pthread_mutex_lock(mu);
+    return task->timed_out ? ETIMEDOUT : 0;
+}
+
+// Wakes the oldest task, or every task if all is non-zero, parked on key.
+void chan_task_wake(const void* key, int all)
+{
+    if (__atomic_load_n(&chan_sched_parked, __ATOMIC_SEQ_CST) == 0)
+    {
+        return;
+    }
+
+    chan_sched_bucket_t* bucket = chan_sched_bucket(key);
+    chan_task_t* woken = NULL;
+    pthread_mutex_lock(&bucket->mu);
+    chan_task_t* task = bucket->head;
+    while (task)
+    {
+        chan_task_t* next = task->next;
+        if (task->key == key)
+        {
+            chan_sched_unlink(bucket, task);
+            task->next = woken;
+            woken = task;
+            if (!all)
+            {
+                break;
+            }
+        }
+        task = next;
+    }
+    pthread_mutex_unlock(&bucket->mu);
+
+    // The list is reused to collect the tasks, so read it before resuming
+    // each one.
+    while (woken)
+    {
+        chan_task_t* next = woken->next;
+        chan_task_resume(woken);
+        woken = next;
+    }
+}
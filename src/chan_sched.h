@@ -0,0 +1,56 @@
+#ifndef chan_sched_h
+#define chan_sched_h
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+// Stack size of a task when chan_sched_init is given 0.
+#define CHAN_SCHED_STACK_DEFAULT (64 * 1024)
+
+// A lightweight task started by chan_go.
+typedef struct chan_task_t chan_task_t;
+
+// Starts the task runtime with the given number of worker threads, each
+// running tasks with stacks of stack_size bytes (0 for
+// CHAN_SCHED_STACK_DEFAULT). Stacks are mapped lazily, so a task only uses as
+// much memory as it touches, and have no guard page, so a task must not
+// overflow its stack. Returns 0 on success or -1 with errno set, to
+// EINVAL if the runtime is already running or workers is less than 1.
+int chan_sched_init(int workers, size_t stack_size);
+
+// Waits for every task to finish, then stops the worker threads and releases
+// the runtime so it can be started again. Must not be called from a task.
+// Returns 0 on success or -1 with errno set, to EINVAL if the runtime is not
+// running or EDEADLK if called from a task.
+int chan_sched_shutdown(void);
+
+// Starts a task running fn(arg) on one of the worker threads. Tasks are
+// spread over the workers in turn and stay on the worker they started on.
+// When a task blocks on a channel, its worker runs other tasks until it is
+// woken. A task must not hold a blocking mutex across a channel operation:
+// another task on the same worker waiting for it would block the worker
+// thread, so the holder could never run again to release it. Returns 0 on
+// success or -1 with errno set, to EINVAL if the runtime is not running.
+int chan_go(void (*fn)(void*), void* arg);
+
+// Lets the worker run its other tasks before coming back to the calling task.
+// Outside a task, yields the thread instead.
+void chan_yield(void);
+
+// Returns the task running on the calling thread, or NULL outside a task.
+chan_task_t* chan_task_current(void);
+
+// Suspends the current task until chan_task_wake is called with key, like a
+// condition variable wait: mu is released while suspended and held again on
+// return. If deadline (on the clock channel deadlines use) is not NULL, gives
+// up once it has passed and returns ETIMEDOUT. Returns 0 once woken. Must be
+// called from a task.
+int chan_task_park(const void* key, pthread_mutex_t* mu,
+    const struct timespec* deadline);
+
+// Wakes the oldest task, or every task if all is non-zero, parked on key.
+// Costs a single load when no task is parked anywhere.
+void chan_task_wake(const void* key, int all);
+
+#endif
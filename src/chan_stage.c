@@ -0,0 +1,411 @@
+#define _GNU_SOURCE
+
+#ifdef __APPLE__
+#define _XOPEN_SOURCE
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chan.h"
+#include "chan_stage.h"
+
+// Most values a stage thread moves per receive and send.
+#define CHAN_STAGE_BATCH 64
+
+// What the threads of a stage do.
+#define CHAN_STAGE_FORWARD 0 // Chains and merges: ins[i] through steps to outs[0]
+#define CHAN_STAGE_SPLIT 1   // ins[0] to outs[i]
+#define CHAN_STAGE_TEE 2     // ins[0] to every output
+
+typedef struct chan_stage_thread_t
+{
+    struct chan_stage_t* stage;
+    int                  index;
+    pthread_t            thread;
+} chan_stage_thread_t;
+
+// Threads wait on cond until state leaves 0, so a stage whose threads could
+// not all be created can be torn down before any of them touches a channel.
+// live counts the forwarding threads still running; the last one closes the
+// output.
+struct chan_stage_t
+{
+    int                  kind;
+    chan_t**             ins;
+    int                  in_count;
+    chan_t**             outs;
+    int                  out_count;
+    chan_step_t*         steps;
+    int                  step_count;
+    chan_stage_thread_t* threads;
+    int                  thread_count;
+    int                  live;
+
+    pthread_mutex_t      mu;
+    pthread_cond_t       cond;
+    int                  state;
+};
+
+// Runs a batch of values through the steps of a stage, compacting it in
+// place. Each value goes through every step before the next one is touched.
+// Returns the number of values left.
+static int chan_stage_apply(chan_stage_t* stage, void* batch[], int n)
+{
+    int kept = 0;
+    int i;
+    for (i = 0; i < n; i++)
+    {
+        void* value = batch[i];
+        int keep = 1;
+        int s;
+        for (s = 0; s < stage->step_count && keep; s++)
+        {
+            const chan_step_t* step = &stage->steps[s];
+            if (step->map)
+            {
+                value = step->map(value);
+            }
+            else
+            {
+                keep = step->filter(value);
+            }
+        }
+        if (keep)
+        {
+            batch[kept++] = value;
+        }
+    }
+    return kept;
+}
+
+static void chan_stage_forward(chan_stage_t* stage, int index)
+{
+    chan_t* in = stage->ins[index % stage->in_count];
+    chan_t* out = stage->outs[0];
+    void* batch[CHAN_STAGE_BATCH];
+    int n;
+    while ((n = chan_recv_many(in, batch, CHAN_STAGE_BATCH)) > 0)
+    {
+        // Values for a closed output are dropped, but in is still drained so
+        // upstream does not block.
+        n = chan_stage_apply(stage, batch, n);
+        if (n > 0)
+        {
+            chan_send_many(out, batch, n);
+        }
+    }
+
+    if (__atomic_sub_fetch(&stage->live, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        chan_close(out);
+    }
+}
+
+static void chan_stage_split(chan_stage_t* stage, int index)
+{
+    chan_t* in = stage->ins[0];
+    chan_t* out = stage->outs[index];
+    void* batch[CHAN_STAGE_BATCH];
+    int n;
+    while ((n = chan_recv_many(in, batch, CHAN_STAGE_BATCH)) > 0)
+    {
+        if (chan_send_many(out, batch, n) < n)
+        {
+            // Output closed, leave the values to the other threads.
+            break;
+        }
+    }
+    chan_close(out);
+}
+
+static void chan_stage_tee(chan_stage_t* stage)
+{
+    chan_t* in = stage->ins[0];
+    int open[stage->out_count];
+    int i;
+    for (i = 0; i < stage->out_count; i++)
+    {
+        open[i] = 1;
+    }
+
+    void* batch[CHAN_STAGE_BATCH];
+    int n;
+    while ((n = chan_recv_many(in, batch, CHAN_STAGE_BATCH)) > 0)
+    {
+        for (i = 0; i < stage->out_count; i++)
+        {
+            if (open[i] && chan_send_many(stage->outs[i], batch, n) < n)
+            {
+                open[i] = 0;
+            }
+        }
+    }
+
+    for (i = 0; i < stage->out_count; i++)
+    {
+        chan_close(stage->outs[i]);
+    }
+}
+
+static void* chan_stage_main(void* arg)
+{
+    chan_stage_thread_t* self = (chan_stage_thread_t*) arg;
+    chan_stage_t* stage = self->stage;
+
+    pthread_mutex_lock(&stage->mu);
+    while (stage->state == 0)
+    {
+        pthread_cond_wait(&stage->cond, &stage->mu);
+    }
+    int run = stage->state > 0;
+    pthread_mutex_unlock(&stage->mu);
+    if (!run)
+    {
+        return NULL;
+    }
+
+    if (stage->kind == CHAN_STAGE_FORWARD)
+    {
+        chan_stage_forward(stage, self->index);
+    }
+    else if (stage->kind == CHAN_STAGE_SPLIT)
+    {
+        chan_stage_split(stage, self->index);
+    }
+    else
+    {
+        chan_stage_tee(stage);
+    }
+    return NULL;
+}
+
+// Lets the threads of a stage run, or exit straight away if run is 0.
+static void chan_stage_release(chan_stage_t* stage, int run)
+{
+    pthread_mutex_lock(&stage->mu);
+    stage->state = run ? 1 : -1;
+    pthread_cond_broadcast(&stage->cond);
+    pthread_mutex_unlock(&stage->mu);
+}
+
+static void chan_stage_free(chan_stage_t* stage)
+{
+    free(stage->ins);
+    free(stage->outs);
+    free(stage->steps);
+    free(stage->threads);
+    free(stage);
+}
+
+// Returns non-zero if stages can move values of the channel, which rules out
+// the channels that have their own send and receive functions.
+static int chan_stage_valid(chan_t* chan)
+{
+    return chan && !chan->elem_size && !chan->bytes && !chan->shm;
+}
+
+// Allocates a stage over copies of the given channels and steps and starts
+// its threads. Returns NULL and sets errno if that failed.
+static chan_stage_t* chan_stage_start(int kind, chan_t* ins[], int in_count,
+    chan_t* outs[], int out_count, const chan_step_t steps[], int step_count,
+    int thread_count)
+{
+    int i;
+    for (i = 0; i < in_count; i++)
+    {
+        if (!chan_stage_valid(ins[i]))
+        {
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    for (i = 0; i < out_count; i++)
+    {
+        if (!chan_stage_valid(outs[i]))
+        {
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    chan_stage_t* stage = (chan_stage_t*) calloc(1, sizeof(chan_stage_t));
+    if (!stage)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    stage->kind = kind;
+    stage->in_count = in_count;
+    stage->out_count = out_count;
+    stage->step_count = step_count;
+    stage->thread_count = thread_count;
+    stage->live = thread_count;
+    stage->ins = (chan_t**) malloc(in_count * sizeof(chan_t*));
+    stage->outs = (chan_t**) malloc(out_count * sizeof(chan_t*));
+    stage->steps = step_count ?
+        (chan_step_t*) malloc(step_count * sizeof(chan_step_t)) : NULL;
+    stage->threads = (chan_stage_thread_t*) malloc(
+        thread_count * sizeof(chan_stage_thread_t));
+    if (!stage->ins || !stage->outs || (step_count && !stage->steps) ||
+        !stage->threads)
+    {
+        chan_stage_free(stage);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(stage->ins, ins, in_count * sizeof(chan_t*));
+    memcpy(stage->outs, outs, out_count * sizeof(chan_t*));
+    if (step_count)
+    {
+        memcpy(stage->steps, steps, step_count * sizeof(chan_step_t));
+    }
+
+    if (pthread_mutex_init(&stage->mu, NULL) != 0)
+    {
+        chan_stage_free(stage);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (pthread_cond_init(&stage->cond, NULL) != 0)
+    {
+        pthread_mutex_destroy(&stage->mu);
+        chan_stage_free(stage);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (i = 0; i < thread_count; i++)
+    {
+        stage->threads[i].stage = stage;
+        stage->threads[i].index = i;
+        int rc = pthread_create(&stage->threads[i].thread, NULL,
+            chan_stage_main, &stage->threads[i]);
+        if (rc != 0)
+        {
+            // None of the threads started has touched a channel yet.
+            chan_stage_release(stage, 0);
+            int j;
+            for (j = 0; j < i; j++)
+            {
+                pthread_join(stage->threads[j].thread, NULL);
+            }
+            pthread_cond_destroy(&stage->cond);
+            pthread_mutex_destroy(&stage->mu);
+            chan_stage_free(stage);
+            errno = rc;
+            return NULL;
+        }
+    }
+    chan_stage_release(stage, 1);
+    return stage;
+}
+
+// Starts a stage of workers threads, each receiving values from in, passing
+// them through fn and sending the results to out. Values move in batches, so
+// a busy stage locks each channel once per batch rather than once per value.
+// With a single worker, values keep their order. Once in is closed and
+// drained, the last worker closes out. If out is closed early, the stage keeps
+// draining in and drops what it cannot send. Returns NULL and sets errno if
+// the stage could not be started.
+chan_stage_t* chan_map(chan_t* in, chan_t* out, void* (*fn)(void*),
+    int workers)
+{
+    chan_step_t step = { fn, NULL };
+    return chan_chain(in, out, &step, 1, workers);
+}
+
+// Starts a stage like chan_map that sends on only the values pred returns
+// non-zero for.
+chan_stage_t* chan_filter(chan_t* in, chan_t* out, int (*pred)(void*),
+    int workers)
+{
+    chan_step_t step = { NULL, pred };
+    return chan_chain(in, out, &step, 1, workers);
+}
+
+// Starts a stage like chan_map that passes each value through count steps in
+// turn. This fuses what would otherwise be a stage per step into one, saving
+// a channel hop and a thread handoff per value between steps. Returns NULL
+// and sets errno to EINVAL if a step does not set exactly one function.
+chan_stage_t* chan_chain(chan_t* in, chan_t* out, const chan_step_t steps[],
+    int count, int workers)
+{
+    if (count < 0 || (count > 0 && !steps) || workers < 1)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        if (!steps[i].map == !steps[i].filter)
+        {
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    return chan_stage_start(CHAN_STAGE_FORWARD, &in, 1, &out, 1, steps, count,
+        workers);
+}
+
+// Starts a stage forwarding every value received from the count channels in
+// ins to out, with a thread per input. Once every input is closed and
+// drained, out is closed.
+chan_stage_t* chan_merge(chan_t* ins[], int count, chan_t* out)
+{
+    if (!ins || count < 1)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    return chan_stage_start(CHAN_STAGE_FORWARD, ins, count, &out, 1, NULL, 0,
+        count);
+}
+
+// Starts a stage handing each value received from in to one of the count
+// channels in outs, with a thread per output taking values as fast as its
+// output accepts them, so a slow consumer gets a smaller share. Each output is
+// closed once in is closed and drained. A thread whose output is closed early
+// stops taking values and drops the batch it holds.
+chan_stage_t* chan_split(chan_t* in, chan_t* outs[], int count)
+{
+    if (!outs || count < 1)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    return chan_stage_start(CHAN_STAGE_SPLIT, &in, 1, outs, count, NULL, 0,
+        count);
+}
+
+// Starts a stage sending every value received from in to each of the count
+// channels in outs, in order, so the slowest output sets the pace. Outputs
+// closed early are skipped. Every output is closed once in is closed and
+// drained.
+chan_stage_t* chan_tee(chan_t* in, chan_t* outs[], int count)
+{
+    if (!outs || count < 1)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    return chan_stage_start(CHAN_STAGE_TEE, &in, 1, outs, count, NULL, 0, 1);
+}
+
+// Waits for the stage to finish, which it does once its inputs are closed
+// and drained, and releases it. The channels are not disposed.
+void chan_stage_dispose(chan_stage_t* stage)
+{
+    int i;
+    for (i = 0; i < stage->thread_count; i++)
+    {
+        pthread_join(stage->threads[i].thread, NULL);
+    }
+    pthread_cond_destroy(&stage->cond);
+    pthread_mutex_destroy(&stage->mu);
+    chan_stage_free(stage);
+}
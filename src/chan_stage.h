@@ -0,0 +1,63 @@
+#ifndef chan_stage_h
+#define chan_stage_h
+
+struct chan_t;
+
+// One stateless step of a chain, see chan_chain. Exactly one of map and
+// filter is set: map replaces each value with what it returns, and filter
+// keeps only the values it returns non-zero for.
+typedef struct chan_step_t
+{
+    void* (*map)(void*);
+    int   (*filter)(void*);
+} chan_step_t;
+
+// A running pipeline stage: threads moving values between channels, see
+// chan_map.
+typedef struct chan_stage_t chan_stage_t;
+
+// Starts a stage of workers threads, each receiving values from in, passing
+// them through fn and sending the results to out. Values move in batches, so
+// a busy stage locks each channel once per batch rather than once per value.
+// With a single worker, values keep their order. Once in is closed and
+// drained, the last worker closes out. If out is closed early, the stage keeps
+// draining in and drops what it cannot send. Returns NULL and sets errno if
+// the stage could not be started.
+chan_stage_t* chan_map(struct chan_t* in, struct chan_t* out,
+    void* (*fn)(void*), int workers);
+
+// Starts a stage like chan_map that sends on only the values pred returns
+// non-zero for.
+chan_stage_t* chan_filter(struct chan_t* in, struct chan_t* out,
+    int (*pred)(void*), int workers);
+
+// Starts a stage like chan_map that passes each value through count steps in
+// turn. This fuses what would otherwise be a stage per step into one, saving
+// a channel hop and a thread handoff per value between steps. Returns NULL
+// and sets errno to EINVAL if a step does not set exactly one function.
+chan_stage_t* chan_chain(struct chan_t* in, struct chan_t* out,
+    const chan_step_t steps[], int count, int workers);
+
+// Starts a stage forwarding every value received from the count channels in
+// ins to out, with a thread per input. Once every input is closed and
+// drained, out is closed.
+chan_stage_t* chan_merge(struct chan_t* ins[], int count, struct chan_t* out);
+
+// Starts a stage handing each value received from in to one of the count
+// channels in outs, with a thread per output taking values as fast as its
+// output accepts them, so a slow consumer gets a smaller share. Each output is
+// closed once in is closed and drained. A thread whose output is closed early
+// stops taking values and drops the batch it holds.
+chan_stage_t* chan_split(struct chan_t* in, struct chan_t* outs[], int count);
+
+// Starts a stage sending every value received from in to each of the count
+// channels in outs, in order, so the slowest output sets the pace. Outputs
+// closed early are skipped. Every output is closed once in is closed and
+// drained.
+chan_stage_t* chan_tee(struct chan_t* in, struct chan_t* outs[], int count);
+
+// Waits for the stage to finish, which it does once its inputs are closed
+// and drained, and releases it. The channels are not disposed.
+void chan_stage_dispose(chan_stage_t* stage);
+
+#endif
@@ -1,10 +1,15 @@
 #undef __STRICT_ANSI__
 
+#include <errno.h>
+#include <stddef.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/wait.h>
 
 #include "chan.h"
 
@@ -342,11 +347,431 @@ void test_chan_select_send()
     pass();
 }
 
+void* delayed_sender(void* chan)
+{
+    usleep(10000);
+    chan_send(chan, "foo");
+    return NULL;
+}
+
+void* delayed_receiver(void* chan)
+{
+    usleep(10000);
+    void* msg;
+    chan_recv(chan, &msg);
+    return msg;
+}
+
+void test_chan_select_wait()
+{
+    chan_t* chan1 = chan_init(0);
+    chan_t* chan2 = chan_init(1);
+    chan_t* chan3 = chan_init_flags(1, CHAN_MPMC);
+    chan_t* chans[3] = {chan1, chan2, chan3};
+    void* recv = NULL;
+    pthread_t th;
+
+    // Each kind of channel wakes a blocked select when a sender arrives.
+    for (int i = 0; i < 3; ++i)
+    {
+        pthread_create(&th, NULL, delayed_sender, chans[i]);
+        int selected = chan_select_wait(chans, 3, &recv, NULL, 0, NULL);
+        assert_true(selected == i, chans[i], "Received on wrong channel");
+        assert_true(strcmp(recv, "foo") == 0, chans[i],
+            "Messages are not equal");
+        pthread_join(th, NULL);
+    }
+
+    // A blocked send proceeds once a receiver arrives.
+    void* msg[] = {"bar"};
+    pthread_create(&th, NULL, delayed_receiver, chan1);
+    assert_true(chan_select_wait(NULL, 0, NULL, &chan1, 1, msg) == 0, chan1,
+        "Sent on no channels");
+    pthread_join(th, &recv);
+    assert_true(strcmp(recv, "bar") == 0, chan1, "Messages are not equal");
+
+    // Closed channels that can never proceed end the select.
+    chan_close(chan1);
+    chan_close(chan2);
+    chan_close(chan3);
+    assert_true(chan_select_wait(chans, 3, &recv, NULL, 0, NULL) == -1, chan1,
+        "Received on closed channels");
+
+    chan_dispose(chan1);
+    chan_dispose(chan2);
+    chan_dispose(chan3);
+    pass();
+}
+
+void* select_sender(void* chan)
+{
+    chan_t* chans[] = { chan };
+    void* msg[] = { "baz" };
+    struct timespec timeout = { 2, 0 };
+    return (void*) (intptr_t) chan_select_timeout(NULL, 0, NULL, chans, 1, msg,
+        &timeout);
+}
+
+void* select_receiver(void* arg)
+{
+    chan_t** chans = (chan_t**) arg;
+    void* msg = NULL;
+    struct timespec timeout = { 2, 0 };
+    int selected = chan_select_timeout(chans, 2, &msg, NULL, 0, NULL,
+        &timeout);
+    return selected >= 0 && strcmp(msg, "baz") == 0 ? chans[selected] : NULL;
+}
+
+void test_chan_select_pair()
+{
+    chan_t* chan1 = chan_init(0);
+    chan_t* chan2 = chan_init(0);
+    chan_t* chans[2] = {chan1, chan2};
+    struct timespec timeout = { 2, 0 };
+    void* msg[] = {"baz"};
+    void* recv = NULL;
+    pthread_t th;
+
+    // A select blocked receiving on an unbuffered channel completes a select
+    // that sends on it.
+    pthread_create(&th, NULL, select_receiver, chans);
+    wait_for_reader(chan1);
+    assert_true(chan_select_timeout(NULL, 0, NULL, &chan1, 1, msg,
+        &timeout) == 0, chan1, "Selects did not pair");
+    pthread_join(th, &recv);
+    assert_true(recv == chan1, chan1, "Received on wrong channel");
+
+    // And the other way around.
+    pthread_create(&th, NULL, select_sender, chan1);
+    wait_for_writer(chan1);
+    assert_true(chan_select_timeout(chans, 2, &recv, NULL, 0, NULL,
+        &timeout) == 0, chan1, "Selects did not pair");
+    assert_true(strcmp(recv, "baz") == 0, chan1, "Messages are not equal");
+    pthread_join(th, &recv);
+    assert_true((intptr_t) recv == 0, chan1, "Send not selected");
+
+    // Only the first case to pair completes the select. Its other case is
+    // left for no one.
+    pthread_create(&th, NULL, select_receiver, chans);
+    wait_for_reader(chan1);
+    wait_for_reader(chan2);
+    assert_true(chan_try_send(chan2, "baz") == 0, chan2, "Send failed");
+    assert_true(chan_try_send(chan1, "baz") == -1 && errno == EAGAIN, chan1,
+        "Selected twice");
+    pthread_join(th, &recv);
+    assert_true(recv == chan2, chan2, "Received on wrong channel");
+    assert_true(chan1->r_waiting == 0 && chan2->r_waiting == 0, chan1,
+        "Select left waiters behind");
+
+    chan_dispose(chan1);
+    chan_dispose(chan2);
+    pass();
+}
+
 void test_chan_select()
 {
     test_chan_select_recv();
     test_chan_select_send();
+    test_chan_select_wait();
+    test_chan_select_pair();
+}
+
+void test_chan_timeout()
+{
+    chan_t* buffered = chan_init(1);
+    chan_t* unbuffered = chan_init(0);
+    chan_t* ring = chan_init_flags(1, CHAN_MPMC);
+    chan_t* chans[3] = {buffered, unbuffered, ring};
+    struct timespec timeout = {0, 5000000};
+    void* msg;
+
+    for (int i = 0; i < 3; ++i)
+    {
+        errno = 0;
+        assert_true(chan_recv_timeout(chans[i], &msg, &timeout) == -1,
+            chans[i], "Recv on empty channel succeeded");
+        assert_true(errno == ETIMEDOUT, chans[i], "Recv did not time out");
+    }
+
+    errno = 0;
+    assert_true(chan_select_timeout(chans, 3, &msg, NULL, 0, NULL,
+        &timeout) == -1, buffered, "Select on empty channels succeeded");
+    assert_true(errno == ETIMEDOUT, buffered, "Select did not time out");
+
+    // A send without a receiver is withdrawn when it times out.
+    errno = 0;
+    assert_true(chan_send_timeout(unbuffered, "foo", &timeout) == -1,
+        unbuffered, "Send without receiver succeeded");
+    assert_true(errno == ETIMEDOUT, unbuffered, "Send did not time out");
+    assert_true(!unbuffered->w_waiting, unbuffered, "Chan has sender");
+
+    assert_true(chan_send_timeout(buffered, "foo", &timeout) == 0, buffered,
+        "Send failed");
+    errno = 0;
+    assert_true(chan_send_timeout(buffered, "foo", &timeout) == -1, buffered,
+        "Send on full channel succeeded");
+    assert_true(errno == ETIMEDOUT, buffered, "Send did not time out");
+
+    // Values arriving before the deadline are received.
+    struct timespec longer = {5, 0};
+    pthread_t th;
+    pthread_create(&th, NULL, delayed_sender, unbuffered);
+    assert_true(chan_recv_timeout(unbuffered, &msg, &longer) == 0, unbuffered,
+        "Recv failed");
+    assert_true(strcmp(msg, "foo") == 0, unbuffered, "Messages are not equal");
+    pthread_join(th, NULL);
+
+    chan_dispose(buffered);
+    chan_dispose(unbuffered);
+    chan_dispose(ring);
+    pass();
+}
+
+void* batch_sender(void* chan)
+{
+    void* batch[100];
+    for (uintptr_t i = 0; i < 100; ++i)
+    {
+        batch[i] = (void*) (i + 1);
+    }
+    chan_send_many(chan, batch, 100);
+    chan_close(chan);
+    return NULL;
+}
+
+void test_chan_batch()
+{
+    chan_t* chans[2] = {chan_init(7), chan_init_flags(7, CHAN_MPMC)};
+    for (int c = 0; c < 2; ++c)
+    {
+        chan_t* chan = chans[c];
+        void* batch[10];
+        void* msg[] = {"foo", "bar", "baz"};
+
+        // Offset the ring so that batches wrap around the end of it.
+        chan_send(chan, "x");
+        chan_recv(chan, batch);
+        assert_true(chan_send_many(chan, msg, 3) == 3, chan, "Send failed");
+        assert_true(chan_size(chan) == 3, chan, "Wrong size");
+        assert_true(chan_drain(chan, batch, 10) == 3, chan, "Drain failed");
+        assert_true(batch[0] == msg[0] && batch[2] == msg[2], chan,
+            "Messages are not equal");
+        assert_true(chan_drain(chan, batch, 10) == 0, chan, "Drain not empty");
+
+        pthread_t th;
+        pthread_create(&th, NULL, batch_sender, chan);
+        uintptr_t expected = 1;
+        int received;
+        while ((received = chan_recv_many(chan, batch, 10)) > 0)
+        {
+            for (int i = 0; i < received; ++i)
+            {
+                assert_true((uintptr_t) batch[i] == expected++, chan,
+                    "Messages out of order");
+            }
+        }
+        assert_true(expected == 101, chan, "Messages lost");
+        assert_true(chan_drain(chan, batch, 10) == -1, chan,
+            "Drain on closed channel succeeded");
+
+        pthread_join(th, NULL);
+        chan_dispose(chan);
+    }
+    pass();
+}
+
+void* spin_sender(void* chan)
+{
+    for (uintptr_t i = 1; i <= 10000; ++i)
+    {
+        chan_send(chan, (void*) i);
+    }
+    chan_close(chan);
+    return NULL;
+}
+
+void test_chan_spin()
+{
+    chan_t* chans[2] = {chan_init(4), chan_init_flags(4, CHAN_MPMC)};
+    for (int c = 0; c < 2; ++c)
+    {
+        chan_t* chan = chans[c];
+        errno = 0;
+        assert_true(chan_set_spin(chan, -1) == -1 && errno == EINVAL, chan,
+            "Negative spin limit accepted");
+        assert_true(chan->spin == CHAN_SPIN_DEFAULT, chan, "Wrong spin budget");
+
+        // Waits that spinning never satisfies shrink the budget.
+        struct timespec timeout = {0, 1000000};
+        void* msg;
+        for (int i = 0; i < 4; ++i)
+        {
+            chan_recv_timeout(chan, &msg, &timeout);
+        }
+        assert_true(chan->spin < CHAN_SPIN_DEFAULT, chan,
+            "Spin budget did not back off");
+
+        pthread_t th;
+        pthread_create(&th, NULL, spin_sender, chan);
+        uintptr_t expected = 1;
+        while (chan_recv(chan, &msg) == 0)
+        {
+            assert_true((uintptr_t) msg == expected++, chan,
+                "Messages out of order");
+        }
+        assert_true(expected == 10001, chan, "Messages lost");
+        assert_true(chan->spin >= 16 && chan->spin <= CHAN_SPIN_DEFAULT, chan,
+            "Spin budget out of bounds");
+        pthread_join(th, NULL);
+        chan_dispose(chan);
+    }
+
+    // Spinning can be turned off.
+    chan_t* chan = chan_init(1);
+    assert_true(chan_set_spin(chan, 0) == 0, chan, "Set spin failed");
+    pthread_t th;
+    pthread_create(&th, NULL, spin_sender, chan);
+    void* msg;
+    int received = 0;
+    while (chan_recv(chan, &msg) == 0)
+    {
+        received++;
+    }
+    assert_true(received == 10000, chan, "Messages lost");
+    assert_true(chan->spin == 0, chan, "Spin budget changed");
+    pthread_join(th, NULL);
+    chan_dispose(chan);
+    pass();
+}
+
+uint64_t latency_count(chan_stats_t* stats)
+{
+    uint64_t count = 0;
+    for (int i = 0; i < CHAN_STATS_BUCKETS; ++i)
+    {
+        count += stats->latency[i];
+    }
+    return count;
+}
+
+void test_chan_stats()
+{
+    chan_t* buffered = chan_init(4);
+    chan_t* unbuffered = chan_init(0);
+    chan_t* ring = chan_init_flags(4, CHAN_MPMC);
+    chan_stats_t stats;
+    void* msg;
+
+    errno = 0;
+    assert_true(chan_stats(buffered, &stats) == -1 && errno == EINVAL,
+        buffered, "Stats read before being enabled");
+
+    // Values queued before stats are enabled are not counted.
+    chan_send(buffered, "foo");
+    assert_true(chan_stats_enable(buffered) == 0, buffered,
+        "Enable stats failed");
+    for (int i = 0; i < 3; ++i)
+    {
+        chan_send(buffered, "foo");
+    }
+    for (int i = 0; i < 4; ++i)
+    {
+        chan_recv(buffered, &msg);
+    }
+
+    pthread_t th;
+    pthread_create(&th, NULL, delayed_sender, buffered);
+    chan_recv(buffered, &msg);
+    pthread_join(th, NULL);
+
+    chan_stats(buffered, &stats);
+    assert_true(stats.sends == 4, buffered, "Wrong number of sends");
+    assert_true(stats.recvs == 5, buffered, "Wrong number of recvs");
+    assert_true(stats.high_water == 4, buffered, "Wrong high-water mark");
+    assert_true(latency_count(&stats) == 4, buffered,
+        "Wrong number of latency samples");
+    assert_true(stats.recv_blocks >= 1 && stats.send_blocks == 0, buffered,
+        "Wrong number of blocks");
+    assert_true(stats.recv_blocked_ns >= stats.recv_blocked_max_ns &&
+        stats.recv_blocked_max_ns > 0, buffered, "Wrong blocked time");
+
+    chan_stats_enable(unbuffered);
+    pthread_create(&th, NULL, delayed_sender, unbuffered);
+    chan_recv(unbuffered, &msg);
+    pthread_join(th, NULL);
+    chan_stats(unbuffered, &stats);
+    assert_true(stats.sends == 1 && stats.recvs == 1, unbuffered,
+        "Wrong number of sends or recvs");
+    assert_true(latency_count(&stats) == 1, unbuffered,
+        "Wrong number of latency samples");
+
+    chan_stats_enable(ring);
+    chan_send(ring, "foo");
+    chan_send(ring, "bar");
+    chan_recv(ring, &msg);
+    chan_stats(ring, &stats);
+    assert_true(stats.sends == 2 && stats.recvs == 1, ring,
+        "Wrong number of sends or recvs");
+    assert_true(stats.high_water == 2, ring, "Wrong high-water mark");
+
+    chan_dispose(buffered);
+    chan_dispose(unbuffered);
+    chan_dispose(ring);
+    pass();
+}
+
+#ifdef __linux__
+int fd_readable(int fd, int timeout_ms)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    return poll(&pfd, 1, timeout_ms) == 1 && (pfd.revents & POLLIN);
+}
+
+void test_chan_fd()
+{
+    chan_t* chans[3] = {chan_init(4), chan_init_flags(4, CHAN_MPMC),
+        chan_init_unbounded()};
+    void* batch[4];
+    for (int c = 0; c < 3; ++c)
+    {
+        chan_t* chan = chans[c];
+        chan_send(chan, "foo");
+        int fd = chan_fd(chan);
+        assert_true(fd >= 0, chan, "No descriptor");
+        assert_true(chan_fd(chan) == fd, chan, "Descriptor changed");
+        assert_true(fd_readable(fd, 0), chan, "Descriptor not readable");
+
+        chan_send(chan, "bar");
+        void* msg;
+        chan_recv(chan, &msg);
+        assert_true(fd_readable(fd, 0), chan, "Descriptor not readable");
+        chan_recv(chan, &msg);
+        assert_true(!fd_readable(fd, 0), chan, "Descriptor readable when empty");
+
+        chan_send(chan, "foo");
+        assert_true(fd_readable(fd, 0), chan, "Descriptor not readable");
+        assert_true(chan_drain(chan, batch, 4) == 1, chan, "Drain failed");
+        assert_true(!fd_readable(fd, 0), chan, "Descriptor readable when empty");
+
+        chan_close(chan);
+        assert_true(fd_readable(fd, 0), chan, "Closed descriptor not readable");
+        chan_dispose(chan);
+    }
+
+    // An unbuffered channel is readable while a sender is waiting.
+    chan_t* chan = chan_init(0);
+    int fd = chan_fd(chan);
+    assert_true(!fd_readable(fd, 0), chan, "Descriptor readable when empty");
+    pthread_t th;
+    pthread_create(&th, NULL, delayed_sender, chan);
+    assert_true(fd_readable(fd, 5000), chan, "Descriptor not readable");
+    assert_true(chan_drain(chan, batch, 4) == 1, chan, "Drain failed");
+    assert_true(!fd_readable(fd, 0), chan, "Descriptor readable when empty");
+    pthread_join(th, NULL);
+    chan_dispose(chan);
+    pass();
 }
+#endif
 
 void test_chan_int()
 {
@@ -396,6 +821,55 @@ void test_chan_buf()
     pass();
 }
 
+void* sized_sender(void* chan)
+{
+    for (int64_t i = 1; i <= 1000; ++i)
+    {
+        chan_send_int64(chan, i);
+    }
+    chan_close(chan);
+    return NULL;
+}
+
+void test_chan_sized()
+{
+    chan_t* chans[2] = {chan_init_sized(3, sizeof(int64_t)),
+        chan_init_sized(0, sizeof(int64_t))};
+    for (int c = 0; c < 2; ++c)
+    {
+        chan_t* chan = chans[c];
+        assert_true(chan->elem_size == sizeof(int64_t), chan,
+            "Wrong element size");
+        assert_true(chan_send_int32(chan, 1) == -1 && errno == EINVAL, chan,
+            "Sent element of wrong size");
+        assert_true(chan_send(chan, "foo") == -1 && errno == EINVAL, chan,
+            "Sent pointer on sized channel");
+
+        pthread_t th;
+        pthread_create(&th, NULL, sized_sender, chan);
+        int64_t expected = 1, r64;
+        while (chan_recv_int64(chan, &r64) == 0)
+        {
+            assert_true(r64 == expected++, chan, "Messages out of order");
+        }
+        assert_true(expected == 1001, chan, "Messages lost");
+
+        pthread_join(th, NULL);
+        chan_dispose(chan);
+    }
+
+    chan_t* chan = chan_init_sized(2, 256);
+    char s[256], r[256];
+    strcpy(s, "hello world");
+    assert_true(chan_send_buf(chan, s, sizeof(s)) == 0, chan, "Send failed");
+    strcpy(s, "Hello World");
+    assert_true(chan_recv_buf(chan, r, sizeof(r)) == 0, chan, "Recv failed");
+    assert_true(strcmp(r, "hello world") == 0, chan, "Wrong value of buf");
+
+    chan_dispose(chan);
+    pass();
+}
+
 void test_chan_multi()
 {
     chan_t* chan = chan_init(5);
@@ -428,6 +902,9 @@ void test_chan_multi()
     pass();
 }
 
+#ifndef CHAN_FUTEX
+// Drives the channel condition variables directly, so it only applies when
+// the library parks on them.
 void test_chan_multi2()
 {
     chan_t* chan = chan_init(5);
@@ -478,6 +955,1471 @@ void test_chan_multi2()
     chan_dispose(chan);
     pass();
 }
+#endif
+
+typedef struct fifo_arg_t
+{
+    chan_t*  chan;
+    intptr_t value;
+    int      rc;
+    int      err;
+} fifo_arg_t;
+
+void* fifo_sender(void* arg)
+{
+    fifo_arg_t* fifo = arg;
+    fifo->rc = chan_send(fifo->chan, (void*) fifo->value);
+    fifo->err = errno;
+    return NULL;
+}
+
+void* fifo_receiver(void* arg)
+{
+    fifo_arg_t* fifo = arg;
+    void* msg = NULL;
+    fifo->rc = chan_recv(fifo->chan, &msg);
+    fifo->err = errno;
+    fifo->value = (intptr_t) msg;
+    return NULL;
+}
+
+void wait_for_waiting(chan_t* chan, int* waiting, int count)
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&chan->m_mu);
+        int done = *waiting == count;
+        pthread_mutex_unlock(&chan->m_mu);
+        if (done) break;
+        sched_yield();
+    }
+}
+
+void test_chan_fifo()
+{
+    chan_t* chan = chan_init(0);
+    pthread_t th[4];
+    fifo_arg_t args[4];
+
+    // Senders that blocked first are received from first.
+    for (int i = 0; i < 4; ++i)
+    {
+        args[i].chan = chan;
+        args[i].value = i + 1;
+        pthread_create(&th[i], NULL, fifo_sender, &args[i]);
+        wait_for_waiting(chan, &chan->w_waiting, i + 1);
+    }
+    for (int i = 0; i < 4; ++i)
+    {
+        void* msg;
+        assert_true(chan_recv(chan, &msg) == 0, chan, "Recv failed");
+        assert_true((intptr_t) msg == i + 1, chan, "Senders not served FIFO");
+    }
+    for (int i = 0; i < 4; ++i)
+    {
+        pthread_join(th[i], NULL);
+        assert_true(args[i].rc == 0, chan, "Send failed");
+    }
+    assert_true(chan->w_head == NULL && chan->w_waiting == 0, chan,
+        "Sender queue not empty");
+
+    // Receivers too, and each value goes straight to the one receiver.
+    for (int i = 0; i < 4; ++i)
+    {
+        args[i].chan = chan;
+        args[i].value = 0;
+        pthread_create(&th[i], NULL, fifo_receiver, &args[i]);
+        wait_for_waiting(chan, &chan->r_waiting, i + 1);
+    }
+    for (int i = 0; i < 4; ++i)
+    {
+        assert_true(chan_send(chan, (void*) (intptr_t) (i + 1)) == 0, chan,
+            "Send failed");
+    }
+    for (int i = 0; i < 4; ++i)
+    {
+        pthread_join(th[i], NULL);
+        assert_true(args[i].rc == 0 && args[i].value == i + 1, chan,
+            "Receivers not served FIFO");
+    }
+
+    // A timed out sender leaves the queue without disturbing the others.
+    args[0].chan = chan;
+    args[0].value = 1;
+    pthread_create(&th[0], NULL, fifo_sender, &args[0]);
+    wait_for_waiting(chan, &chan->w_waiting, 1);
+    struct timespec timeout = { 0, 1000000 };
+    assert_true(chan_send_timeout(chan, (void*) 2, &timeout) == -1 &&
+        errno == ETIMEDOUT, chan, "Send did not time out");
+    void* msg;
+    assert_true(chan_recv(chan, &msg) == 0 && (intptr_t) msg == 1, chan,
+        "Wrong value after timeout");
+    pthread_join(th[0], NULL);
+    assert_true(chan->w_head == NULL && chan->w_tail == NULL, chan,
+        "Timed out sender still queued");
+
+    // Closing wakes every blocked sender with EPIPE.
+    for (int i = 0; i < 4; ++i)
+    {
+        args[i].chan = chan;
+        args[i].value = i + 1;
+        pthread_create(&th[i], NULL, fifo_sender, &args[i]);
+    }
+    wait_for_waiting(chan, &chan->w_waiting, 4);
+    chan_close(chan);
+    for (int i = 0; i < 4; ++i)
+    {
+        pthread_join(th[i], NULL);
+        assert_true(args[i].rc == -1 && args[i].err == EPIPE, chan,
+            "Blocked sender not failed by close");
+    }
+    assert_true(chan->w_head == NULL && chan->w_waiting == 0, chan,
+        "Sender queue not empty after close");
+
+    chan_dispose(chan);
+    pass();
+}
+
+intptr_t overflow_drops[16];
+int overflow_drop_count = 0;
+
+void overflow_drop(void* value)
+{
+    overflow_drops[overflow_drop_count++] = (intptr_t) value;
+}
+
+void test_chan_overflow()
+{
+    chan_t* chan = chan_init(2);
+    void* msg;
+    intptr_t i;
+
+    errno = 0;
+    assert_true(chan_set_overflow(chan, 7, NULL) == -1 && errno == EINVAL,
+        chan, "Unknown policy accepted");
+
+    // Fail fast refuses the send and leaves the buffer alone.
+    assert_true(chan_set_overflow(chan, CHAN_OVERFLOW_FAIL, overflow_drop) == 0,
+        chan, "Policy not set");
+    chan_send(chan, (void*) 1);
+    chan_send(chan, (void*) 2);
+    errno = 0;
+    assert_true(chan_send(chan, (void*) 3) == -1 && errno == EAGAIN, chan,
+        "Send on full channel did not fail");
+    void* batch[] = { (void*) 4, (void*) 5 };
+    errno = 0;
+    assert_true(chan_send_many(chan, batch, 2) == -1 && errno == EAGAIN, chan,
+        "Batch send on full channel did not fail");
+    assert_true(chan_dropped(chan) == 2 && overflow_drop_count == 0, chan,
+        "Refused sends miscounted");
+    chan_recv(chan, &msg);
+    assert_true(chan_send_many(chan, batch, 2) == 1, chan,
+        "Batch send did not fill the channel");
+    chan_recv(chan, &msg);
+    assert_true((intptr_t) msg == 2, chan, "Wrong value after refused send");
+    chan_recv(chan, &msg);
+    assert_true((intptr_t) msg == 4, chan, "Wrong value after batch send");
+
+    // Drop newest discards what does not fit.
+    chan_set_overflow(chan, CHAN_OVERFLOW_DROP_NEWEST, overflow_drop);
+    for (i = 1; i <= 4; i++)
+    {
+        assert_true(chan_send(chan, (void*) i) == 0, chan, "Send failed");
+    }
+    assert_true(chan_dropped(chan) == 5 && overflow_drop_count == 2 &&
+        overflow_drops[0] == 3 && overflow_drops[1] == 4, chan,
+        "Newest values not dropped");
+    chan_recv(chan, &msg);
+    assert_true((intptr_t) msg == 1, chan, "Wrong value after dropping");
+    chan_recv(chan, &msg);
+
+    // Drop oldest keeps the latest values, like an overwriting ring.
+    overflow_drop_count = 0;
+    chan_set_overflow(chan, CHAN_OVERFLOW_DROP_OLDEST, overflow_drop);
+    for (i = 1; i <= 5; i++)
+    {
+        assert_true(chan_send(chan, (void*) i) == 0, chan, "Send failed");
+    }
+    assert_true(overflow_drop_count == 3 && overflow_drops[0] == 1 &&
+        overflow_drops[2] == 3, chan, "Oldest values not evicted");
+    chan_recv(chan, &msg);
+    assert_true((intptr_t) msg == 4, chan, "Wrong value after evicting");
+    chan_recv(chan, &msg);
+    assert_true((intptr_t) msg == 5, chan, "Wrong value after evicting");
+    chan_dispose(chan);
+
+    // Lock-free rings apply the policies too, but SPSC senders cannot evict.
+    chan = chan_init_flags(4, CHAN_MPMC);
+    overflow_drop_count = 0;
+    assert_true(chan_set_overflow(chan, CHAN_OVERFLOW_DROP_OLDEST,
+        overflow_drop) == 0, chan, "Policy not set on MPMC channel");
+    for (i = 1; i <= 6; i++)
+    {
+        assert_true(chan_send(chan, (void*) i) == 0, chan, "Send failed");
+    }
+    assert_true(chan_dropped(chan) == 2 && overflow_drop_count == 2 &&
+        overflow_drops[0] == 1, chan, "Ring did not evict oldest");
+    for (i = 3; i <= 6; i++)
+    {
+        chan_recv(chan, &msg);
+        assert_true((intptr_t) msg == i, chan, "Wrong value in ring");
+    }
+    chan_dispose(chan);
+
+    chan = chan_init_spsc(4);
+    errno = 0;
+    assert_true(chan_set_overflow(chan, CHAN_OVERFLOW_DROP_OLDEST, NULL) == -1 &&
+        errno == EINVAL, chan, "SPSC channel accepted eviction");
+    assert_true(chan_set_overflow(chan, CHAN_OVERFLOW_FAIL, NULL) == 0, chan,
+        "Policy not set on SPSC channel");
+    for (i = 0; i < 4; i++)
+    {
+        chan_send(chan, (void*) i);
+    }
+    errno = 0;
+    assert_true(chan_send(chan, (void*) 4) == -1 && errno == EAGAIN, chan,
+        "Send on full ring did not fail");
+    chan_dispose(chan);
+
+    chan = chan_init(0);
+    errno = 0;
+    assert_true(chan_set_overflow(chan, CHAN_OVERFLOW_DROP_NEWEST, NULL) == -1 &&
+        errno == EINVAL, chan, "Unbuffered channel accepted a policy");
+    assert_true(chan_set_overflow(chan, CHAN_OVERFLOW_BLOCK, NULL) == 0, chan,
+        "Blocking policy refused");
+    chan_dispose(chan);
+
+    // Priority channels evict from the level being sent to.
+    chan = chan_init_priority(2, 2);
+    chan_set_overflow(chan, CHAN_OVERFLOW_DROP_OLDEST, NULL);
+    chan_send_prio(chan, (void*) 1, 0);
+    chan_send_prio(chan, (void*) 2, 0);
+    chan_send_prio(chan, (void*) 10, 1);
+    chan_send_prio(chan, (void*) 3, 0);
+    intptr_t expected[] = { 10, 2, 3 };
+    for (i = 0; i < 3; i++)
+    {
+        chan_recv(chan, &msg);
+        assert_true((intptr_t) msg == expected[i], chan,
+            "Wrong priority value after evicting");
+    }
+    chan_dispose(chan);
+    pass();
+}
+
+void test_chan_try()
+{
+    chan_t* chans[] = { chan_init(1), chan_init_flags(1, CHAN_MPMC),
+        chan_init_spsc(1) };
+    void* msg;
+    int i;
+    for (i = 0; i < 3; i++)
+    {
+        chan_t* chan = chans[i];
+        errno = 0;
+        assert_true(chan_try_recv(chan, &msg) == -1 && errno == EAGAIN, chan,
+            "Receive on empty channel did not fail");
+        assert_true(chan_try_send(chan, "foo") == 0, chan, "Send failed");
+        assert_true(chan_size(chan) == 1, chan, "Chan size is not 1");
+
+        // Rings round their capacity up, so fill whatever room is left.
+        int sent = 1;
+        while (sent < 64 && chan_try_send(chan, "bar") == 0)
+        {
+            sent++;
+        }
+        assert_true(sent < 64 && errno == EAGAIN, chan,
+            "Send on full channel did not fail");
+        assert_true(chan_size(chan) == sent, chan, "Chan size is wrong");
+        assert_true(chan_try_recv(chan, &msg) == 0 && strcmp(msg, "foo") == 0,
+            chan, "Wrong value received");
+        assert_true(chan_try_send(chan, "baz") == 0, chan,
+            "Send after receive failed");
+        chan_close(chan);
+        assert_true(chan_is_closed(chan), chan, "Chan not closed");
+        errno = 0;
+        assert_true(chan_try_send(chan, "bar") == -1 && errno == EPIPE, chan,
+            "Send on closed channel did not fail");
+        int received = 0;
+        while (chan_try_recv(chan, &msg) == 0)
+        {
+            received++;
+        }
+        assert_true(received == sent && strcmp(msg, "baz") == 0 &&
+            errno == EPIPE, chan, "Buffered values lost on close");
+        chan_dispose(chan);
+    }
+
+    // Unbuffered channels only pair with a thread already blocked.
+    chan_t* chan = chan_init(0);
+    errno = 0;
+    assert_true(chan_try_send(chan, "foo") == -1 && errno == EAGAIN, chan,
+        "Send without receiver did not fail");
+    assert_true(chan_try_recv(chan, &msg) == -1 && errno == EAGAIN, chan,
+        "Receive without sender did not fail");
+    pthread_t th;
+    pthread_create(&th, NULL, receiver, chan);
+    wait_for_reader(chan);
+    assert_true(chan_try_send(chan, "foo") == 0, chan,
+        "Send to blocked receiver failed");
+    pthread_join(th, NULL);
+    pthread_create(&th, NULL, sender, chan);
+    wait_for_writer(chan);
+    assert_true(chan_try_recv(chan, &msg) == 0 && strcmp(msg, "foo") == 0,
+        chan, "Receive from blocked sender failed");
+    pthread_join(th, NULL);
+    chan_close(chan);
+    errno = 0;
+    assert_true(chan_try_recv(chan, &msg) == -1 && errno == EPIPE, chan,
+        "Receive on closed channel did not fail");
+    chan_dispose(chan);
+    pass();
+}
+
+void test_chan_unbounded()
+{
+    chan_t* chan = chan_init_unbounded();
+    errno = 0;
+    assert_true(chan_init_flags(5, CHAN_UNBOUNDED) == NULL && errno == EINVAL,
+        chan, "Unbounded channel with capacity created");
+    assert_true(chan->seg != NULL && chan->seg->head == NULL, chan,
+        "Segment allocated up front");
+
+    // Sends never block, however far ahead of the receiver they get.
+    for (uintptr_t i = 1; i <= 1000; ++i)
+    {
+        assert_true(chan_send(chan, (void*) i) == 0, chan, "Send failed");
+    }
+    assert_true(chan_size(chan) == 1000, chan, "Wrong size");
+
+    void* msg;
+    for (uintptr_t i = 1; i <= 1000; ++i)
+    {
+        chan_recv(chan, &msg);
+        assert_true((uintptr_t) msg == i, chan, "Messages out of order");
+    }
+    assert_true(chan_size(chan) == 0, chan, "Chan not empty");
+    assert_true(chan->seg->head == chan->seg->tail, chan,
+        "Emptied segments not released");
+    assert_true(chan->seg->free_count <= SEG_QUEUE_FREELIST_SIZE, chan,
+        "Freelist too long");
+
+    // Batches span segment boundaries.
+    void* batch[600];
+    for (uintptr_t i = 0; i < 600; ++i)
+    {
+        batch[i] = (void*) (i + 1);
+    }
+    assert_true(chan_send_many(chan, batch, 600) == 600, chan, "Send failed");
+    chan_close(chan);
+    assert_true(chan_drain(chan, batch, 600) == 600, chan, "Drain failed");
+    assert_true((uintptr_t) batch[599] == 600, chan, "Messages out of order");
+    assert_true(chan_recv(chan, &msg) == -1, chan,
+        "Recv on closed empty channel succeeded");
+    chan_dispose(chan);
+
+    chan = chan_init_unbounded();
+    pthread_t th;
+    pthread_create(&th, NULL, spin_sender, chan);
+    uintptr_t expected = 1;
+    while (chan_recv(chan, &msg) == 0)
+    {
+        assert_true((uintptr_t) msg == expected++, chan,
+            "Messages out of order");
+    }
+    assert_true(expected == 10001, chan, "Messages lost");
+    pthread_join(th, NULL);
+    chan_dispose(chan);
+    pass();
+}
+
+void* spsc_producer(void* chan)
+{
+    for (uintptr_t i = 1; i <= 10000; ++i)
+    {
+        chan_send(chan, (void*) i);
+    }
+    chan_close(chan);
+    return NULL;
+}
+
+void test_chan_spsc()
+{
+    chan_t* chan = chan_init_spsc(4);
+    assert_true(chan->spsc != NULL, chan, "Ring is NULL");
+    assert_true(chan->queue == NULL, chan, "Queue is not NULL");
+
+    void* msg = "foo";
+    void* received = NULL;
+    assert_true(chan_send(chan, msg) == 0, chan, "Send failed");
+    assert_true(chan_size(chan) == 1, chan, "Ring is empty");
+    assert_true(chan_recv(chan, &received) == 0, chan, "Recv failed");
+    assert_true(msg == received, chan, "Messages are not equal");
+    assert_true(chan_size(chan) == 0, chan, "Ring is not empty");
+
+    // Small capacity forces both sides to park repeatedly.
+    pthread_t th;
+    pthread_create(&th, NULL, spsc_producer, chan);
+    uintptr_t expected = 1;
+    while (chan_recv(chan, &received) == 0)
+    {
+        assert_true((uintptr_t) received == expected, chan,
+            "Messages out of order");
+        expected++;
+    }
+    assert_true(expected == 10001, chan, "Messages lost");
+    assert_true(chan_send(chan, msg) == -1, chan, "Send on closed succeeded");
+
+    pthread_join(th, NULL);
+    chan_dispose(chan);
+    pass();
+}
+
+void* mpmc_producer(void* chan)
+{
+    for (uintptr_t i = 1; i <= 1000; ++i)
+    {
+        chan_send(chan, (void*) i);
+    }
+    return NULL;
+}
+
+void* mpmc_consumer(void* chan)
+{
+    uintptr_t sum = 0;
+    void* msg;
+    while (chan_recv(chan, &msg) == 0)
+    {
+        sum += (uintptr_t) msg;
+    }
+    return (void*) sum;
+}
+
+void test_chan_mpmc()
+{
+    chan_t* chan = chan_init_flags(3, CHAN_MPMC);
+    assert_true(chan->mpmc != NULL, chan, "Ring is NULL");
+    assert_true(chan_init_flags(0, CHAN_MPMC) == NULL, chan,
+        "Unbuffered ring created");
+
+    pthread_t producers[4], consumers[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        pthread_create(&producers[i], NULL, mpmc_producer, chan);
+        pthread_create(&consumers[i], NULL, mpmc_consumer, chan);
+    }
+    for (int i = 0; i < 4; ++i)
+    {
+        pthread_join(producers[i], NULL);
+    }
+    chan_close(chan);
+
+    uintptr_t sum = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+        void* partial;
+        pthread_join(consumers[i], &partial);
+        sum += (uintptr_t) partial;
+    }
+    assert_true(sum == 4 * 500500, chan, "Messages lost");
+    assert_true(chan_size(chan) == 0, chan, "Ring is not empty");
+    chan_dispose(chan);
+
+    // A ring of capacity 1 holds exactly one value.
+    chan = chan_init_flags(1, CHAN_MPMC);
+    void* msg = "foo";
+    assert_true(chan_select(NULL, 0, NULL, &chan, 1, &msg) == 0, chan,
+        "Send failed");
+    assert_true(chan_select(NULL, 0, NULL, &chan, 1, &msg) == -1, chan,
+        "Send on full ring succeeded");
+    assert_true(chan_size(chan) == 1, chan, "Wrong ring size");
+    assert_true(chan_recv(chan, &msg) == 0 &&
+        chan_select(&chan, 1, &msg, NULL, 0, NULL) == -1, chan,
+        "Wrong ring contents");
+
+    chan_dispose(chan);
+    pass();
+}
+
+void* bytes_producer(void* chan)
+{
+    // Message i is i % 50 bytes long and filled with the byte i.
+    for (int i = 0; i < 10000; ++i)
+    {
+        size_t len = i % 50;
+        unsigned char* buf = chan_reserve(chan, 64);
+        memset(buf, i & 0xff, len);
+        chan_commit(chan, len);
+    }
+    chan_close(chan);
+    return NULL;
+}
+
+void* bytes_front(void* chan)
+{
+    usleep(10000);
+    char* buf = chan_reserve(chan, 200);
+    memset(buf, 'x', 200);
+    chan_commit(chan, 200);
+    return buf;
+}
+
+void test_chan_bytes()
+{
+    chan_t* chan = chan_init_bytes(100);
+    assert_true(chan->bytes != NULL, chan, "Ring is NULL");
+    assert_true(chan->bytes->capacity == 104, chan,
+        "Capacity not rounded up");
+
+    errno = 0;
+    assert_true(chan_reserve(chan, 200) == NULL && errno == EMSGSIZE, chan,
+        "Oversized reservation succeeded");
+    errno = 0;
+    assert_true(chan_send(chan, "foo") == -1 && errno == EINVAL, chan,
+        "Pointer send on byte channel succeeded");
+
+    char* buf = chan_reserve(chan, 16);
+    assert_true(buf != NULL && ((uintptr_t) buf & 7) == 0, chan,
+        "Reservation not aligned");
+    memcpy(buf, "hello", 5);
+    assert_true(chan_commit(chan, 32) == -1, chan,
+        "Commit beyond reservation succeeded");
+    assert_true(chan_commit(chan, 5) == 0, chan, "Commit failed");
+    assert_true(chan_size(chan) == 16, chan, "Wrong size");
+
+    size_t len = 0;
+    const char* msg = chan_peek_msg(chan, &len);
+    assert_true(msg == buf && len == 5 && memcmp(msg, "hello", 5) == 0,
+        chan, "Peeked message is not a view of the reserved room");
+    chan_consume(chan);
+    assert_true(chan_size(chan) == 0, chan, "Chan not empty");
+
+    // A message which does not fit before the end of the ring starts at the
+    // front behind padding.
+    chan_reserve(chan, 40);
+    chan_commit(chan, 40);
+    chan_peek_msg(chan, &len);
+    assert_true(len == 40, chan, "Wrong length");
+    chan_consume(chan);
+    char* wrapped = chan_reserve(chan, 40);
+    assert_true(wrapped == chan->bytes->data + 8, chan,
+        "Message not wrapped to the front");
+    chan_commit(chan, 1);
+    msg = chan_peek_msg(chan, &len);
+    assert_true(msg == wrapped && len == 1, chan, "Padding not skipped");
+    chan_consume(chan);
+
+    chan_close(chan);
+    errno = 0;
+    assert_true(chan_reserve(chan, 8) == NULL && errno == EPIPE, chan,
+        "Reserve on closed channel succeeded");
+    assert_true(chan_peek_msg(chan, &len) == NULL, chan,
+        "Peek on closed empty channel succeeded");
+    chan_dispose(chan);
+
+    chan = chan_init_bytes(256);
+    pthread_t th;
+    pthread_create(&th, NULL, bytes_producer, chan);
+    int expected = 0;
+    const unsigned char* data;
+    while ((data = chan_peek_msg(chan, &len)) != NULL)
+    {
+        assert_true(len == (size_t) (expected % 50), chan, "Wrong length");
+        for (size_t i = 0; i < len; ++i)
+        {
+            assert_true(data[i] == (expected & 0xff), chan,
+                "Message corrupted");
+        }
+        chan_consume(chan);
+        expected++;
+    }
+    assert_true(expected == 10000, chan, "Messages lost");
+    pthread_join(th, NULL);
+    chan_dispose(chan);
+
+    // An empty ring takes a message too long to fit behind the padding for
+    // the end of the ring by starting over at the front.
+    chan = chan_init_bytes(256);
+    chan_reserve(chan, 128);
+    chan_commit(chan, 128);
+    chan_peek_msg(chan, &len);
+    chan_consume(chan);
+    void* front;
+    pthread_create(&th, NULL, bytes_front, chan);
+    for (int i = 0; i < 200 && chan_size(chan) == 0; ++i)
+    {
+        usleep(10000);
+    }
+    assert_true(chan_size(chan) == 208, chan, "Message did not fit empty ring");
+    pthread_join(th, &front);
+    assert_true(front == chan->bytes->data + 8, chan,
+        "Message not placed at the front");
+    msg = chan_peek_msg(chan, &len);
+    assert_true(msg == front && len == 200, chan, "Wrong message");
+    chan_consume(chan);
+
+    // Likewise while a receiver is blocked on the ring.
+    chan_reserve(chan, 128);
+    chan_commit(chan, 128);
+    chan_peek_msg(chan, &len);
+    chan_consume(chan);
+    pthread_create(&th, NULL, bytes_front, chan);
+    msg = chan_peek_msg(chan, &len);
+    assert_true(len == 200 && msg[199] == 'x', chan, "Wrong message");
+    chan_consume(chan);
+    pthread_join(th, NULL);
+    chan_dispose(chan);
+    pass();
+}
+
+void test_chan_shm()
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/chan_test_%d", (int) getpid());
+    chan_t* chan = chan_open_shm(name, 4, sizeof(int64_t));
+    if (!chan)
+    {
+        perror("chan_open_shm");
+        exit(1);
+    }
+    assert_true(chan->shm != NULL, chan, "Mapping is NULL");
+
+    errno = 0;
+    assert_true(chan_open_shm(name, 8, sizeof(int64_t)) == NULL &&
+        errno == EINVAL, chan, "Opened with mismatched capacity");
+    errno = 0;
+    assert_true(chan_send(chan, "foo") == -1 && errno == EINVAL, chan,
+        "Pointer send on shared-memory channel succeeded");
+
+    // A second handle in the same process sees the same channel.
+    chan_t* other = chan_open_shm(name, 4, sizeof(int64_t));
+    assert_true(other != NULL, chan, "Reopen failed");
+    assert_true(chan_send_int64(other, 42) == 0, chan, "Send failed");
+    assert_true(chan_size(chan) == 1, chan, "Wrong size");
+    int64_t value = 0;
+    assert_true(chan_recv_int64(chan, &value) == 0 && value == 42, chan,
+        "Recv failed");
+    chan_dispose(other);
+
+    // Values cross the process boundary through a ring smaller than the
+    // number sent, so both sides block.
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        chan_t* child = chan_open_shm(name, 4, sizeof(int64_t));
+        for (int64_t i = 1; child && i <= 1000; ++i)
+        {
+            chan_send_int64(child, i);
+        }
+        if (child)
+        {
+            chan_close(child);
+            chan_dispose(child);
+        }
+        _exit(child ? 0 : 1);
+    }
+
+    int64_t expected = 1;
+    while (chan_recv_int64(chan, &value) == 0)
+    {
+        assert_true(value == expected++, chan, "Values out of order");
+    }
+    assert_true(expected == 1001, chan, "Values lost");
+    assert_true(chan_is_closed(chan), chan, "Close not shared");
+
+    int status;
+    waitpid(pid, &status, 0);
+    assert_true(WIFEXITED(status) && WEXITSTATUS(status) == 0, chan,
+        "Child failed");
+    assert_true(chan_unlink_shm(name) == 0, chan, "Unlink failed");
+    chan_dispose(chan);
+
+    // Anonymous channels are shared with forked children.
+    chan = chan_open_shm(NULL, 2, sizeof(double));
+    pid = fork();
+    if (pid == 0)
+    {
+        chan_send_double(chan, 2.5);
+        _exit(0);
+    }
+    double d = 0;
+    assert_true(chan_recv_double(chan, &d) == 0 && d == 2.5, chan,
+        "Anonymous recv failed");
+    waitpid(pid, &status, 0);
+    chan_dispose(chan);
+    pass();
+}
+
+typedef struct
+{
+    chan_t** chans;
+    int      count;
+} set_senders_t;
+
+void* set_sender(void* arg)
+{
+    set_senders_t* senders = (set_senders_t*) arg;
+    for (uintptr_t i = 1; i <= 10000; ++i)
+    {
+        chan_send(senders->chans[(i * 7) % senders->count], (void*) i);
+    }
+    for (int i = 0; i < senders->count; ++i)
+    {
+        chan_close(senders->chans[i]);
+    }
+    return NULL;
+}
+
+void test_chan_set()
+{
+    chan_t* chans[200];
+    for (int i = 0; i < 200; ++i)
+    {
+        // Mix every engine a set can hold.
+        switch (i % 4)
+        {
+            case 0: chans[i] = chan_init(4); break;
+            case 1: chans[i] = chan_init_flags(4, CHAN_MPMC); break;
+            case 2: chans[i] = chan_init_unbounded(); break;
+            default: chans[i] = chan_init(0); break;
+        }
+    }
+    chan_t* chan = chans[0];
+
+    errno = 0;
+    assert_true(chan_set_init(0) == NULL && errno == EINVAL, chan,
+        "Set with no capacity created");
+    chan_set_t* set = chan_set_init(200);
+    assert_true(set != NULL, chan, "Set is NULL");
+
+    // Values sent before a channel joins are still found.
+    chan_send(chans[100], "before");
+    for (int i = 0; i < 200; ++i)
+    {
+        assert_true(chan_set_add(set, chans[i]) == i, chan, "Wrong index");
+    }
+    errno = 0;
+    assert_true(chan_set_add(set, chans[0]) == -1 && errno == EBUSY, chan,
+        "Channel added twice");
+    chan_t* extra = chan_init(1);
+    errno = 0;
+    assert_true(chan_set_add(set, extra) == -1 && errno == ENOSPC, extra,
+        "Added to full set");
+    chan_t* sized = chan_init_sized(1, sizeof(int32_t));
+    errno = 0;
+    assert_true(chan_set_add(set, sized) == -1 && errno == EINVAL, sized,
+        "Sized channel added");
+    chan_dispose(sized);
+
+    void* msg = NULL;
+    assert_true(chan_set_select(set, &msg) == 100 &&
+        strcmp(msg, "before") == 0, chan, "Early value lost");
+    assert_true(chan_set_select(set, &msg) == -1, chan,
+        "Select on idle set succeeded");
+
+    // Only the channels with values are visited, each once per value.
+    chan_send(chans[4], "a");
+    chan_send(chans[4], "b");
+    chan_send(chans[197], "c");
+    int seen4 = 0, seen197 = 0;
+    for (int i = 0; i < 3; ++i)
+    {
+        int index = chan_set_select(set, &msg);
+        seen4 += index == 4;
+        seen197 += index == 197;
+    }
+    assert_true(seen4 == 2 && seen197 == 1, chan, "Wrong channels selected");
+    assert_true(chan_set_select(set, &msg) == -1, chan, "Set not drained");
+
+    struct timespec timeout = {0, 10000000};
+    errno = 0;
+    assert_true(chan_set_select_timeout(set, &msg, &timeout) == -1 &&
+        errno == ETIMEDOUT, chan, "Timed select did not time out");
+
+    // A removed channel is no longer selected and its index is reused.
+    assert_true(chan_set_remove(set, chans[8]) == 0, chan, "Remove failed");
+    chan_send(chans[8], "gone");
+    assert_true(chan_set_select(set, &msg) == -1, chan,
+        "Removed channel selected");
+    assert_true(chan_set_add(set, extra) == 8, extra, "Index not reused");
+    assert_true(chan_set_remove(set, chans[8]) == -1, chan,
+        "Removed channel removed again");
+    chan_set_remove(set, extra);
+    chan_recv(chans[8], &msg);
+    chan_dispose(extra);
+
+    // Values from a busy sender are all delivered, then the set reports
+    // closed once every channel is.
+    chan_set_add(set, chans[8]);
+    set_senders_t senders = {chans, 200};
+    pthread_t th;
+    pthread_create(&th, NULL, set_sender, &senders);
+    uintptr_t sum = 0;
+    int received = 0;
+    int index;
+    while ((index = chan_set_select_wait(set, &msg)) >= 0)
+    {
+        assert_true(index == (int) (((uintptr_t) msg * 7) % 200), chan,
+            "Value from wrong channel");
+        sum += (uintptr_t) msg;
+        received++;
+    }
+    assert_true(errno == EPIPE, chan, "Wrong error");
+    assert_true(received == 10000 && sum == 10000 * 10001 / 2, chan,
+        "Values lost");
+    pthread_join(th, NULL);
+
+    chan_set_dispose(set);
+    assert_true(chans[1]->set == NULL, chan, "Channel still in set");
+    for (int i = 1; i < 200; ++i)
+    {
+        chan_dispose(chans[i]);
+    }
+    chan_dispose(chan);
+    pass();
+}
+
+typedef struct
+{
+    chan_sub_t* sub;
+    uintptr_t   received;
+    int         in_order;
+} bcast_reader_t;
+
+void* bcast_reader(void* arg)
+{
+    bcast_reader_t* reader = (bcast_reader_t*) arg;
+    void* msg;
+    reader->in_order = 1;
+    while (chan_sub_recv(reader->sub, &msg) == 0)
+    {
+        reader->in_order &= (uintptr_t) msg == ++reader->received;
+    }
+    return NULL;
+}
+
+void test_chan_bcast()
+{
+    chan_t* chan = chan_init(0);
+    chan_bcast_t* bcast = chan_bcast_init(10);
+    assert_true(bcast != NULL, chan, "Broadcast channel is NULL");
+
+    // With nobody subscribed, sends go nowhere and never block.
+    for (uintptr_t i = 0; i < 100; ++i)
+    {
+        assert_true(chan_bcast_send(bcast, (void*) i) == 0, chan,
+            "Send failed");
+    }
+
+    // Every lossless subscriber sees every value, in order, even though the
+    // ring is much smaller than the number sent.
+    bcast_reader_t readers[4];
+    pthread_t threads[4];
+    for (int i = 0; i < 4; ++i)
+    {
+        readers[i].sub = chan_bcast_subscribe(bcast, 0);
+        readers[i].received = 0;
+        pthread_create(&threads[i], NULL, bcast_reader, &readers[i]);
+    }
+
+    // A lossy subscriber that is not reading does not hold the sender back.
+    chan_sub_t* lossy = chan_bcast_subscribe(bcast, CHAN_SUB_LOSSY);
+    for (uintptr_t i = 1; i <= 10000; ++i)
+    {
+        chan_bcast_send(bcast, (void*) i);
+    }
+    chan_bcast_close(bcast);
+    for (int i = 0; i < 4; ++i)
+    {
+        pthread_join(threads[i], NULL);
+        assert_true(readers[i].received == 10000 && readers[i].in_order,
+            chan, "Subscriber missed values");
+    }
+    assert_true(chan_bcast_send(bcast, NULL) == -1 && errno == EPIPE, chan,
+        "Send on closed channel succeeded");
+
+    void* msg;
+    assert_true(chan_sub_recv(lossy, &msg) == 0, chan, "Lossy recv failed");
+    assert_true(chan_sub_dropped(lossy) == 10000 - 15 &&
+        (uintptr_t) msg == 10000 - 14, chan, "Lossy subscriber did not skip");
+    uintptr_t last = (uintptr_t) msg;
+    while (chan_sub_recv(lossy, &msg) == 0)
+    {
+        assert_true((uintptr_t) msg == ++last, chan, "Values out of order");
+    }
+    assert_true(last == 10000, chan, "Lossy subscriber missed the end");
+    chan_bcast_dispose(bcast);
+
+    // Unsubscribing a subscriber that fell behind releases the sender.
+    bcast = chan_bcast_init(2);
+    chan_sub_t* slow = chan_bcast_subscribe(bcast, 0);
+    chan_sub_t* late = NULL;
+    chan_bcast_send(bcast, (void*) 1);
+    chan_bcast_send(bcast, (void*) 2);
+    late = chan_bcast_subscribe(bcast, 0);
+    pthread_t th;
+    bcast_reader_t reader = {late, 2, 1};
+    pthread_create(&th, NULL, bcast_reader, &reader);
+    chan_bcast_unsubscribe(slow);
+    assert_true(chan_bcast_send(bcast, (void*) 3) == 0, chan, "Send failed");
+    chan_bcast_close(bcast);
+    pthread_join(th, NULL);
+    assert_true(reader.received == 3 && reader.in_order, chan,
+        "Late subscriber saw old values");
+    chan_bcast_dispose(bcast);
+    chan_dispose(chan);
+    pass();
+}
+
+void* prio_sender(void* chan)
+{
+    for (uintptr_t i = 1; i <= 1000; ++i)
+    {
+        chan_send_prio(chan, (void*) i, 0);
+    }
+    chan_close(chan);
+    return NULL;
+}
+
+void test_chan_priority()
+{
+    chan_t* chan = chan_init_priority(2, 3);
+    errno = 0;
+    assert_true(chan_init_priority(2, 0) == NULL && errno == EINVAL, chan,
+        "Priority channel without levels created");
+    errno = 0;
+    assert_true(chan_init_priority(2, PRIO_QUEUE_MAX_LEVELS + 1) == NULL &&
+        errno == EINVAL, chan, "Priority channel with too many levels created");
+    errno = 0;
+    assert_true(chan_send_prio(chan, "x", 3) == -1 && errno == EINVAL, chan,
+        "Send above the top level succeeded");
+    errno = 0;
+    assert_true(chan_send_prio(chan, "x", -1) == -1 && errno == EINVAL, chan,
+        "Send below level 0 succeeded");
+
+    // A full level does not hold back the levels above it.
+    assert_true(chan_send(chan, "low1") == 0, chan, "Send failed");
+    assert_true(chan_send_prio(chan, "low2", 0) == 0, chan, "Send failed");
+    struct timespec zero = { 0, 0 };
+    errno = 0;
+    assert_true(chan_send_timeout(chan, "low3", &zero) == -1 &&
+        errno == ETIMEDOUT, chan, "Send on full level succeeded");
+    assert_true(chan_send_prio(chan, "mid", 1) == 0, chan, "Send failed");
+    assert_true(chan_send_prio(chan, "high", 2) == 0, chan, "Send failed");
+    assert_true(chan_size(chan) == 4, chan, "Wrong size");
+
+    // Receives drain the highest level first, each level in order.
+    const char* expected[] = { "high", "mid", "low1", "low2" };
+    void* msg;
+    for (int i = 0; i < 4; ++i)
+    {
+        chan_recv(chan, &msg);
+        assert_true(strcmp(msg, expected[i]) == 0, chan,
+            "Messages out of priority order");
+    }
+    assert_true(chan_size(chan) == 0, chan, "Chan not empty");
+    chan_dispose(chan);
+
+    // An urgent value overtakes a backlog kept full by a blocked sender.
+    chan = chan_init_priority(4, 2);
+    chan_t* plain = chan_init(1);
+    errno = 0;
+    assert_true(chan_send_prio(plain, "x", 0) == -1 && errno == EINVAL, chan,
+        "Priority send on plain channel succeeded");
+    chan_dispose(plain);
+
+    pthread_t th;
+    pthread_create(&th, NULL, prio_sender, chan);
+    uintptr_t next = 1;
+    while (chan_recv(chan, &msg) == 0)
+    {
+        assert_true((uintptr_t) msg == next++, chan, "Messages out of order");
+        if ((uintptr_t) msg % 100 == 50)
+        {
+            // The sender is at most a few values ahead, so not done yet.
+            assert_true(chan_send_prio(chan, NULL, 1) == 0, chan,
+                "Send failed");
+            chan_recv(chan, &msg);
+            assert_true(msg == NULL, chan, "Urgent value did not overtake");
+        }
+    }
+    assert_true(next == 1001, chan, "Messages lost");
+    pthread_join(th, NULL);
+    chan_dispose(chan);
+    pass();
+}
+
+void test_chan_opts()
+{
+    chan_t* chan = chan_init(4);
+    assert_true((uintptr_t) chan % CHAN_CACHE_LINE == 0, chan,
+        "Channel not cache-line aligned");
+    assert_true(offsetof(chan_t, w_waiting) / CHAN_CACHE_LINE !=
+        offsetof(chan_t, r_waiting) / CHAN_CACHE_LINE, chan,
+        "Sender and receiver state share a cache line");
+    errno = 0;
+    assert_true(chan_init_flags(4, CHAN_NUMA) == NULL && errno == EINVAL, chan,
+        "NUMA channel created without a node");
+    chan_opts_t bad = { 0, CHAN_UNBOUNDED | CHAN_HUGEPAGES, 0 };
+    errno = 0;
+    assert_true(chan_init_opts(&bad) == NULL && errno == EINVAL, chan,
+        "Unbounded channel placed");
+    chan_dispose(chan);
+
+    // A ring of a million slots backed by huge pages, or by ordinary pages
+    // where neither kind of huge page is available.
+    chan_opts_t huge = { 1 << 20, CHAN_SPSC | CHAN_HUGEPAGES, 0 };
+    chan = chan_init_opts(&huge);
+    assert_true(chan != NULL, chan, "Huge page channel not created");
+    for (uintptr_t i = 1; i <= 1 << 20; ++i)
+    {
+        assert_true(chan_send(chan, (void*) i) == 0, chan, "Send failed");
+    }
+    void* msg;
+    for (uintptr_t i = 1; i <= 1 << 20; ++i)
+    {
+        chan_recv(chan, &msg);
+        assert_true((uintptr_t) msg == i, chan, "Messages out of order");
+    }
+    chan_dispose(chan);
+
+#ifdef __linux__
+    chan_opts_t numa[2] = {
+        { 16, CHAN_NUMA, 0 },
+        { 16, CHAN_MPMC | CHAN_NUMA | CHAN_HUGEPAGES, 0 }
+    };
+    for (int i = 0; i < 2; ++i)
+    {
+        chan = chan_init_opts(&numa[i]);
+        if (!chan && (errno == ENOSYS || errno == EPERM))
+        {
+            // The kernel was built without NUMA support or forbids mbind.
+            break;
+        }
+        assert_true(chan != NULL, chan, "NUMA channel not created");
+        assert_true(chan_send(chan, "numa") == 0, chan, "Send failed");
+        chan_recv(chan, &msg);
+        assert_true(strcmp(msg, "numa") == 0, chan, "Wrong message");
+        chan_dispose(chan);
+    }
+
+    chan = chan_init(0);
+    chan_opts_t missing = { 16, CHAN_NUMA, 1 << 20 };
+    errno = 0;
+    assert_true(chan_init_opts(&missing) == NULL && errno == EINVAL, chan,
+        "Channel placed on missing node");
+    chan_dispose(chan);
+#endif
+    pass();
+}
+
+void* cache_churner(void* arg)
+{
+    (void) arg;
+    for (int i = 0; i < 1000; ++i)
+    {
+        chan_t* chan = chan_init(i % 3);
+        chan_send_timeout(chan, "x", &(struct timespec) { 0, 0 });
+        chan_dispose(chan);
+    }
+    return NULL;
+}
+
+void test_chan_cache()
+{
+    chan_t* chan = chan_init(8);
+    assert_true(chan->queue == (queue_t*) (chan + 1) &&
+        chan->queue->data == (void**) (chan->queue + 1), chan,
+        "Buffered channel not in one allocation");
+    errno = 0;
+    assert_true(chan_cache_enable(CHAN_CACHE_MAX + 1) == -1 && errno == EINVAL,
+        chan, "Cache larger than the maximum enabled");
+    assert_true(chan_cache_enable(2) == 0, chan, "Cache not enabled");
+
+    // A disposed channel comes back reset for the same capacity only.
+    chan_set_spin(chan, 0);
+    chan_send(chan, "a");
+    chan_close(chan);
+    chan_t* old = chan;
+    chan_dispose(chan);
+    chan = chan_init(4);
+    assert_true(chan != old, chan, "Cached channel reused at wrong capacity");
+    chan_dispose(chan);
+    chan = chan_init(8);
+    assert_true(chan == old, chan, "Cached channel not reused");
+    assert_true(!chan_is_closed(chan) && chan_size(chan) == 0 &&
+        chan->spin_limit == CHAN_SPIN_DEFAULT, chan, "Cached channel not reset");
+    void* msg;
+    assert_true(chan_send(chan, "b") == 0 && chan_recv(chan, &msg) == 0 &&
+        strcmp(msg, "b") == 0, chan, "Cached channel unusable");
+    chan_dispose(chan);
+
+    // Channels with other engines are never cached.
+    chan = chan_init_flags(8, CHAN_MPMC);
+    assert_true(!chan->plain, chan, "Ring channel cacheable");
+    chan_dispose(chan);
+
+    // Caches of exiting threads are released with them.
+    pthread_t th;
+    pthread_create(&th, NULL, cache_churner, NULL);
+    pthread_join(th, NULL);
+
+    chan = chan_init(0);
+    assert_true(chan->plain, chan, "Unbuffered channel not cacheable");
+    chan_dispose(chan);
+    chan = chan_init(0);
+    assert_true(chan_cache_enable(0) == 0, chan, "Cache not disabled");
+    chan_dispose(chan);
+    pass();
+}
+
+#define GO_CHAIN 1000
+
+void go_relay(void* arg)
+{
+    chan_t** chans = (chan_t**) arg;
+    void* msg;
+    if (chan_recv(chans[0], &msg) == 0)
+    {
+        chan_send(chans[1], (void*) ((intptr_t) msg + 1));
+    }
+}
+
+void go_waiter(void* arg)
+{
+    chan_t** chans = (chan_t**) arg;
+    void* msg;
+    struct timespec timeout = { 0, 10000000 };
+    int rc = chan_recv_timeout(chans[0], &msg, &timeout);
+    chan_send(chans[2], (void*) (intptr_t) (rc == -1 && errno == ETIMEDOUT));
+
+    // Blocks in a select until the main thread sends on the second channel.
+    int chosen = chan_select_wait(chans, 2, &msg, NULL, 0, NULL);
+    chan_send(chans[2], (void*) (intptr_t) (chosen == 1 &&
+        strcmp(msg, "go") == 0));
+}
+
+// Selects over every channel of the chain, more cases than would fit on the
+// task's stack.
+void go_wide(void* arg)
+{
+    chan_t** chans = (chan_t**) arg;
+    void* msg;
+    int chosen = chan_select_wait(chans, GO_CHAIN, &msg, NULL, 0, NULL);
+    chan_send(chans[GO_CHAIN], (void*) (intptr_t) (chosen == GO_CHAIN - 1 &&
+        strcmp(msg, "wide") == 0));
+}
+
+void test_chan_go()
+{
+    chan_t* chans[GO_CHAIN + 1];
+    int i;
+    for (i = 0; i <= GO_CHAIN; i++)
+    {
+        chans[i] = chan_init(0);
+    }
+    errno = 0;
+    assert_true(chan_go(go_relay, chans) == -1 && errno == EINVAL, chans[0],
+        "Task started without a runtime");
+    assert_true(chan_sched_init(2, 0) == 0, chans[0], "Runtime not started");
+    errno = 0;
+    assert_true(chan_sched_init(2, 0) == -1 && errno == EINVAL, chans[0],
+        "Runtime started twice");
+
+    // Every task blocks on its own unbuffered channel, far more tasks than
+    // worker threads.
+    for (i = 0; i < GO_CHAIN; i++)
+    {
+        assert_true(chan_go(go_relay, &chans[i]) == 0, chans[0],
+            "Task not started");
+    }
+    void* msg;
+    chan_send(chans[0], (void*) (intptr_t) 0);
+    chan_recv(chans[GO_CHAIN], &msg);
+    assert_true((intptr_t) msg == GO_CHAIN, chans[0],
+        "Value lost along the task chain");
+
+    // Timeouts and selects park tasks too.
+    chan_t* waits[3] = { chans[0], chans[1], chans[2] };
+    assert_true(chan_go(go_waiter, waits) == 0, chans[0], "Task not started");
+    chan_recv(waits[2], &msg);
+    assert_true(msg != NULL, chans[0], "Receive in a task did not time out");
+    chan_send(waits[1], "go");
+    chan_recv(waits[2], &msg);
+    assert_true(msg != NULL, chans[0], "Select in a task not woken");
+
+    assert_true(chan_go(go_wide, chans) == 0, chans[0], "Task not started");
+    chan_send(chans[GO_CHAIN - 1], "wide");
+    chan_recv(chans[GO_CHAIN], &msg);
+    assert_true(msg != NULL, chans[0], "Wide select in a task failed");
+
+    assert_true(chan_sched_shutdown() == 0, chans[0], "Runtime not stopped");
+    errno = 0;
+    assert_true(chan_sched_shutdown() == -1 && errno == EINVAL, chans[0],
+        "Runtime stopped twice");
+    for (i = 0; i <= GO_CHAIN; i++)
+    {
+        chan_dispose(chans[i]);
+    }
+    pass();
+}
+
+chan_pool_t* split_pool;
+
+void* pool_square(void* job)
+{
+    intptr_t n = (intptr_t) job;
+    if (n < 0)
+    {
+        // Split into jobs queued on this worker's own deque for others to
+        // steal.
+        intptr_t i;
+        for (i = 1; i <= -n; i++)
+        {
+            chan_pool_send(split_pool, (void*) i);
+        }
+        return (void*) 0;
+    }
+    return (void*) (n * n);
+}
+
+void test_chan_pool()
+{
+    errno = 0;
+    chan_t* chan = chan_init(0);
+    assert_true(!chan_pool_init(0, pool_square, 0) && errno == EINVAL, chan,
+        "Pool without workers created");
+
+    // Jobs sent from outside and from inside the pool all run once.
+    chan_pool_t* pool = chan_pool_init(4, pool_square,
+        CHAN_POOL_RESULTS | CHAN_POOL_PIN);
+    assert_true(pool != NULL, chan, "Pool not created");
+    split_pool = pool;
+    intptr_t i;
+    intptr_t expected = 0;
+    for (i = 1; i <= 1000; i++)
+    {
+        chan_pool_send(pool, (void*) i);
+        expected += i * i;
+    }
+    assert_true(chan_pool_send(pool, (void*) -2000) == 0, chan,
+        "Job not sent");
+    for (i = 1; i <= 2000; i++)
+    {
+        expected += i * i;
+    }
+
+    // The splitting job's sends race the close, so wait for all results.
+    intptr_t sum = 0;
+    void* result;
+    for (i = 0; i < 3001; i++)
+    {
+        assert_true(chan_pool_recv(pool, &result) == 0, chan,
+            "Result not received");
+        sum += (intptr_t) result;
+    }
+    assert_true(sum == expected, chan, "Pool results wrong");
+    assert_true(chan_pool_close(pool) == 0, chan, "Pool not closed");
+    errno = 0;
+    assert_true(chan_pool_send(pool, (void*) 1) == -1 && errno == EPIPE, chan,
+        "Job sent to closed pool");
+    errno = 0;
+    assert_true(chan_pool_recv(pool, &result) == -1 && errno == EPIPE, chan,
+        "Receive on drained pool did not fail");
+    chan_pool_dispose(pool);
+
+    // Without CHAN_POOL_RESULTS, results are not kept.
+    pool = chan_pool_init(2, pool_square, 0);
+    chan_pool_send(pool, (void*) 3);
+    errno = 0;
+    assert_true(chan_pool_recv(pool, &result) == -1 && errno == EINVAL, chan,
+        "Result kept without CHAN_POOL_RESULTS");
+    chan_pool_dispose(pool);
+    chan_dispose(chan);
+    pass();
+}
+
+void* stage_double(void* value)
+{
+    return (void*) ((intptr_t) value * 2);
+}
+
+void* stage_inc(void* value)
+{
+    return (void*) ((intptr_t) value + 1);
+}
+
+int stage_even(void* value)
+{
+    return (intptr_t) value % 2 == 0;
+}
+
+int stage_not_four(void* value)
+{
+    return (intptr_t) value % 4 != 0;
+}
+
+// Receives every value left in a closed channel, returning how many there
+// were and adding them up in sum.
+int stage_drain(chan_t* chan, intptr_t* sum)
+{
+    int count = 0;
+    void* msg;
+    while (chan_recv(chan, &msg) == 0)
+    {
+        *sum += (intptr_t) msg;
+        count++;
+    }
+    return count;
+}
+
+void test_chan_stage()
+{
+    chan_t* in = chan_init_unbounded();
+    chan_t* mid = chan_init(8);
+    chan_t* out = chan_init_unbounded();
+    intptr_t i;
+
+    errno = 0;
+    assert_true(!chan_map(in, out, stage_double, 0) && errno == EINVAL, in,
+        "Stage without workers started");
+    chan_t* sized = chan_init_sized(4, sizeof(int));
+    errno = 0;
+    assert_true(!chan_map(sized, out, stage_double, 1) && errno == EINVAL, in,
+        "Stage over a sized channel started");
+    chan_dispose(sized);
+    chan_step_t bad = { stage_double, stage_even };
+    errno = 0;
+    assert_true(!chan_chain(in, out, &bad, 1, 1) && errno == EINVAL, in,
+        "Step with both functions accepted");
+
+    // Two stages through a small channel, each closing the next.
+    chan_stage_t* map = chan_map(in, mid, stage_double, 3);
+    chan_stage_t* filter = chan_filter(mid, out, stage_not_four, 2);
+    assert_true(map && filter, in, "Stages not started");
+    intptr_t expected = 0;
+    for (i = 1; i <= 1000; i++)
+    {
+        chan_send(in, (void*) i);
+        expected += i % 2 ? i * 2 : 0;
+    }
+    chan_close(in);
+    chan_stage_dispose(map);
+    chan_stage_dispose(filter);
+    assert_true(chan_is_closed(mid) && chan_is_closed(out), in,
+        "Close not propagated");
+    intptr_t sum = 0;
+    assert_true(stage_drain(out, &sum) == 500 && sum == expected, in,
+        "Map and filter results wrong");
+    chan_dispose(in);
+    chan_dispose(mid);
+    chan_dispose(out);
+
+    // A fused chain with one worker keeps the order.
+    in = chan_init_unbounded();
+    out = chan_init_unbounded();
+    chan_step_t steps[] = {
+        { stage_inc, NULL }, { NULL, stage_even }, { stage_double, NULL } };
+    chan_stage_t* chain = chan_chain(in, out, steps, 3, 1);
+    for (i = 0; i < 100; i++)
+    {
+        chan_send(in, (void*) i);
+    }
+    chan_close(in);
+    chan_stage_dispose(chain);
+    for (i = 1; i < 100; i += 2)
+    {
+        void* msg;
+        assert_true(chan_recv(out, &msg) == 0 && (intptr_t) msg == (i + 1) * 2,
+            in, "Chain results wrong");
+    }
+    assert_true(chan_recv(out, NULL) == -1, in, "Chain sent extra values");
+    chan_dispose(in);
+    chan_dispose(out);
+
+    // Merge closes its output once every input is done.
+    chan_t* ins[3];
+    out = chan_init_unbounded();
+    for (i = 0; i < 3; i++)
+    {
+        ins[i] = chan_init(4);
+    }
+    chan_stage_t* merge = chan_merge(ins, 3, out);
+    expected = 0;
+    for (i = 1; i <= 300; i++)
+    {
+        chan_send(ins[i % 3], (void*) i);
+        expected += i;
+    }
+    chan_close(ins[0]);
+    chan_close(ins[1]);
+    assert_true(!chan_is_closed(out), out, "Merge closed output early");
+    chan_close(ins[2]);
+    chan_stage_dispose(merge);
+    sum = 0;
+    assert_true(stage_drain(out, &sum) == 300 && sum == expected, out,
+        "Merge results wrong");
+    for (i = 0; i < 3; i++)
+    {
+        chan_dispose(ins[i]);
+    }
+    chan_dispose(out);
+
+    // Split hands each value to exactly one output.
+    chan_t* outs[3];
+    in = chan_init_unbounded();
+    for (i = 0; i < 3; i++)
+    {
+        outs[i] = chan_init_unbounded();
+    }
+    chan_stage_t* split = chan_split(in, outs, 3);
+    for (i = 1; i <= 300; i++)
+    {
+        chan_send(in, (void*) i);
+    }
+    chan_close(in);
+    chan_stage_dispose(split);
+    int count = 0;
+    sum = 0;
+    for (i = 0; i < 3; i++)
+    {
+        count += stage_drain(outs[i], &sum);
+        assert_true(chan_is_closed(outs[i]), in, "Split output not closed");
+    }
+    assert_true(count == 300 && sum == expected, in, "Split results wrong");
+    for (i = 0; i < 3; i++)
+    {
+        chan_dispose(outs[i]);
+    }
+    chan_dispose(in);
+
+    // Tee sends every value to every output, in order.
+    in = chan_init(4);
+    for (i = 0; i < 2; i++)
+    {
+        outs[i] = chan_init_unbounded();
+    }
+    chan_stage_t* tee = chan_tee(in, outs, 2);
+    for (i = 0; i < 100; i++)
+    {
+        chan_send(in, (void*) i);
+    }
+    chan_close(in);
+    chan_stage_dispose(tee);
+    for (i = 0; i < 200; i++)
+    {
+        void* msg;
+        assert_true(chan_recv(outs[i / 100], &msg) == 0 &&
+            (intptr_t) msg == i % 100, in, "Tee results wrong");
+    }
+    for (i = 0; i < 2; i++)
+    {
+        assert_true(chan_recv(outs[i], NULL) == -1, in, "Tee output not closed");
+        chan_dispose(outs[i]);
+    }
+    chan_dispose(in);
+    pass();
+}
 
 int main()
 {
@@ -486,11 +2428,37 @@ int main()
     test_chan_send();
     test_chan_recv();
     test_chan_select();
+    test_chan_set();
+    test_chan_timeout();
+    test_chan_batch();
+    test_chan_spin();
+    test_chan_stats();
+#ifdef __linux__
+    test_chan_fd();
+#endif
     test_chan_int();
     test_chan_double();
     test_chan_buf();
+    test_chan_sized();
     test_chan_multi();
+#ifndef CHAN_FUTEX
     test_chan_multi2();
+#endif
+    test_chan_fifo();
+    test_chan_overflow();
+    test_chan_try();
+    test_chan_spsc();
+    test_chan_mpmc();
+    test_chan_unbounded();
+    test_chan_opts();
+    test_chan_cache();
+    test_chan_priority();
+    test_chan_go();
+    test_chan_pool();
+    test_chan_stage();
+    test_chan_bytes();
+    test_chan_bcast();
+    test_chan_shm();
     printf("\n%d passed\n", passed);
     return 0;
 }
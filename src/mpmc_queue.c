@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+
+#ifdef __APPLE__
+#define _XOPEN_SOURCE
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "mpmc_queue.h"
+
+// Returns the cell for the given position.
+static inline mpmc_cell_t* mpmc_queue_cell(mpmc_queue_t* queue, size_t pos)
+{
+    return &queue->cells[pos & queue->mask];
+}
+
+// Allocates and returns a new queue. The capacity specifies the maximum
+// number of items that can be in the queue at one time. Returns NULL and sets
+// errno if initialization failed.
+mpmc_queue_t* mpmc_queue_init(size_t capacity)
+{
+    return mpmc_queue_init_mem(capacity, NULL);
+}
+
+// Allocates and returns a new queue like mpmc_queue_init, placing it as
+// described by mem (see chan_mem_alloc), which may be NULL. Returns NULL and
+// sets errno if initialization failed.
+mpmc_queue_t* mpmc_queue_init_mem(size_t capacity, const chan_mem_t* mem)
+{
+    if (capacity == 0 || capacity > INT_MAX / sizeof(mpmc_cell_t))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // Round the number of slots up to a power of two so positions can be
+    // wrapped with a mask. There are always at least two, since with a single
+    // slot the sequence numbers cannot tell a full queue from an empty one.
+    // The logical capacity is enforced by mpmc_queue_push.
+    size_t slots = 2;
+    while (slots < capacity)
+    {
+        slots <<= 1;
+    }
+
+    mpmc_queue_t* queue = (mpmc_queue_t*) chan_mem_alloc(sizeof(mpmc_queue_t),
+        mem);
+    mpmc_cell_t*  cells = (mpmc_cell_t*) chan_mem_alloc(
+        slots * sizeof(mpmc_cell_t), mem);
+    if (!queue || !cells)
+    {
+        int err = errno;
+        chan_mem_free(queue);
+        chan_mem_free(cells);
+        errno = err;
+        return NULL;
+    }
+
+    size_t i;
+    for (i = 0; i < slots; i++)
+    {
+        cells[i].seq = i;
+    }
+
+    queue->enqueue_pos = 0;
+    queue->dequeue_pos = 0;
+    queue->capacity = capacity;
+    queue->mask = slots - 1;
+    queue->cells = cells;
+    return queue;
+}
+
+// Releases the queue resources.
+void mpmc_queue_dispose(mpmc_queue_t* queue)
+{
+    chan_mem_free(queue->cells);
+    chan_mem_free(queue);
+}
+
+// Enqueues an item in the queue. Returns 0 if the add succeeded or -1 if the
+// queue is full.
+int mpmc_queue_push(mpmc_queue_t* queue, void* value)
+{
+    mpmc_cell_t* cell;
+    size_t pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        cell = mpmc_queue_cell(queue, pos);
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0)
+        {
+            // The slot is free, but the queue may already hold as many items
+            // as its capacity allows. A stale pos that has fallen behind
+            // dequeue_pos goes on to fail the claim below.
+            size_t dequeue = __atomic_load_n(&queue->dequeue_pos,
+                __ATOMIC_ACQUIRE);
+            if ((intptr_t) (pos - dequeue) >= (intptr_t) queue->capacity)
+            {
+                return -1;
+            }
+
+            // Slot is free for this position, try to claim it.
+            if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1,
+                    1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // Slot still holds the value from the previous lap.
+            return -1;
+        }
+        else
+        {
+            // Another producer claimed this position first.
+            pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->value = value;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Dequeues an item from the head of the queue into value. Returns 0 if an
+// item was removed or -1 if the queue is empty.
+int mpmc_queue_pop(mpmc_queue_t* queue, void** value)
+{
+    mpmc_cell_t* cell;
+    size_t pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        cell = mpmc_queue_cell(queue, pos);
+        size_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t) seq - (intptr_t) (pos + 1);
+        if (diff == 0)
+        {
+            // Slot holds a value for this position, try to claim it.
+            if (__atomic_compare_exchange_n(&queue->dequeue_pos, &pos, pos + 1,
+                    1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // Nothing has been published at this position yet.
+            return -1;
+        }
+        else
+        {
+            // Another consumer claimed this position first.
+            pos = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    *value = cell->value;
+    __atomic_store_n(&cell->seq, pos + queue->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Returns the number of items claimed in the queue. The result is a snapshot
+// and may be stale by the time it is used.
+size_t mpmc_queue_size(mpmc_queue_t* queue)
+{
+    size_t dequeue = __atomic_load_n(&queue->dequeue_pos, __ATOMIC_ACQUIRE);
+    size_t enqueue = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_ACQUIRE);
+    size_t size = enqueue - dequeue;
+    return size > queue->capacity ? queue->capacity : size;
+}
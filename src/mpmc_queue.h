@@ -0,0 +1,65 @@
+#ifndef mpmc_queue_h
+#define mpmc_queue_h
+
+#include <stddef.h>
+
+#include "spsc_queue.h"
+
+// A slot in an mpmc_queue_t. The sequence number tells producers and
+// consumers whose turn it is to use the slot.
+typedef struct mpmc_cell_t
+{
+    size_t seq;
+    void*  value;
+} mpmc_cell_t;
+
+// Defines a bounded lock-free circular buffer for any number of producer and
+// consumer threads, after Dmitry Vyukov's bounded MPMC queue. Producers and
+// consumers claim positions with a compare-and-swap on their own index and
+// hand slots to each other through the per-slot sequence numbers, so a full
+// or empty check never needs a shared size field.
+typedef struct mpmc_queue_t
+{
+    char         pad0[CHAN_CACHE_LINE];
+
+    // Producer-owned.
+    size_t       enqueue_pos;
+    char         pad1[CHAN_CACHE_LINE - sizeof(size_t)];
+
+    // Consumer-owned.
+    size_t       dequeue_pos;
+    char         pad2[CHAN_CACHE_LINE - sizeof(size_t)];
+
+    // Read-only after initialization. There are mask + 1 slots, a power of
+    // two that may be more than capacity.
+    size_t       capacity;
+    size_t       mask;
+    mpmc_cell_t* cells;
+} mpmc_queue_t;
+
+// Allocates and returns a new queue. The capacity specifies the maximum
+// number of items that can be in the queue at one time. Returns NULL and sets
+// errno if initialization failed.
+mpmc_queue_t* mpmc_queue_init(size_t capacity);
+
+// Allocates and returns a new queue like mpmc_queue_init, placing it as
+// described by mem (see chan_mem_alloc), which may be NULL. Returns NULL and
+// sets errno if initialization failed.
+mpmc_queue_t* mpmc_queue_init_mem(size_t capacity, const chan_mem_t* mem);
+
+// Releases the queue resources.
+void mpmc_queue_dispose(mpmc_queue_t* queue);
+
+// Enqueues an item in the queue. Returns 0 if the add succeeded or -1 if the
+// queue is full.
+int mpmc_queue_push(mpmc_queue_t* queue, void* value);
+
+// Dequeues an item from the head of the queue into value. Returns 0 if an
+// item was removed or -1 if the queue is empty.
+int mpmc_queue_pop(mpmc_queue_t* queue, void** value);
+
+// Returns the number of items claimed in the queue. The result is a snapshot
+// and may be stale by the time it is used.
+size_t mpmc_queue_size(mpmc_queue_t* queue);
+
+#endif
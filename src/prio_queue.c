@@ -0,0 +1,154 @@
+#define _GNU_SOURCE
+
+#ifdef __APPLE__
+#define _XOPEN_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "prio_queue.h"
+
+// Returns the highest level holding an item. The queue must not be empty.
+static inline int prio_queue_top(prio_queue_t* queue)
+{
+    return 31 - __builtin_clz(queue->mask);
+}
+
+// Allocates and returns a new queue with the given number of levels, each of
+// which holds up to capacity items. Returns NULL and sets errno if
+// initialization failed.
+prio_queue_t* prio_queue_init(size_t capacity, int levels)
+{
+    if (capacity == 0 || levels < 1 || levels > PRIO_QUEUE_MAX_LEVELS)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    prio_queue_t* queue = (prio_queue_t*) calloc(1, sizeof(prio_queue_t));
+    if (!queue)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    for (int i = 0; i < levels; i++)
+    {
+        queue->levels[i] = queue_init(capacity);
+        if (!queue->levels[i])
+        {
+            int err = errno;
+            prio_queue_dispose(queue);
+            errno = err;
+            return NULL;
+        }
+    }
+
+    queue->level_count = levels;
+    queue->mask = 0;
+    queue->size = 0;
+    return queue;
+}
+
+// Releases the queue resources.
+void prio_queue_dispose(prio_queue_t* queue)
+{
+    for (int i = 0; i < PRIO_QUEUE_MAX_LEVELS && queue->levels[i]; i++)
+    {
+        queue_dispose(queue->levels[i]);
+    }
+    free(queue);
+}
+
+// Returns non-zero if the given level is at capacity.
+int prio_queue_full(prio_queue_t* queue, int level)
+{
+    queue_t* ring = queue->levels[level];
+    return ring->size >= ring->capacity;
+}
+
+// Enqueues an item at the given level. Returns 0 if the add succeeded or -1
+// if it failed. If -1 is returned, errno will be set.
+int prio_queue_add(prio_queue_t* queue, int level, void* value)
+{
+    if (queue_add(queue->levels[level], value) != 0)
+    {
+        return -1;
+    }
+    queue->mask |= (uint32_t) 1 << level;
+    __atomic_store_n(&queue->size, queue->size + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Dequeues the oldest item of the highest non-empty level. Returns NULL if
+// the queue is empty.
+void* prio_queue_remove(prio_queue_t* queue)
+{
+    if (queue->mask == 0)
+    {
+        return NULL;
+    }
+
+    int level = prio_queue_top(queue);
+    queue_t* ring = queue->levels[level];
+    void* value = queue_remove(ring);
+    if (ring->size == 0)
+    {
+        queue->mask &= ~((uint32_t) 1 << level);
+    }
+    __atomic_store_n(&queue->size, queue->size - 1, __ATOMIC_RELAXED);
+    return value;
+}
+
+// Dequeues the oldest item of the given level. Returns NULL if that level is
+// empty.
+void* prio_queue_remove_level(prio_queue_t* queue, int level)
+{
+    queue_t* ring = queue->levels[level];
+    if (ring->size == 0)
+    {
+        return NULL;
+    }
+
+    void* value = queue_remove(ring);
+    if (ring->size == 0)
+    {
+        queue->mask &= ~((uint32_t) 1 << level);
+    }
+    __atomic_store_n(&queue->size, queue->size - 1, __ATOMIC_RELAXED);
+    return value;
+}
+
+// Enqueues up to count items from values at the given level, stopping when
+// it is full. Returns the number of items added.
+int prio_queue_add_many(prio_queue_t* queue, int level, void* values[],
+    int count)
+{
+    int added = queue_add_many(queue->levels[level], values, count);
+    if (added > 0)
+    {
+        queue->mask |= (uint32_t) 1 << level;
+        __atomic_store_n(&queue->size, queue->size + added, __ATOMIC_RELAXED);
+    }
+    return added;
+}
+
+// Dequeues up to count items into values, draining higher levels before lower
+// ones. Returns the number of items removed.
+int prio_queue_remove_many(prio_queue_t* queue, void* values[], int count)
+{
+    int removed = 0;
+    while (removed < count && queue->mask != 0)
+    {
+        int level = prio_queue_top(queue);
+        queue_t* ring = queue->levels[level];
+        removed += queue_remove_many(ring, &values[removed], count - removed);
+        if (ring->size == 0)
+        {
+            queue->mask &= ~((uint32_t) 1 << level);
+        }
+    }
+    __atomic_store_n(&queue->size, queue->size - removed, __ATOMIC_RELAXED);
+    return removed;
+}
@@ -0,0 +1,58 @@
+#ifndef prio_queue_h
+#define prio_queue_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "queue.h"
+
+// Maximum number of priority levels a prio_queue_t can serve.
+#define PRIO_QUEUE_MAX_LEVELS 32
+
+// Defines a bounded queue serving a small, fixed number of priority levels.
+// Each level is its own FIFO ring of the same capacity, so a burst at one
+// level can never keep a more urgent item from being enqueued. Higher levels
+// are more urgent. A bitmask with one bit per non-empty level lets the
+// highest non-empty level be found with a single count-leading-zeros. size is
+// read without the channel lock, so it is only changed with atomic stores.
+typedef struct prio_queue_t
+{
+    int      level_count;
+    uint32_t mask;
+    size_t   size;
+    queue_t* levels[PRIO_QUEUE_MAX_LEVELS];
+} prio_queue_t;
+
+// Allocates and returns a new queue with the given number of levels, each of
+// which holds up to capacity items. Returns NULL and sets errno if
+// initialization failed.
+prio_queue_t* prio_queue_init(size_t capacity, int levels);
+
+// Releases the queue resources.
+void prio_queue_dispose(prio_queue_t* queue);
+
+// Returns non-zero if the given level is at capacity.
+int prio_queue_full(prio_queue_t* queue, int level);
+
+// Enqueues an item at the given level. Returns 0 if the add succeeded or -1
+// if it failed. If -1 is returned, errno will be set.
+int prio_queue_add(prio_queue_t* queue, int level, void* value);
+
+// Dequeues the oldest item of the highest non-empty level. Returns NULL if
+// the queue is empty.
+void* prio_queue_remove(prio_queue_t* queue);
+
+// Dequeues the oldest item of the given level. Returns NULL if that level is
+// empty.
+void* prio_queue_remove_level(prio_queue_t* queue, int level);
+
+// Enqueues up to count items from values at the given level, stopping when
+// it is full. Returns the number of items added.
+int prio_queue_add_many(prio_queue_t* queue, int level, void* values[],
+    int count);
+
+// Dequeues up to count items into values, draining higher levels before lower
+// ones. Returns the number of items removed.
+int prio_queue_remove_many(prio_queue_t* queue, void* values[], int count);
+
+#endif
@@ -9,6 +9,7 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "queue.h"
 
@@ -29,34 +30,78 @@ static inline int queue_at_capacity(queue_t* queue)
 // initialization failed.
 queue_t* queue_init(size_t capacity)
 {
-    if (capacity > INT_MAX / sizeof(void*))
+    return queue_init_mem(capacity, 0, NULL);
+}
+
+// Allocates and returns a new queue which stores elements of elem_size bytes
+// by value. A capacity greater than INT_MAX / elem_size is considered an
+// error. Returns NULL if initialization failed.
+queue_t* queue_init_sized(size_t capacity, size_t elem_size)
+{
+    if (elem_size == 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    return queue_init_mem(capacity, elem_size, NULL);
+}
+
+// Allocates and returns a new queue like queue_init_sized, placing its buffer
+// as described by mem (see chan_mem_alloc), which may be NULL. An elem_size
+// of 0 makes a queue of pointers. Returns NULL if initialization failed.
+queue_t* queue_init_mem(size_t capacity, size_t elem_size,
+    const chan_mem_t* mem)
+{
+    size_t slot_size = elem_size ? elem_size : sizeof(void*);
+    if (capacity > INT_MAX / slot_size)
     {
         errno = EINVAL;
         return NULL;
     }
 
     queue_t* queue = (queue_t*) malloc(sizeof(queue_t));
-    void**   data  = (void**) malloc(capacity * sizeof(void*));
+    void**   data  = (void**) chan_mem_alloc(capacity * slot_size, mem);
     if (!queue || !data)
     {
+        int err = errno;
         // In case of free(NULL), no operation is performed.
         free(queue);
-        free(data);   
-        errno = ENOMEM;
+        chan_mem_free(data);
+        errno = err;
         return NULL;
     }
 
+    queue_init_buf(queue, capacity, elem_size, data);
+    return queue;
+}
+
+// Initializes a queue of capacity elements of elem_size bytes, or of pointers
+// if elem_size is 0, in storage provided by the caller, so it can share an
+// allocation with its owner. data must hold capacity elements. Such a queue
+// must not be passed to queue_dispose. Returns 0 on success or -1 with errno
+// set to EINVAL if the capacity is too large.
+int queue_init_buf(queue_t* queue, size_t capacity, size_t elem_size,
+    void* data)
+{
+    size_t slot_size = elem_size ? elem_size : sizeof(void*);
+    if (capacity > INT_MAX / slot_size)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
     queue->size = 0;
     queue->next = 0;
     queue->capacity = capacity;
-    queue->data = data;
-    return queue;
+    queue->elem_size = elem_size;
+    queue->data = (void**) data;
+    return 0;
 }
 
 // Releases the queue resources.
 void queue_dispose(queue_t* queue)
 {
-    free(queue->data);
+    chan_mem_free(queue->data);
     free(queue);
 }
 
@@ -78,7 +123,7 @@ int queue_add(queue_t* queue, void* value)
 
     queue->data[pos] = value;
 
-    queue->size++;
+    __atomic_store_n(&queue->size, queue->size + 1, __ATOMIC_RELAXED);
     return 0;
 }
 
@@ -92,7 +137,7 @@ void* queue_remove(queue_t* queue)
     {
         value = queue->data[queue->next];
         queue->next++;
-        queue->size--;
+        __atomic_store_n(&queue->size, queue->size - 1, __ATOMIC_RELAXED);
         if (queue->next >= queue->capacity)
         {
             queue->next -= queue->capacity;
@@ -102,6 +147,105 @@ void* queue_remove(queue_t* queue)
     return value;
 }
 
+// Enqueues up to count items from values in the queue, stopping when it is
+// full. Returns the number of items added.
+int queue_add_many(queue_t* queue, void* values[], int count)
+{
+    int space = queue->capacity - queue->size;
+    if (count > space)
+    {
+        count = space;
+    }
+
+    int pos = queue->next + queue->size;
+    if (pos >= queue->capacity)
+    {
+        pos -= queue->capacity;
+    }
+
+    // Copy up to the end of the buffer, then wrap around to the front.
+    int first = queue->capacity - pos;
+    if (first > count)
+    {
+        first = count;
+    }
+    memcpy(&queue->data[pos], values, first * sizeof(void*));
+    memcpy(queue->data, &values[first], (count - first) * sizeof(void*));
+
+    __atomic_store_n(&queue->size, queue->size + count, __ATOMIC_RELAXED);
+    return count;
+}
+
+// Dequeues up to count items from the head of the queue into values. Returns
+// the number of items removed.
+int queue_remove_many(queue_t* queue, void* values[], int count)
+{
+    if (count > queue->size)
+    {
+        count = queue->size;
+    }
+
+    // Copy up to the end of the buffer, then wrap around to the front.
+    int first = queue->capacity - queue->next;
+    if (first > count)
+    {
+        first = count;
+    }
+    memcpy(values, &queue->data[queue->next], first * sizeof(void*));
+    memcpy(&values[first], queue->data, (count - first) * sizeof(void*));
+
+    queue->next += count;
+    if (queue->next >= queue->capacity)
+    {
+        queue->next -= queue->capacity;
+    }
+    __atomic_store_n(&queue->size, queue->size - count, __ATOMIC_RELAXED);
+    return count;
+}
+
+// Copies an element into the tail of a sized queue. Returns 0 if the add
+// succeeded or -1 if it failed. If -1 is returned, errno will be set.
+int queue_add_elem(queue_t* queue, const void* elem)
+{
+    if (queue_at_capacity(queue))
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    int pos = queue->next + queue->size;
+    if (pos >= queue->capacity)
+    {
+       pos -= queue->capacity;
+    }
+
+    memcpy((char*) queue->data + (size_t) pos * queue->elem_size, elem,
+        queue->elem_size);
+
+    __atomic_store_n(&queue->size, queue->size + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Copies the element at the head of a sized queue into elem and removes it.
+// Returns 0 if an element was removed or -1 if the queue is empty.
+int queue_remove_elem(queue_t* queue, void* elem)
+{
+    if (queue->size == 0)
+    {
+        return -1;
+    }
+
+    memcpy(elem, (char*) queue->data + (size_t) queue->next * queue->elem_size,
+        queue->elem_size);
+    queue->next++;
+    __atomic_store_n(&queue->size, queue->size - 1, __ATOMIC_RELAXED);
+    if (queue->next >= queue->capacity)
+    {
+        queue->next -= queue->capacity;
+    }
+    return 0;
+}
+
 // Returns, but does not remove, the head of the queue. Returns NULL if the
 // queue is empty.
 void* queue_peek(queue_t* queue)
@@ -1,13 +1,20 @@
 #ifndef queue_h
 #define queue_h
 
+#include <stddef.h>
 
-// Defines a circular buffer which acts as a FIFO queue.
+#include "chan_mem.h"
+
+// Defines a circular buffer which acts as a FIFO queue. A queue either holds
+// pointers or, if elem_size is non-zero, fixed-size elements stored by value
+// in data. Channels read size without their lock, so it is only changed with
+// relaxed atomic stores.
 typedef struct queue_t
 {
     int    size;
     int    next;
     int    capacity;
+    int    elem_size;
     void** data;
 } queue_t;
 
@@ -17,6 +24,25 @@ typedef struct queue_t
 // initialization failed.
 queue_t* queue_init(size_t capacity);
 
+// Allocates and returns a new queue which stores elements of elem_size bytes
+// by value. A capacity greater than INT_MAX / elem_size is considered an
+// error. Returns NULL if initialization failed.
+queue_t* queue_init_sized(size_t capacity, size_t elem_size);
+
+// Allocates and returns a new queue like queue_init_sized, placing its buffer
+// as described by mem (see chan_mem_alloc), which may be NULL. An elem_size
+// of 0 makes a queue of pointers. Returns NULL if initialization failed.
+queue_t* queue_init_mem(size_t capacity, size_t elem_size,
+    const chan_mem_t* mem);
+
+// Initializes a queue of capacity elements of elem_size bytes, or of pointers
+// if elem_size is 0, in storage provided by the caller, so it can share an
+// allocation with its owner. data must hold capacity elements. Such a queue
+// must not be passed to queue_dispose. Returns 0 on success or -1 with errno
+// set to EINVAL if the capacity is too large.
+int queue_init_buf(queue_t* queue, size_t capacity, size_t elem_size,
+    void* data);
+
 // Releases the queue resources.
 void queue_dispose(queue_t* queue);
 
@@ -28,6 +54,22 @@ int queue_add(queue_t* queue, void* value);
 // empty.
 void* queue_remove(queue_t* queue);
 
+// Enqueues up to count items from values in the queue, stopping when it is
+// full. Returns the number of items added.
+int queue_add_many(queue_t* queue, void* values[], int count);
+
+// Dequeues up to count items from the head of the queue into values. Returns
+// the number of items removed.
+int queue_remove_many(queue_t* queue, void* values[], int count);
+
+// Copies an element into the tail of a sized queue. Returns 0 if the add
+// succeeded or -1 if it failed. If -1 is returned, errno will be set.
+int queue_add_elem(queue_t* queue, const void* elem);
+
+// Copies the element at the head of a sized queue into elem and removes it.
+// Returns 0 if an element was removed or -1 if the queue is empty.
+int queue_remove_elem(queue_t* queue, void* elem);
+
 // Returns, but does not remove, the head of the queue. Returns NULL if the
 // queue is empty.
 void* queue_peek(queue_t*);
@@ -0,0 +1,216 @@
+#define _GNU_SOURCE
+
+#ifdef __APPLE__
+#define _XOPEN_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "seg_queue.h"
+
+// Returns a segment to use as the new tail, reusing a freed one if there is
+// one. Returns NULL and sets errno if allocation failed.
+static seg_queue_segment_t* seg_queue_segment_get(seg_queue_t* queue)
+{
+    seg_queue_segment_t* segment = queue->free;
+    if (segment)
+    {
+        queue->free = segment->next;
+        queue->free_count--;
+    }
+    else
+    {
+        segment = (seg_queue_segment_t*) malloc(sizeof(seg_queue_segment_t));
+        if (!segment)
+        {
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    segment->next = NULL;
+    return segment;
+}
+
+// Keeps an emptied segment on the freelist, or frees it if the list is full.
+static void seg_queue_segment_put(seg_queue_t* queue,
+    seg_queue_segment_t* segment)
+{
+    if (queue->free_count >= SEG_QUEUE_FREELIST_SIZE)
+    {
+        free(segment);
+        return;
+    }
+
+    segment->next = queue->free;
+    queue->free = segment;
+    queue->free_count++;
+}
+
+// Makes sure the tail segment has a free slot. Returns 0 if it does or -1 if
+// a new segment could not be allocated.
+static int seg_queue_reserve(seg_queue_t* queue)
+{
+    if (queue->tail && queue->tail_pos < SEG_QUEUE_SEGMENT_SIZE)
+    {
+        return 0;
+    }
+
+    seg_queue_segment_t* segment = seg_queue_segment_get(queue);
+    if (!segment)
+    {
+        return -1;
+    }
+
+    if (queue->tail)
+    {
+        queue->tail->next = segment;
+    }
+    else
+    {
+        queue->head = segment;
+        queue->head_pos = 0;
+    }
+    queue->tail = segment;
+    queue->tail_pos = 0;
+    return 0;
+}
+
+// Moves the head past n items of its segment, releasing the segment once it
+// is used up and others follow it.
+static void seg_queue_advance(seg_queue_t* queue, int n)
+{
+    queue->head_pos += n;
+    __atomic_store_n(&queue->size, queue->size - n, __ATOMIC_RELAXED);
+    if (queue->size == 0)
+    {
+        // Only one segment is left, start over at its front.
+        queue->head_pos = 0;
+        queue->tail_pos = 0;
+    }
+    else if (queue->head_pos == SEG_QUEUE_SEGMENT_SIZE)
+    {
+        seg_queue_segment_t* segment = queue->head;
+        queue->head = segment->next;
+        queue->head_pos = 0;
+        seg_queue_segment_put(queue, segment);
+    }
+}
+
+// Allocates and returns a new, empty queue. No segment is allocated until the
+// first item is added. Returns NULL if initialization failed.
+seg_queue_t* seg_queue_init(void)
+{
+    seg_queue_t* queue = (seg_queue_t*) malloc(sizeof(seg_queue_t));
+    if (!queue)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->head_pos = 0;
+    queue->tail_pos = 0;
+    queue->size = 0;
+    queue->free = NULL;
+    queue->free_count = 0;
+    return queue;
+}
+
+// Releases the queue resources.
+void seg_queue_dispose(seg_queue_t* queue)
+{
+    seg_queue_segment_t* lists[2] = {queue->head, queue->free};
+    int i;
+    for (i = 0; i < 2; i++)
+    {
+        seg_queue_segment_t* segment = lists[i];
+        while (segment)
+        {
+            seg_queue_segment_t* next = segment->next;
+            free(segment);
+            segment = next;
+        }
+    }
+    free(queue);
+}
+
+// Enqueues an item in the queue. Returns 0 if the add succeeded or -1 if it
+// failed. If -1 is returned, errno will be set.
+int seg_queue_add(seg_queue_t* queue, void* value)
+{
+    if (seg_queue_reserve(queue) != 0)
+    {
+        return -1;
+    }
+
+    queue->tail->data[queue->tail_pos++] = value;
+    __atomic_store_n(&queue->size, queue->size + 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+// Dequeues an item from the head of the queue. Returns NULL if the queue is
+// empty.
+void* seg_queue_remove(seg_queue_t* queue)
+{
+    if (queue->size == 0)
+    {
+        return NULL;
+    }
+
+    void* value = queue->head->data[queue->head_pos];
+    seg_queue_advance(queue, 1);
+    return value;
+}
+
+// Enqueues count items from values in the queue. Returns the number of items
+// added, which is less than count only if a segment could not be allocated.
+int seg_queue_add_many(seg_queue_t* queue, void* values[], int count)
+{
+    int added = 0;
+    while (added < count)
+    {
+        if (seg_queue_reserve(queue) != 0)
+        {
+            break;
+        }
+
+        // Fill the rest of the tail segment.
+        int n = SEG_QUEUE_SEGMENT_SIZE - queue->tail_pos;
+        if (n > count - added)
+        {
+            n = count - added;
+        }
+        memcpy(&queue->tail->data[queue->tail_pos], &values[added],
+            n * sizeof(void*));
+        queue->tail_pos += n;
+        __atomic_store_n(&queue->size, queue->size + n, __ATOMIC_RELAXED);
+        added += n;
+    }
+    return added;
+}
+
+// Dequeues up to count items from the head of the queue into values. Returns
+// the number of items removed.
+int seg_queue_remove_many(seg_queue_t* queue, void* values[], int count)
+{
+    int removed = 0;
+    while (removed < count && queue->size > 0)
+    {
+        // Take what is left of the head segment.
+        int n = (queue->head == queue->tail ?
+            queue->tail_pos : SEG_QUEUE_SEGMENT_SIZE) - queue->head_pos;
+        if (n > count - removed)
+        {
+            n = count - removed;
+        }
+        memcpy(&values[removed], &queue->head->data[queue->head_pos],
+            n * sizeof(void*));
+        removed += n;
+        seg_queue_advance(queue, n);
+    }
+    return removed;
+}
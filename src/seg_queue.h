@@ -0,0 +1,59 @@
+#ifndef seg_queue_h
+#define seg_queue_h
+
+#include <stddef.h>
+
+// Number of items held by each segment of a seg_queue_t.
+#define SEG_QUEUE_SEGMENT_SIZE 256
+
+// Number of emptied segments a seg_queue_t keeps for reuse instead of
+// freeing them.
+#define SEG_QUEUE_FREELIST_SIZE 4
+
+// A fixed-size block of slots in a seg_queue_t.
+typedef struct seg_queue_segment_t
+{
+    struct seg_queue_segment_t* next;
+    void*                       data[SEG_QUEUE_SEGMENT_SIZE];
+} seg_queue_segment_t;
+
+// Defines an unbounded FIFO queue stored as a linked list of fixed-size
+// segments. Segments are allocated only when the tail one fills up and are
+// returned to a small freelist as the head moves past them, so memory tracks
+// the number of queued items and adding never copies existing items. size is
+// read without the channel lock, so it is only changed with atomic stores.
+typedef struct seg_queue_t
+{
+    seg_queue_segment_t* head;
+    seg_queue_segment_t* tail;
+    int                  head_pos;
+    int                  tail_pos;
+    size_t               size;
+    seg_queue_segment_t* free;
+    int                  free_count;
+} seg_queue_t;
+
+// Allocates and returns a new, empty queue. No segment is allocated until the
+// first item is added. Returns NULL if initialization failed.
+seg_queue_t* seg_queue_init(void);
+
+// Releases the queue resources.
+void seg_queue_dispose(seg_queue_t* queue);
+
+// Enqueues an item in the queue. Returns 0 if the add succeeded or -1 if it
+// failed. If -1 is returned, errno will be set.
+int seg_queue_add(seg_queue_t* queue, void* value);
+
+// Dequeues an item from the head of the queue. Returns NULL if the queue is
+// empty.
+void* seg_queue_remove(seg_queue_t* queue);
+
+// Enqueues count items from values in the queue. Returns the number of items
+// added, which is less than count only if a segment could not be allocated.
+int seg_queue_add_many(seg_queue_t* queue, void* values[], int count);
+
+// Dequeues up to count items from the head of the queue into values. Returns
+// the number of items removed.
+int seg_queue_remove_many(seg_queue_t* queue, void* values[], int count);
+
+#endif
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+
+#ifdef __APPLE__
+#define _XOPEN_SOURCE
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include "spsc_queue.h"
+
+// Allocates and returns a new queue. The capacity specifies the maximum
+// number of items that can be in the queue at one time. Returns NULL and sets
+// errno if initialization failed.
+spsc_queue_t* spsc_queue_init(size_t capacity)
+{
+    return spsc_queue_init_mem(capacity, NULL);
+}
+
+// Allocates and returns a new queue like spsc_queue_init, placing it as
+// described by mem (see chan_mem_alloc), which may be NULL. Returns NULL and
+// sets errno if initialization failed.
+spsc_queue_t* spsc_queue_init_mem(size_t capacity, const chan_mem_t* mem)
+{
+    if (capacity == 0 || capacity > INT_MAX / sizeof(void*))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // Round the number of slots up to a power of two so indices can be
+    // wrapped with a mask instead of a division. The logical capacity is
+    // still enforced on push.
+    size_t slots = 1;
+    while (slots < capacity)
+    {
+        slots <<= 1;
+    }
+
+    // The padding between the indices only keeps them apart if the queue
+    // starts on a cache line.
+    spsc_queue_t* queue = (spsc_queue_t*) chan_mem_alloc(sizeof(spsc_queue_t),
+        mem);
+    void**        data  = (void**) chan_mem_alloc(slots * sizeof(void*), mem);
+    if (!queue || !data)
+    {
+        int err = errno;
+        chan_mem_free(queue);
+        chan_mem_free(data);
+        errno = err;
+        return NULL;
+    }
+
+    queue->head = 0;
+    queue->cached_tail = 0;
+    queue->tail = 0;
+    queue->cached_head = 0;
+    queue->capacity = capacity;
+    queue->mask = slots - 1;
+    queue->data = data;
+    return queue;
+}
+
+// Releases the queue resources.
+void spsc_queue_dispose(spsc_queue_t* queue)
+{
+    chan_mem_free(queue->data);
+    chan_mem_free(queue);
+}
+
+// Enqueues an item in the queue. Must only be called by the producer. Returns
+// 0 if the add succeeded or -1 if the queue is full.
+int spsc_queue_push(spsc_queue_t* queue, void* value)
+{
+    size_t tail = queue->tail;
+    if (tail - queue->cached_head >= queue->capacity)
+    {
+        // Looks full, refresh our view of the consumer.
+        queue->cached_head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+        if (tail - queue->cached_head >= queue->capacity)
+        {
+            return -1;
+        }
+    }
+
+    queue->data[tail & queue->mask] = value;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Dequeues an item from the head of the queue into value. Must only be called
+// by the consumer. Returns 0 if an item was removed or -1 if the queue is
+// empty.
+int spsc_queue_pop(spsc_queue_t* queue, void** value)
+{
+    size_t head = queue->head;
+    if (head == queue->cached_tail)
+    {
+        // Looks empty, refresh our view of the producer.
+        queue->cached_tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+        if (head == queue->cached_tail)
+        {
+            return -1;
+        }
+    }
+
+    *value = queue->data[head & queue->mask];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Returns the number of items in the queue. The result is a snapshot and may
+// be stale by the time it is used.
+size_t spsc_queue_size(spsc_queue_t* queue)
+{
+    size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+    size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+    return tail - head;
+}
@@ -0,0 +1,63 @@
+#ifndef spsc_queue_h
+#define spsc_queue_h
+
+#include <stddef.h>
+
+#include "chan_mem.h"
+
+// Assumed size of a CPU cache line. Indices written by different threads are
+// kept at least this far apart so they never share a line.
+#define CHAN_CACHE_LINE 64
+
+// Defines a wait-free circular buffer for exactly one producer thread and one
+// consumer thread. The producer only writes tail and the consumer only writes
+// head, so neither side takes a lock. Each side also caches the last value it
+// read of the other side's index to avoid touching that cache line on every
+// operation.
+typedef struct spsc_queue_t
+{
+    char   pad0[CHAN_CACHE_LINE];
+
+    // Consumer-owned.
+    size_t head;
+    size_t cached_tail;
+    char   pad1[CHAN_CACHE_LINE - 2 * sizeof(size_t)];
+
+    // Producer-owned.
+    size_t tail;
+    size_t cached_head;
+    char   pad2[CHAN_CACHE_LINE - 2 * sizeof(size_t)];
+
+    // Read-only after initialization.
+    size_t capacity;
+    size_t mask;
+    void** data;
+} spsc_queue_t;
+
+// Allocates and returns a new queue. The capacity specifies the maximum
+// number of items that can be in the queue at one time. Returns NULL and sets
+// errno if initialization failed.
+spsc_queue_t* spsc_queue_init(size_t capacity);
+
+// Allocates and returns a new queue like spsc_queue_init, placing it as
+// described by mem (see chan_mem_alloc), which may be NULL. Returns NULL and
+// sets errno if initialization failed.
+spsc_queue_t* spsc_queue_init_mem(size_t capacity, const chan_mem_t* mem);
+
+// Releases the queue resources.
+void spsc_queue_dispose(spsc_queue_t* queue);
+
+// Enqueues an item in the queue. Must only be called by the producer. Returns
+// 0 if the add succeeded or -1 if the queue is full.
+int spsc_queue_push(spsc_queue_t* queue, void* value);
+
+// Dequeues an item from the head of the queue into value. Must only be called
+// by the consumer. Returns 0 if an item was removed or -1 if the queue is
+// empty.
+int spsc_queue_pop(spsc_queue_t* queue, void** value);
+
+// Returns the number of items in the queue. The result is a snapshot and may
+// be stale by the time it is used.
+size_t spsc_queue_size(spsc_queue_t* queue);
+
+#endif
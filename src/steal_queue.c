@@ -0,0 +1,146 @@
+#define _GNU_SOURCE
+
+#ifdef __APPLE__
+#define _XOPEN_SOURCE
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+
+#include "steal_queue.h"
+
+// Allocates and returns a new deque. The capacity is rounded up to the next
+// power of two. Returns NULL and sets errno if initialization failed.
+steal_queue_t* steal_queue_init(size_t capacity)
+{
+    return steal_queue_init_mem(capacity, NULL);
+}
+
+// Allocates and returns a new deque like steal_queue_init, placing it as
+// described by mem (see chan_mem_alloc), which may be NULL. Returns NULL and
+// sets errno if initialization failed.
+steal_queue_t* steal_queue_init_mem(size_t capacity, const chan_mem_t* mem)
+{
+    if (capacity == 0 || capacity > INT_MAX / sizeof(void*))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t slots = 1;
+    while (slots < capacity)
+    {
+        slots <<= 1;
+    }
+
+    steal_queue_t* queue = (steal_queue_t*) chan_mem_alloc(
+        sizeof(steal_queue_t), mem);
+    void**         data  = (void**) chan_mem_alloc(slots * sizeof(void*), mem);
+    if (!queue || !data)
+    {
+        int err = errno;
+        chan_mem_free(queue);
+        chan_mem_free(data);
+        errno = err;
+        return NULL;
+    }
+
+    queue->top = 0;
+    queue->bottom = 0;
+    queue->capacity = slots;
+    queue->mask = slots - 1;
+    queue->data = data;
+    return queue;
+}
+
+// Releases the deque resources.
+void steal_queue_dispose(steal_queue_t* queue)
+{
+    chan_mem_free(queue->data);
+    chan_mem_free(queue);
+}
+
+// Pushes an item onto the bottom of the deque. Must only be called by the
+// owner. Returns 0 if the push succeeded or -1 if the deque is full.
+int steal_queue_push(steal_queue_t* queue, void* value)
+{
+    long bottom = queue->bottom;
+    long top = __atomic_load_n(&queue->top, __ATOMIC_ACQUIRE);
+    if ((size_t) (bottom - top) >= queue->capacity)
+    {
+        return -1;
+    }
+
+    // Thieves read the slot after seeing the new bottom.
+    __atomic_store_n(&queue->data[bottom & queue->mask], value,
+        __ATOMIC_RELAXED);
+    __atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Pops the most recently pushed item from the bottom of the deque into value.
+// Must only be called by the owner. Returns 0 if an item was removed or -1 if
+// the deque is empty.
+int steal_queue_pop(steal_queue_t* queue, void** value)
+{
+    // Claim the bottom item before looking at top, so a thief either sees the
+    // claim or we see its steal.
+    long bottom = queue->bottom - 1;
+    __atomic_store_n(&queue->bottom, bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long top = __atomic_load_n(&queue->top, __ATOMIC_RELAXED);
+
+    if (top > bottom)
+    {
+        // Empty.
+        __atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+
+    *value = __atomic_load_n(&queue->data[bottom & queue->mask],
+        __ATOMIC_RELAXED);
+    if (top == bottom)
+    {
+        // Last item, race the thieves for it.
+        int won = __atomic_compare_exchange_n(&queue->top, &top, top + 1, 0,
+            __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+        __atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return won ? 0 : -1;
+    }
+    return 0;
+}
+
+// Takes the oldest item from the top of the deque into value. May be called
+// by any thread. Returns 1 if an item was taken, 0 if the deque is empty or -1
+// if another thread took the item first, in which case it is worth trying
+// again.
+int steal_queue_steal(steal_queue_t* queue, void** value)
+{
+    long top = __atomic_load_n(&queue->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long bottom = __atomic_load_n(&queue->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom)
+    {
+        return 0;
+    }
+
+    void* read = __atomic_load_n(&queue->data[top & queue->mask],
+        __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&queue->top, &top, top + 1, 0,
+        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+        return -1;
+    }
+    *value = read;
+    return 1;
+}
+
+// Returns the number of items in the deque. The result is a snapshot and may
+// be stale by the time it is used.
+size_t steal_queue_size(steal_queue_t* queue)
+{
+    long top = __atomic_load_n(&queue->top, __ATOMIC_ACQUIRE);
+    long bottom = __atomic_load_n(&queue->bottom, __ATOMIC_ACQUIRE);
+    return bottom > top ? (size_t) (bottom - top) : 0;
+}
@@ -0,0 +1,64 @@
+#ifndef steal_queue_h
+#define steal_queue_h
+
+#include <stddef.h>
+
+#include "chan_mem.h"
+#include "spsc_queue.h"
+
+// Defines a Chase-Lev work-stealing deque. One owner thread pushes and pops
+// at the bottom without taking a lock, and only synchronizes with other
+// threads when the deque is down to its last item. Any number of thieves take
+// items from the top, racing each other and the owner with a compare and swap.
+// The capacity is fixed; the owner must find somewhere else for items that do
+// not fit.
+typedef struct steal_queue_t
+{
+    char   pad0[CHAN_CACHE_LINE];
+
+    // Advanced by thieves, and by the owner taking the last item.
+    long   top;
+    char   pad1[CHAN_CACHE_LINE - sizeof(long)];
+
+    // Owner-owned, read by thieves.
+    long   bottom;
+    char   pad2[CHAN_CACHE_LINE - sizeof(long)];
+
+    // Read-only after initialization.
+    size_t capacity;
+    size_t mask;
+    void** data;
+} steal_queue_t;
+
+// Allocates and returns a new deque. The capacity is rounded up to the next
+// power of two. Returns NULL and sets errno if initialization failed.
+steal_queue_t* steal_queue_init(size_t capacity);
+
+// Allocates and returns a new deque like steal_queue_init, placing it as
+// described by mem (see chan_mem_alloc), which may be NULL. Returns NULL and
+// sets errno if initialization failed.
+steal_queue_t* steal_queue_init_mem(size_t capacity, const chan_mem_t* mem);
+
+// Releases the deque resources.
+void steal_queue_dispose(steal_queue_t* queue);
+
+// Pushes an item onto the bottom of the deque. Must only be called by the
+// owner. Returns 0 if the push succeeded or -1 if the deque is full.
+int steal_queue_push(steal_queue_t* queue, void* value);
+
+// Pops the most recently pushed item from the bottom of the deque into value.
+// Must only be called by the owner. Returns 0 if an item was removed or -1 if
+// the deque is empty.
+int steal_queue_pop(steal_queue_t* queue, void** value);
+
+// Takes the oldest item from the top of the deque into value. May be called
+// by any thread. Returns 1 if an item was taken, 0 if the deque is empty or -1
+// if another thread took the item first, in which case it is worth trying
+// again.
+int steal_queue_steal(steal_queue_t* queue, void** value);
+
+// Returns the number of items in the deque. The result is a snapshot and may
+// be stale by the time it is used.
+size_t steal_queue_size(steal_queue_t* queue);
+
+#endif